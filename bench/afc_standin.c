@@ -0,0 +1,837 @@
+/*
+ * afc_standin.c
+ * Stand-in for the parts of libimobiledevice used by ifuse, serving AFC
+ * requests from a local directory with simulated latency and bandwidth.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ifuse-bench is ifuse linked against this file instead of libimobiledevice.
+ * It is configured through the environment:
+ *
+ *   IFUSE_STANDIN_ROOT       directory that plays the device's AFC root (required)
+ *   IFUSE_STANDIN_LATENCY    round trip time of every request in microseconds
+ *   IFUSE_STANDIN_BANDWIDTH  link bandwidth in bytes per second, shared by
+ *                            all connections (0 means unlimited)
+ *
+ * Each AFC client handles one request at a time, like a real AFC connection.
+ * house_arrest vends the same directory as the container of every app, so
+ * --documents mounts its Documents subdirectory.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/file.h>
+#include <sys/time.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/house_arrest.h>
+#include <libimobiledevice/installation_proxy.h>
+
+#define STANDIN_UDID "0000000000000000000000000000000000standin"
+
+struct idevice_private {
+	char *udid;
+};
+
+struct lockdownd_client_private {
+	int unused;
+};
+
+struct afc_client_private {
+	pthread_mutex_t mutex;
+};
+
+struct house_arrest_client_private {
+	int vended;
+};
+
+static struct {
+	pthread_once_t once;
+	char root[PATH_MAX];
+	unsigned long latency;
+	unsigned long long bandwidth;
+	pthread_mutex_t link;
+} standin = { PTHREAD_ONCE_INIT, "", 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static void standin_setup(void)
+{
+	const char *val = getenv("IFUSE_STANDIN_ROOT");
+
+	if (!val || !*val) {
+		fprintf(stderr, "ERROR: IFUSE_STANDIN_ROOT is not set\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!realpath(val, standin.root)) {
+		fprintf(stderr, "ERROR: IFUSE_STANDIN_ROOT %s: %s\n", val, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	val = getenv("IFUSE_STANDIN_LATENCY");
+	if (val)
+		standin.latency = strtoul(val, NULL, 10);
+	val = getenv("IFUSE_STANDIN_BANDWIDTH");
+	if (val)
+		standin.bandwidth = strtoull(val, NULL, 10);
+}
+
+/* simulates a request/response exchange that carries bytes of payload */
+static void standin_delay(size_t bytes)
+{
+	if (standin.latency > 0)
+		usleep(standin.latency);
+	if (standin.bandwidth > 0 && bytes > 0) {
+		/* the link is shared by all connections */
+		pthread_mutex_lock(&standin.link);
+		usleep((useconds_t)((unsigned long long)bytes * 1000000ULL / standin.bandwidth));
+		pthread_mutex_unlock(&standin.link);
+	}
+}
+
+static void standin_path(char *buf, size_t size, const char *path)
+{
+	while (*path == '/')
+		path++;
+	snprintf(buf, size, "%s/%s", standin.root, path);
+}
+
+static afc_error_t errno_to_afc_error(int e)
+{
+	switch (e) {
+	case 0: return AFC_E_SUCCESS;
+	case ENOENT: return AFC_E_OBJECT_NOT_FOUND;
+	case EISDIR: return AFC_E_OBJECT_IS_DIR;
+	case ENOTDIR: return AFC_E_READ_ERROR;
+	case ENOTEMPTY: return AFC_E_DIR_NOT_EMPTY;
+	case EEXIST: return AFC_E_OBJECT_EXISTS;
+	case EACCES:
+	case EPERM: return AFC_E_PERM_DENIED;
+	case EINVAL: return AFC_E_INVALID_ARG;
+	case ENOSPC: return AFC_E_NO_SPACE_LEFT;
+	case EBUSY: return AFC_E_OBJECT_BUSY;
+	case EMFILE: return AFC_E_NO_RESOURCES;
+	case ENOMEM: return AFC_E_NO_MEM;
+	default: return AFC_E_IO_ERROR;
+	}
+}
+
+#define AFC_BEGIN(client) \
+	if (!client) return AFC_E_INVALID_ARG; \
+	pthread_mutex_lock(&client->mutex)
+#define AFC_END(client, bytes, res) \
+	standin_delay(bytes); \
+	pthread_mutex_unlock(&client->mutex); \
+	return res
+
+static char **list_new(int n)
+{
+	return calloc(n + 1, sizeof(char*));
+}
+
+/* idevice */
+
+void idevice_set_debug_level(int level)
+{
+}
+
+idevice_error_t idevice_new_with_options(idevice_t *device, const char *udid, enum idevice_options options)
+{
+	struct idevice_private *dev;
+
+	pthread_once(&standin.once, standin_setup);
+	dev = calloc(1, sizeof(struct idevice_private));
+	if (!dev)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	dev->udid = strdup(udid ? udid : STANDIN_UDID);
+	*device = dev;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_new(idevice_t *device, const char *udid)
+{
+	return idevice_new_with_options(device, udid, IDEVICE_LOOKUP_USBMUX);
+}
+
+idevice_error_t idevice_free(idevice_t device)
+{
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+	free(device->udid);
+	free(device);
+	return IDEVICE_E_SUCCESS;
+}
+
+struct idevice_subscription_context {
+	idevice_event_cb_t callback;
+	void *user_data;
+	pthread_t thread;
+};
+
+/* usbmuxd reports attached devices right after subscribing */
+static void *standin_attach(void *arg)
+{
+	struct idevice_subscription_context *ctx = arg;
+	idevice_event_t event;
+
+	event.event = IDEVICE_DEVICE_ADD;
+	event.udid = STANDIN_UDID;
+	event.conn_type = CONNECTION_USBMUXD;
+	ctx->callback(&event, ctx->user_data);
+
+	return NULL;
+}
+
+idevice_error_t idevice_events_subscribe(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data)
+{
+	struct idevice_subscription_context *ctx;
+
+	pthread_once(&standin.once, standin_setup);
+	ctx = calloc(1, sizeof(struct idevice_subscription_context));
+	if (!ctx)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	ctx->callback = callback;
+	ctx->user_data = user_data;
+	if (pthread_create(&ctx->thread, NULL, standin_attach, ctx) != 0) {
+		free(ctx);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	*context = ctx;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_events_unsubscribe(idevice_subscription_context_t context)
+{
+	if (!context)
+		return IDEVICE_E_INVALID_ARG;
+	pthread_join(context->thread, NULL);
+	free(context);
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_get_udid(idevice_t device, char **udid)
+{
+	if (!device || !udid)
+		return IDEVICE_E_INVALID_ARG;
+	*udid = strdup(device->udid);
+	return IDEVICE_E_SUCCESS;
+}
+
+/* lockdownd */
+
+lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label)
+{
+	standin_delay(0);
+	*client = calloc(1, sizeof(struct lockdownd_client_private));
+	return (*client) ? LOCKDOWN_E_SUCCESS : LOCKDOWN_E_UNKNOWN_ERROR;
+}
+
+lockdownd_error_t lockdownd_client_free(lockdownd_client_t client)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+	free(client);
+	return LOCKDOWN_E_SUCCESS;
+}
+
+lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char *identifier, lockdownd_service_descriptor_t *service)
+{
+	if (!client || !identifier || !service)
+		return LOCKDOWN_E_INVALID_ARG;
+	if (strcmp(identifier, AFC_SERVICE_NAME) != 0 && strcmp(identifier, HOUSE_ARREST_SERVICE_NAME) != 0)
+		return LOCKDOWN_E_INVALID_SERVICE;
+	standin_delay(0);
+	*service = calloc(1, sizeof(struct lockdownd_service_descriptor));
+	if (!*service)
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	(*service)->port = 1;
+	(*service)->identifier = strdup(identifier);
+	return LOCKDOWN_E_SUCCESS;
+}
+
+lockdownd_error_t lockdownd_service_descriptor_free(lockdownd_service_descriptor_t service)
+{
+	if (service) {
+		free(service->identifier);
+		free(service);
+	}
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/* house_arrest, every app has the root as its container */
+
+house_arrest_error_t house_arrest_client_new(idevice_t device, lockdownd_service_descriptor_t service, house_arrest_client_t *client)
+{
+	if (!device || !service || !client)
+		return HOUSE_ARREST_E_INVALID_ARG;
+	standin_delay(0);
+	*client = calloc(1, sizeof(struct house_arrest_client_private));
+	return (*client) ? HOUSE_ARREST_E_SUCCESS : HOUSE_ARREST_E_CONN_FAILED;
+}
+
+house_arrest_error_t house_arrest_client_free(house_arrest_client_t client)
+{
+	if (!client)
+		return HOUSE_ARREST_E_INVALID_ARG;
+	free(client);
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+house_arrest_error_t house_arrest_send_command(house_arrest_client_t client, const char *command, const char *appid)
+{
+	if (!client || !command || !appid)
+		return HOUSE_ARREST_E_INVALID_ARG;
+	if (strcmp(command, "VendContainer") != 0 && strcmp(command, "VendDocuments") != 0)
+		return HOUSE_ARREST_E_INVALID_ARG;
+	standin_delay(0);
+	client->vended = 1;
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+house_arrest_error_t house_arrest_get_result(house_arrest_client_t client, plist_t *dict)
+{
+	if (!client || !dict || !client->vended)
+		return HOUSE_ARREST_E_INVALID_ARG;
+	*dict = plist_new_dict();
+	plist_dict_set_item(*dict, "Status", plist_new_string("Complete"));
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client, afc_client_t *afc_client)
+{
+	struct afc_client_private *afc;
+
+	if (!client || !client->vended || !afc_client)
+		return AFC_E_INVALID_ARG;
+
+	afc = calloc(1, sizeof(struct afc_client_private));
+	if (!afc)
+		return AFC_E_NO_MEM;
+	pthread_mutex_init(&afc->mutex, NULL);
+	*afc_client = afc;
+
+	return AFC_E_SUCCESS;
+}
+
+/* installation_proxy is not available */
+
+instproxy_error_t instproxy_client_new(idevice_t device, lockdownd_service_descriptor_t service, instproxy_client_t *client)
+{
+	return INSTPROXY_E_CONN_FAILED;
+}
+
+instproxy_error_t instproxy_client_start_service(idevice_t device, instproxy_client_t *client, const char *label)
+{
+	return INSTPROXY_E_CONN_FAILED;
+}
+
+instproxy_error_t instproxy_client_free(instproxy_client_t client)
+{
+	return INSTPROXY_E_INVALID_ARG;
+}
+
+instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+{
+	return INSTPROXY_E_INVALID_ARG;
+}
+
+plist_t instproxy_client_options_new(void)
+{
+	return plist_new_dict();
+}
+
+void instproxy_client_options_add(plist_t client_options, ...)
+{
+}
+
+void instproxy_client_options_set_return_attributes(plist_t client_options, ...)
+{
+}
+
+void instproxy_client_options_free(plist_t client_options)
+{
+	plist_free(client_options);
+}
+
+/* afc */
+
+afc_error_t afc_client_new(idevice_t device, lockdownd_service_descriptor_t service, afc_client_t *client)
+{
+	struct afc_client_private *afc;
+
+	if (!device || !service || !client)
+		return AFC_E_INVALID_ARG;
+
+	afc = calloc(1, sizeof(struct afc_client_private));
+	if (!afc)
+		return AFC_E_NO_MEM;
+	pthread_mutex_init(&afc->mutex, NULL);
+	standin_delay(0);
+	*client = afc;
+
+	return AFC_E_SUCCESS;
+}
+
+afc_error_t afc_client_free(afc_client_t client)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+	pthread_mutex_destroy(&client->mutex);
+	free(client);
+	return AFC_E_SUCCESS;
+}
+
+afc_error_t afc_dictionary_free(char **dictionary)
+{
+	int i;
+
+	if (!dictionary)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; dictionary[i]; i++)
+		free(dictionary[i]);
+	free(dictionary);
+	return AFC_E_SUCCESS;
+}
+
+static int device_info(char ***info)
+{
+	struct statvfs vfs;
+	char **list;
+
+	if (statvfs(standin.root, &vfs) < 0)
+		return errno;
+	list = list_new(8);
+	if (!list)
+		return ENOMEM;
+	list[0] = strdup("Model");
+	list[1] = strdup("iPhone0,0");
+	list[2] = strdup("FSTotalBytes");
+	asprintf(&list[3], "%llu", (unsigned long long)vfs.f_blocks * vfs.f_frsize);
+	list[4] = strdup("FSFreeBytes");
+	asprintf(&list[5], "%llu", (unsigned long long)vfs.f_bavail * vfs.f_frsize);
+	list[6] = strdup("FSBlockSize");
+	asprintf(&list[7], "%lu", (unsigned long)vfs.f_bsize);
+	*info = list;
+
+	return 0;
+}
+
+afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
+{
+	int e;
+
+	AFC_BEGIN(client);
+	e = device_info(device_information);
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value)
+{
+	char **info = NULL;
+	int i, e;
+
+	*value = NULL;
+	AFC_BEGIN(client);
+	e = device_info(&info);
+	if (e == 0) {
+		for (i = 0; info[i] && info[i+1]; i += 2) {
+			if (!strcmp(info[i], key)) {
+				*value = strdup(info[i+1]);
+				break;
+			}
+		}
+		afc_dictionary_free(info);
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_get_device_info_plist(afc_client_t client, plist_t *device_info_plist)
+{
+	char **info = NULL;
+	int i, e;
+
+	AFC_BEGIN(client);
+	e = device_info(&info);
+	if (e == 0) {
+		plist_t dict = plist_new_dict();
+		for (i = 0; info[i] && info[i+1]; i += 2) {
+			if (!strcmp(info[i], "Model"))
+				plist_dict_set_item(dict, info[i], plist_new_string(info[i+1]));
+			else
+				plist_dict_set_item(dict, info[i], plist_new_uint(strtoull(info[i+1], NULL, 10)));
+		}
+		afc_dictionary_free(info);
+		*device_info_plist = dict;
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+{
+	char local[PATH_MAX];
+	struct dirent *ent;
+	char **list = NULL;
+	size_t count = 0, cap = 64, bytes = 0;
+	DIR *dir;
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	dir = opendir(local);
+	if (!dir) {
+		e = errno;
+	} else {
+		list = list_new(cap);
+		while (list && (ent = readdir(dir))) {
+			if (count == cap) {
+				char **tmp = realloc(list, (cap * 2 + 1) * sizeof(char*));
+				if (!tmp) {
+					e = ENOMEM;
+					break;
+				}
+				list = tmp;
+				cap *= 2;
+			}
+			list[count++] = strdup(ent->d_name);
+			bytes += strlen(ent->d_name) + 1;
+		}
+		if (list)
+			list[count] = NULL;
+		closedir(dir);
+		*directory_information = list;
+	}
+	AFC_END(client, bytes, errno_to_afc_error(e));
+}
+
+static const char *ifmt_name(mode_t mode)
+{
+	if (S_ISDIR(mode)) return "S_IFDIR";
+	if (S_ISLNK(mode)) return "S_IFLNK";
+	if (S_ISBLK(mode)) return "S_IFBLK";
+	if (S_ISCHR(mode)) return "S_IFCHR";
+	if (S_ISFIFO(mode)) return "S_IFIFO";
+	if (S_ISSOCK(mode)) return "S_IFSOCK";
+	return "S_IFREG";
+}
+
+afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***file_information)
+{
+	char local[PATH_MAX];
+	char target[PATH_MAX];
+	struct stat st;
+	char **list;
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (lstat(local, &st) < 0) {
+		e = errno;
+	} else if (!(list = list_new(14))) {
+		e = ENOMEM;
+	} else {
+		int i = 0;
+		list[i++] = strdup("st_size");
+		asprintf(&list[i++], "%llu", (unsigned long long)st.st_size);
+		list[i++] = strdup("st_blocks");
+		asprintf(&list[i++], "%llu", (unsigned long long)st.st_blocks);
+		list[i++] = strdup("st_nlink");
+		asprintf(&list[i++], "%lu", (unsigned long)st.st_nlink);
+		list[i++] = strdup("st_ifmt");
+		list[i++] = strdup(ifmt_name(st.st_mode));
+		list[i++] = strdup("st_mtime");
+		asprintf(&list[i++], "%llu", (unsigned long long)st.st_mtime * 1000000000ULL);
+		list[i++] = strdup("st_birthtime");
+		asprintf(&list[i++], "%llu", (unsigned long long)st.st_ctime * 1000000000ULL);
+		if (S_ISLNK(st.st_mode)) {
+			ssize_t len = readlink(local, target, sizeof(target) - 1);
+			if (len >= 0) {
+				target[len] = '\0';
+				list[i++] = strdup("LinkTarget");
+				list[i++] = strdup(target);
+			}
+		}
+		*file_information = list;
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_get_file_info_plist(afc_client_t client, const char *path, plist_t *file_info)
+{
+	char **info = NULL;
+	afc_error_t err;
+	int i;
+
+	err = afc_get_file_info(client, path, &info);
+	if (err != AFC_E_SUCCESS)
+		return err;
+
+	*file_info = plist_new_dict();
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_ifmt") || !strcmp(info[i], "LinkTarget"))
+			plist_dict_set_item(*file_info, info[i], plist_new_string(info[i+1]));
+		else
+			plist_dict_set_item(*file_info, info[i], plist_new_uint(strtoull(info[i+1], NULL, 10)));
+	}
+	afc_dictionary_free(info);
+
+	return AFC_E_SUCCESS;
+}
+
+afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
+{
+	char local[PATH_MAX];
+	int flags;
+	int fd;
+	int e = 0;
+
+	switch (file_mode) {
+	case AFC_FOPEN_RDONLY: flags = O_RDONLY; break;
+	case AFC_FOPEN_RW: flags = O_RDWR | O_CREAT; break;
+	case AFC_FOPEN_WRONLY: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+	case AFC_FOPEN_WR: flags = O_RDWR | O_CREAT | O_TRUNC; break;
+	case AFC_FOPEN_APPEND: flags = O_WRONLY | O_APPEND | O_CREAT; break;
+	case AFC_FOPEN_RDAPPEND: flags = O_RDWR | O_APPEND | O_CREAT; break;
+	default: return AFC_E_INVALID_ARG;
+	}
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), filename);
+	fd = open(local, flags, 0644);
+	if (fd < 0) {
+		e = errno;
+	} else {
+		*handle = (uint64_t)fd;
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
+{
+	int e = 0;
+
+	AFC_BEGIN(client);
+	if (close((int)handle) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
+{
+	int op = (operation == AFC_LOCK_SH) ? LOCK_SH : (operation == AFC_LOCK_EX) ? LOCK_EX : LOCK_UN;
+	int e = 0;
+
+	AFC_BEGIN(client);
+	if (flock((int)handle, op | LOCK_NB) < 0)
+		e = errno;
+	AFC_END(client, 0, (e == EWOULDBLOCK) ? AFC_E_OP_WOULD_BLOCK : errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	ssize_t res;
+	int e = 0;
+
+	*bytes_read = 0;
+	AFC_BEGIN(client);
+	res = read((int)handle, data, length);
+	if (res < 0) {
+		e = errno;
+		res = 0;
+	} else {
+		*bytes_read = (uint32_t)res;
+	}
+	AFC_END(client, res, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	ssize_t res;
+	int e = 0;
+
+	*bytes_written = 0;
+	AFC_BEGIN(client);
+	res = write((int)handle, data, length);
+	if (res < 0) {
+		e = errno;
+		res = 0;
+	} else {
+		*bytes_written = (uint32_t)res;
+	}
+	AFC_END(client, res, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
+{
+	int e = 0;
+
+	AFC_BEGIN(client);
+	if (lseek((int)handle, offset, whence) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
+{
+	off_t pos;
+	int e = 0;
+
+	AFC_BEGIN(client);
+	pos = lseek((int)handle, 0, SEEK_CUR);
+	if (pos < 0)
+		e = errno;
+	else
+		*position = pos;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize)
+{
+	int e = 0;
+
+	AFC_BEGIN(client);
+	if (ftruncate((int)handle, newsize) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_remove_path(afc_client_t client, const char *path)
+{
+	char local[PATH_MAX];
+	struct stat st;
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (lstat(local, &st) < 0) {
+		e = errno;
+	} else if (S_ISDIR(st.st_mode) ? rmdir(local) : unlink(local)) {
+		e = errno;
+		if (e == EEXIST)
+			e = ENOTEMPTY;
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+static int remove_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+	return remove(fpath);
+}
+
+afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path)
+{
+	char local[PATH_MAX];
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (nftw(local, remove_entry, 64, FTW_DEPTH | FTW_PHYS) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_rename_path(afc_client_t client, const char *from, const char *to)
+{
+	char lfrom[PATH_MAX];
+	char lto[PATH_MAX];
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(lfrom, sizeof(lfrom), from);
+	standin_path(lto, sizeof(lto), to);
+	if (rename(lfrom, lto) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_make_directory(afc_client_t client, const char *path)
+{
+	char local[PATH_MAX];
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (mkdir(local, 0755) < 0 && errno != EEXIST)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize)
+{
+	char local[PATH_MAX];
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (truncate(local, newsize) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const char *target, const char *linkname)
+{
+	char ltarget[PATH_MAX];
+	char lname[PATH_MAX];
+	int e = 0;
+
+	AFC_BEGIN(client);
+	standin_path(lname, sizeof(lname), linkname);
+	if (linktype == AFC_SYMLINK) {
+		if (symlink(target, lname) < 0)
+			e = errno;
+	} else {
+		standin_path(ltarget, sizeof(ltarget), target);
+		if (link(ltarget, lname) < 0)
+			e = errno;
+	}
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
+
+afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mtime)
+{
+	char local[PATH_MAX];
+	struct timespec ts[2];
+	int e = 0;
+
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = mtime / 1000000000ULL;
+	ts[1].tv_nsec = mtime % 1000000000ULL;
+
+	AFC_BEGIN(client);
+	standin_path(local, sizeof(local), path);
+	if (utimensat(AT_FDCWD, local, ts, AT_SYMLINK_NOFOLLOW) < 0)
+		e = errno;
+	AFC_END(client, 0, errno_to_afc_error(e));
+}
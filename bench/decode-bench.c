@@ -0,0 +1,163 @@
+/*
+ * decode-bench.c
+ * Measures the CPU cost of turning an AFC file information reply into a
+ * struct stat, as done by getattr, and of translating AFC error codes.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <plist/plist.h>
+
+#include "../src/afc_info.h"
+
+/* replies as sent by the device for a file, a directory and a symlink */
+static char *reply_file[] = {
+	"st_size", "3145728", "st_blocks", "6144", "st_nlink", "1",
+	"st_ifmt", "S_IFREG", "st_mtime", "1760000000123456789",
+	"st_birthtime", "1750000000000000000", NULL
+};
+static char *reply_dir[] = {
+	"st_size", "1088", "st_blocks", "0", "st_nlink", "34",
+	"st_ifmt", "S_IFDIR", "st_mtime", "1760000000123456789",
+	"st_birthtime", "1750000000000000000", NULL
+};
+static char *reply_link[] = {
+	"st_size", "24", "st_blocks", "0", "st_nlink", "1",
+	"st_ifmt", "S_IFLNK", "st_mtime", "1760000000123456789",
+	"st_birthtime", "1750000000000000000",
+	"LinkTarget", "/private/var/mobile/Media", NULL
+};
+static char **replies[] = { reply_file, reply_dir, reply_link };
+#define NUM_REPLIES (sizeof(replies) / sizeof(replies[0]))
+
+static double monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The previous getattr path: the reply is converted into a plist dictionary
+ * like afc_get_file_info_plist() does, then looked up key by key and st_ifmt
+ * compared against every type name.
+ */
+static void decode_plist(char **info, struct stat *stbuf)
+{
+	plist_t dict = plist_new_dict();
+	int i;
+
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_ifmt") || !strcmp(info[i], "LinkTarget"))
+			plist_dict_set_item(dict, info[i], plist_new_string(info[i+1]));
+		else
+			plist_dict_set_item(dict, info[i], plist_new_uint(strtoull(info[i+1], NULL, 10)));
+	}
+
+	stbuf->st_size = plist_dict_get_uint(dict, "st_size");
+	stbuf->st_blocks = plist_dict_get_uint(dict, "st_blocks");
+	const char* s_ifmt = plist_get_string_ptr(plist_dict_get_item(dict, "st_ifmt"), NULL);
+	if (s_ifmt) {
+		if (!strcmp(s_ifmt, "S_IFREG")) {
+			stbuf->st_mode = S_IFREG;
+		} else if (!strcmp(s_ifmt, "S_IFDIR")) {
+			stbuf->st_mode = S_IFDIR;
+		} else if (!strcmp(s_ifmt, "S_IFLNK")) {
+			stbuf->st_mode = S_IFLNK;
+		} else if (!strcmp(s_ifmt, "S_IFBLK")) {
+			stbuf->st_mode = S_IFBLK;
+		} else if (!strcmp(s_ifmt, "S_IFCHR")) {
+			stbuf->st_mode = S_IFCHR;
+		} else if (!strcmp(s_ifmt, "S_IFIFO")) {
+			stbuf->st_mode = S_IFIFO;
+		} else if (!strcmp(s_ifmt, "S_IFSOCK")) {
+			stbuf->st_mode = S_IFSOCK;
+		}
+	}
+	stbuf->st_nlink = plist_dict_get_uint(dict, "st_nlink");
+	stbuf->st_mtime = (time_t)(plist_dict_get_uint(dict, "st_mtime") / 1000000000);
+	plist_free(dict);
+}
+
+static void decode_direct(char **info, struct stat *stbuf)
+{
+	afc_info_decode(info, stbuf);
+}
+
+static double run(void (*decode)(char **, struct stat *), unsigned long iterations, unsigned long *check)
+{
+	struct stat st;
+	unsigned long i;
+	double start = monotonic_now();
+
+	for (i = 0; i < iterations; i++) {
+		memset(&st, 0, sizeof(st));
+		decode(replies[i % NUM_REPLIES], &st);
+		*check += st.st_mode + st.st_size;
+	}
+
+	return (monotonic_now() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+	unsigned long check = 0;
+	unsigned long i;
+	double start, ns;
+	struct stat a, b;
+
+	if (iterations == 0)
+		iterations = 1;
+
+	/* both decoders have to agree before they are compared */
+	for (i = 0; i < NUM_REPLIES; i++) {
+		memset(&a, 0, sizeof(a));
+		memset(&b, 0, sizeof(b));
+		decode_plist(replies[i], &a);
+		decode_direct(replies[i], &b);
+		if (a.st_mode != b.st_mode || a.st_size != b.st_size || a.st_blocks != b.st_blocks || a.st_nlink != b.st_nlink || a.st_mtime != b.st_mtime) {
+			fprintf(stderr, "ERROR: decoders disagree on reply %lu\n", i);
+			return 1;
+		}
+	}
+
+	printf("getattr decode, %lu entries:\n", iterations);
+	printf("  plist + strcmp:      %8.1f ns/entry\n", run(decode_plist, iterations, &check));
+	printf("  afc_info_decode:     %8.1f ns/entry\n", run(decode_direct, iterations, &check));
+
+	start = monotonic_now();
+	for (i = 0; i < iterations; i++) {
+		check += afc_info_errno((afc_error_t)(1 + i % AFC_E_INTERNAL_ERROR));
+	}
+	ns = (monotonic_now() - start) * 1e9 / iterations;
+	printf("  afc_info_errno:      %8.1f ns/call\n", ns);
+
+	/* keeps the loops from being optimized away */
+	return (check == 0) ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# run-bench.sh - mount ifuse-bench on a local AFC stand-in and report
+# sequential throughput, stat rate and readdir latency.
+#
+# Usage: run-bench.sh [IFUSE_BENCH_BINARY]
+#
+# Tunables (environment):
+#   BENCH_LATENCY      simulated round trip time in microseconds (default 500)
+#   BENCH_BANDWIDTH    simulated link bandwidth in bytes/s (default 33554432)
+#   BENCH_FILE_MB      size of the sequential read/write file (default 64)
+#   BENCH_STAT_FILES   number of files in the stat tree (default 2000)
+#   BENCH_DIR_ENTRIES  number of entries in the readdir directory (default 10000)
+#   BENCH_OPTS         extra mount options passed to ifuse, e.g. "-o afc_connections=8"
+#   BENCH_STATS        if set, the .ifuse/stats of every phase is appended there
+#
+
+IFUSE_BENCH=${1:-./ifuse-bench}
+BENCH_LATENCY=${BENCH_LATENCY:-500}
+BENCH_BANDWIDTH=${BENCH_BANDWIDTH:-33554432}
+BENCH_FILE_MB=${BENCH_FILE_MB:-64}
+BENCH_STAT_FILES=${BENCH_STAT_FILES:-2000}
+BENCH_DIR_ENTRIES=${BENCH_DIR_ENTRIES:-10000}
+
+if [ ! -x "$IFUSE_BENCH" ]; then
+	echo "ERROR: $IFUSE_BENCH is not executable" >&2
+	exit 1
+fi
+
+if command -v fusermount3 >/dev/null 2>&1; then
+	FUSERMOUNT=fusermount3
+else
+	FUSERMOUNT=fusermount
+fi
+
+workdir=$(mktemp -d "${TMPDIR:-/tmp}/ifuse-bench.XXXXXX") || exit 1
+root="$workdir/root"
+mnt="$workdir/mnt"
+pid=
+
+unmount() {
+	if [ -n "$pid" ]; then
+		$FUSERMOUNT -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null
+		wait $pid 2>/dev/null
+		pid=
+	fi
+}
+
+cleanup() {
+	unmount
+	rm -rf "$workdir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+	date +%s.%N
+}
+
+# elapsed START END
+elapsed() {
+	awk -v s="$1" -v e="$2" 'BEGIN { printf "%.3f", e - s }'
+}
+
+# rate COUNT SECONDS
+rate() {
+	awk -v c="$1" -v t="$2" 'BEGIN { if (t > 0) printf "%.1f", c / t; else print "inf" }'
+}
+
+# mount the stand-in with cold caches; every phase gets a fresh mount
+mount_standin() {
+	IFUSE_STANDIN_ROOT="$root" \
+	IFUSE_STANDIN_LATENCY="$BENCH_LATENCY" \
+	IFUSE_STANDIN_BANDWIDTH="$BENCH_BANDWIDTH" \
+		"$IFUSE_BENCH" "$mnt" -f $BENCH_OPTS &
+	pid=$!
+	i=0
+	while [ ! -e "$mnt/.ifuse/stats" ]; do
+		i=$((i+1))
+		if [ $i -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+			echo "ERROR: could not mount $IFUSE_BENCH on $mnt" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+# unmount, keeping the statistics of the phase if requested
+finish_phase() {
+	if [ -n "$BENCH_STATS" ]; then
+		echo "# $1" >> "$BENCH_STATS"
+		cat "$mnt/.ifuse/stats" >> "$BENCH_STATS"
+	fi
+	unmount
+}
+
+mkdir -p "$root/stat" "$root/readdir" "$mnt" || exit 1
+
+echo "Preparing data set in $root ..."
+dd if=/dev/urandom of="$root/seq-read" bs=1048576 count="$BENCH_FILE_MB" 2>/dev/null
+i=0
+while [ $i -lt "$BENCH_STAT_FILES" ]; do
+	d="$root/stat/$((i % 20))"
+	mkdir -p "$d"
+	: > "$d/file$i"
+	i=$((i+1))
+done
+(cd "$root/readdir" && seq -f "entry%05g" 1 "$BENCH_DIR_ENTRIES" | xargs touch) || exit 1
+
+echo "ifuse benchmark: latency ${BENCH_LATENCY}us, bandwidth ${BENCH_BANDWIDTH} B/s, options: ${BENCH_OPTS:-none}"
+
+mount_standin
+t0=$(now)
+dd if=/dev/zero of="$mnt/seq-write" bs=1048576 count="$BENCH_FILE_MB" conv=fsync 2>/dev/null || exit 1
+t1=$(now)
+t=$(elapsed $t0 $t1)
+echo "sequential write: ${BENCH_FILE_MB} MiB in ${t}s, $(rate $BENCH_FILE_MB $t) MiB/s"
+finish_phase "sequential write"
+
+mount_standin
+t0=$(now)
+dd if="$mnt/seq-read" of=/dev/null bs=1048576 2>/dev/null || exit 1
+t1=$(now)
+t=$(elapsed $t0 $t1)
+echo "sequential read:  ${BENCH_FILE_MB} MiB in ${t}s, $(rate $BENCH_FILE_MB $t) MiB/s"
+finish_phase "sequential read"
+
+mount_standin
+t0=$(now)
+n=$(find "$mnt/stat" -type f -printf '%s\n' | wc -l)
+t1=$(now)
+t=$(elapsed $t0 $t1)
+echo "stat:             ${n} files in ${t}s, $(rate $n $t) ops/s"
+finish_phase "stat"
+
+mount_standin
+t0=$(now)
+n=$(ls -f "$mnt/readdir" | wc -l)
+t1=$(now)
+echo "readdir:          ${n} entries in $(elapsed $t0 $t1)s (names only)"
+finish_phase "readdir"
+
+mount_standin
+t0=$(now)
+n=$(ls -l "$mnt/readdir" | grep -vc '^total')
+t1=$(now)
+echo "readdir + stat:   ${n} entries in $(elapsed $t0 $t1)s"
+finish_phase "readdir + stat"
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# run-tests.sh - mount ifuse-bench on a local AFC stand-in and check
+# behavior that must not regress. Run by 'make check'.
+#
+# Usage: run-tests.sh [IFUSE_BENCH_BINARY]
+#
+# Exits with 77 (skipped) if FUSE or setfattr is not usable.
+#
+
+IFUSE_BENCH=${1:-${IFUSE_BENCH:-./ifuse-bench}}
+APPID=com.example.standin
+
+if [ ! -x "$IFUSE_BENCH" ]; then
+	echo "ERROR: $IFUSE_BENCH is not executable" >&2
+	exit 1
+fi
+if [ ! -c /dev/fuse ] || ! command -v setfattr >/dev/null 2>&1; then
+	echo "SKIP: FUSE or setfattr is not available" >&2
+	exit 77
+fi
+
+if command -v fusermount3 >/dev/null 2>&1; then
+	FUSERMOUNT=fusermount3
+else
+	FUSERMOUNT=fusermount
+fi
+
+workdir=$(mktemp -d "${TMPDIR:-/tmp}/ifuse-test.XXXXXX") || exit 1
+root="$workdir/root"
+mnt="$workdir/mnt"
+pid=
+failed=0
+
+unmount() {
+	if [ -n "$pid" ]; then
+		$FUSERMOUNT -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null
+		wait $pid 2>/dev/null
+		pid=
+	fi
+}
+
+cleanup() {
+	unmount
+	rm -rf "$workdir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# mount_standin OPTIONS..., waits until $mnt/keep shows up
+mount_standin() {
+	IFUSE_STANDIN_ROOT="$root" "$IFUSE_BENCH" "$mnt" -f "$@" &
+	pid=$!
+	i=0
+	while [ ! -e "$mnt/keep" ]; do
+		i=$((i+1))
+		if [ $i -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+			echo "SKIP: could not mount $IFUSE_BENCH on $mnt" >&2
+			exit 77
+		fi
+		sleep 0.1
+	done
+}
+
+# check DESCRIPTION COMMAND...
+check() {
+	desc="$1"
+	shift
+	if "$@"; then
+		echo "PASS: $desc"
+	else
+		echo "FAIL: $desc"
+		failed=1
+	fi
+}
+
+mkdir -p "$root/Documents/sub/deeper" "$mnt" || exit 1
+: > "$root/Documents/keep"
+: > "$root/Documents/sub/deeper/file"
+
+mount_standin --documents "$APPID"
+check "removing the mount root is refused with --documents" \
+	sh -c '! setfattr -n user.ifuse.remove "$1" 2>/dev/null' sh "$mnt"
+check "the Documents folder is intact after that" \
+	test -e "$root/Documents/keep" -a -e "$root/Documents/sub/deeper/file"
+check "a directory below the mount root can be removed" \
+	setfattr -n user.ifuse.remove "$mnt/sub"
+check "it is gone from the device" \
+	test ! -e "$root/Documents/sub"
+unmount
+
+exit $failed
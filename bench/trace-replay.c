@@ -0,0 +1,599 @@
+/*
+ * trace-replay.c
+ * Plays a trace recorded with trace_file= back against a mount.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "../src/trace.h"
+
+/* operations that change the mount, only done with --allow-writes */
+#define MODIFYING_OPS ((1u << STATS_OP_CREATE) | (1u << STATS_OP_WRITE) | (1u << STATS_OP_TRUNCATE) | \
+	(1u << STATS_OP_SYMLINK) | (1u << STATS_OP_LINK) | (1u << STATS_OP_UNLINK) | (1u << STATS_OP_RMDIR) | \
+	(1u << STATS_OP_RENAME) | (1u << STATS_OP_MKDIR) | (1u << STATS_OP_UTIMENS) | (1u << STATS_OP_CHMOD) | \
+	(1u << STATS_OP_CHOWN) | (1u << STATS_OP_SETXATTR))
+
+static struct {
+	const char *mount_point;
+	int fast;
+	int allow_writes;
+} opts;
+
+/* id to path, open addressed */
+static struct {
+	uint64_t *ids;
+	char **paths;
+	size_t size;
+	size_t count;
+} paths;
+
+/* open files and directories of the replay by the handle in the trace */
+struct replay_handle {
+	uint64_t fh;
+	int fd;
+	DIR *dir;
+};
+
+static struct {
+	struct replay_handle *slots;
+	size_t size;
+	size_t count;
+} handles;
+
+/* latencies of one operation in ns */
+struct op_latencies {
+	uint64_t *recorded;
+	uint64_t *replayed;
+	size_t count;
+	size_t size;
+	size_t errors;
+	size_t skipped;
+};
+
+static struct op_latencies latencies[STATS_OP_COUNT];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int paths_add(uint64_t id, const char *path, size_t len)
+{
+	size_t i;
+
+	if (2 * (paths.count + 1) > paths.size) {
+		size_t size = (paths.size) ? 2 * paths.size : 1024;
+		uint64_t *ids = calloc(size, sizeof(uint64_t));
+		char **strs = calloc(size, sizeof(char*));
+		if (!ids || !strs) {
+			free(ids);
+			free(strs);
+			return -1;
+		}
+		for (i = 0; i < paths.size; i++) {
+			size_t j;
+			if (!paths.ids[i])
+				continue;
+			for (j = paths.ids[i] & (size - 1); ids[j]; j = (j + 1) & (size - 1));
+			ids[j] = paths.ids[i];
+			strs[j] = paths.paths[i];
+		}
+		free(paths.ids);
+		free(paths.paths);
+		paths.ids = ids;
+		paths.paths = strs;
+		paths.size = size;
+	}
+
+	for (i = id & (paths.size - 1); paths.ids[i]; i = (i + 1) & (paths.size - 1)) {
+		if (paths.ids[i] == id)
+			return 0;
+	}
+	paths.paths[i] = strndup(path, len);
+	if (!paths.paths[i])
+		return -1;
+	paths.ids[i] = id;
+	paths.count++;
+
+	return 0;
+}
+
+static const char *paths_get(uint64_t id)
+{
+	size_t i;
+
+	if (!id || !paths.size)
+		return NULL;
+	for (i = id & (paths.size - 1); paths.ids[i]; i = (i + 1) & (paths.size - 1)) {
+		if (paths.ids[i] == id)
+			return paths.paths[i];
+	}
+
+	return NULL;
+}
+
+static struct replay_handle *handles_find(uint64_t fh, int add)
+{
+	size_t i;
+
+	if (add && 2 * (handles.count + 1) > handles.size) {
+		size_t size = (handles.size) ? 2 * handles.size : 256;
+		struct replay_handle *slots = calloc(size, sizeof(struct replay_handle));
+		if (!slots)
+			return NULL;
+		for (i = 0; i < handles.size; i++) {
+			size_t j;
+			if (!handles.slots[i].fh)
+				continue;
+			for (j = handles.slots[i].fh & (size - 1); slots[j].fh; j = (j + 1) & (size - 1));
+			slots[j] = handles.slots[i];
+		}
+		free(handles.slots);
+		handles.slots = slots;
+		handles.size = size;
+	}
+	if (!fh || !handles.size)
+		return NULL;
+
+	for (i = fh & (handles.size - 1); handles.slots[i].fh; i = (i + 1) & (handles.size - 1)) {
+		if (handles.slots[i].fh == fh)
+			return &handles.slots[i];
+	}
+	if (!add)
+		return NULL;
+	handles.slots[i].fh = fh;
+	handles.slots[i].fd = -1;
+	handles.slots[i].dir = NULL;
+	handles.count++;
+
+	return &handles.slots[i];
+}
+
+/* removes a handle, re-inserting the ones after it in its probe sequence */
+static void handles_remove(struct replay_handle *h)
+{
+	size_t i = h - handles.slots;
+	size_t j;
+
+	h->fh = 0;
+	handles.count--;
+	for (j = (i + 1) & (handles.size - 1); handles.slots[j].fh; j = (j + 1) & (handles.size - 1)) {
+		struct replay_handle moved = handles.slots[j];
+		handles.slots[j].fh = 0;
+		handles.count--;
+		*handles_find(moved.fh, 1) = moved;
+	}
+}
+
+static int latencies_add(enum stats_op op, uint64_t recorded, uint64_t replayed, int failed)
+{
+	struct op_latencies *l = &latencies[op];
+
+	if (l->count == l->size) {
+		size_t size = (l->size) ? 2 * l->size : 64;
+		uint64_t *rec = realloc(l->recorded, size * sizeof(uint64_t));
+		uint64_t *rep;
+		if (!rec)
+			return -1;
+		l->recorded = rec;
+		rep = realloc(l->replayed, size * sizeof(uint64_t));
+		if (!rep)
+			return -1;
+		l->replayed = rep;
+		l->size = size;
+	}
+	l->recorded[l->count] = recorded;
+	l->replayed[l->count] = replayed;
+	l->count++;
+	if (failed) {
+		l->errors++;
+	}
+
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_start(const void *a, const void *b)
+{
+	const struct trace_op *x = (const struct trace_op*)a;
+	const struct trace_op *y = (const struct trace_op*)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Reads a trace file.
+ *
+ * @param file The trace.
+ * @param ops Receives the operations sorted by their start.
+ * @param count Receives the number of operations.
+ *
+ * @return 0 on success, -1 on error, which is printed.
+ */
+static int read_trace(const char *file, struct trace_op **ops, size_t *count)
+{
+	struct trace_header header;
+	struct trace_op *list = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	char path[UINT16_MAX + 8];
+	FILE *f;
+	int type;
+
+	f = fopen(file, "rb");
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header.version != TRACE_VERSION) {
+		fprintf(stderr, "ERROR: %s is not a trace of this version\n", file);
+		fclose(f);
+		return -1;
+	}
+
+	while ((type = fgetc(f)) != EOF) {
+		ungetc(type, f);
+		if (type == TRACE_PATH) {
+			struct trace_path rec;
+			size_t padded;
+			if (fread(&rec, sizeof(rec), 1, f) != 1)
+				break;
+			padded = (rec.len + 7) & ~(size_t)7;
+			if (fread(path, 1, padded, f) != padded)
+				break;
+			if (paths_add(rec.id, path, rec.len) < 0)
+				goto oom;
+		} else if (type == TRACE_OP) {
+			if (n == size) {
+				struct trace_op *l;
+				size = (size) ? 2 * size : 4096;
+				l = realloc(list, size * sizeof(struct trace_op));
+				if (!l)
+					goto oom;
+				list = l;
+			}
+			if (fread(&list[n], sizeof(struct trace_op), 1, f) != 1)
+				break;
+			if (list[n].op < STATS_OP_COUNT) {
+				n++;
+			}
+		} else {
+			fprintf(stderr, "WARNING: Unknown record type %d, ignoring the rest of %s\n", type, file);
+			break;
+		}
+	}
+	fclose(f);
+
+	/* the threads' buffers were written in the order they filled up */
+	qsort(list, n, sizeof(struct trace_op), compare_start);
+	*ops = list;
+	*count = n;
+
+	return 0;
+
+oom:
+	fprintf(stderr, "ERROR: Out of memory\n");
+	fclose(f);
+	free(list);
+	return -1;
+}
+
+/**
+ * Does an operation of the trace on the mount.
+ *
+ * @return 0 if it was done and succeeded, 1 if it was skipped, or -1 if it
+ *    failed.
+ */
+static int replay_op(const struct trace_op *op, char *buf, size_t buf_size)
+{
+	char path[PATH_MAX];
+	char other[PATH_MAX];
+	const char *p = paths_get(op->path);
+	const char *o = paths_get(op->offset);
+	struct replay_handle *h = handles_find(op->fh, 0);
+	struct stat st;
+	struct statvfs sv;
+	struct dirent *de;
+	size_t size = (op->size < buf_size) ? op->size : buf_size;
+	int fd;
+
+	if (!opts.allow_writes && (MODIFYING_OPS & (1u << op->op)))
+		return 1;
+	if (!p)
+		return 1;
+	snprintf(path, sizeof(path), "%s%s", opts.mount_point, p);
+	if (o) {
+		snprintf(other, sizeof(other), "%s%s", opts.mount_point, o);
+	}
+
+	switch (op->op) {
+	case STATS_OP_GETATTR:
+		return ((h && h->fd >= 0) ? fstat(h->fd, &st) : lstat(path, &st)) < 0 ? -1 : 0;
+	case STATS_OP_STATFS:
+		return (statvfs(path, &sv) < 0) ? -1 : 0;
+	case STATS_OP_OPENDIR:
+		if (op->result < 0)
+			return 1;
+		h = handles_find(op->fh, 1);
+		if (!h)
+			return -1;
+		h->dir = opendir(path);
+		if (!h->dir) {
+			handles_remove(h);
+			return -1;
+		}
+		return 0;
+	case STATS_OP_READDIR:
+		/* the whole listing is read when the first part of it was */
+		if (!h || !h->dir || op->offset != 0)
+			return 1;
+		rewinddir(h->dir);
+		errno = 0;
+		while ((de = readdir(h->dir)) != NULL);
+		return (errno) ? -1 : 0;
+	case STATS_OP_RELEASEDIR:
+		if (!h || !h->dir)
+			return 1;
+		closedir(h->dir);
+		handles_remove(h);
+		return 0;
+	case STATS_OP_CREATE:
+	case STATS_OP_OPEN:
+		if (op->result < 0)
+			return 1;
+		if (op->op == STATS_OP_CREATE) {
+			fd = open(path, (int)op->size | O_CREAT, (mode_t)op->offset);
+		} else if (opts.allow_writes) {
+			fd = open(path, (int)op->size & ~(O_CREAT | O_EXCL));
+		} else {
+			/* the writes to it are skipped, so it must not be truncated */
+			fd = open(path, ((int)op->size & ~(O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND)) | O_RDONLY);
+		}
+		if (fd < 0)
+			return -1;
+		h = handles_find(op->fh, 1);
+		if (!h) {
+			close(fd);
+			return -1;
+		}
+		h->fd = fd;
+		return 0;
+	case STATS_OP_READ:
+		if (!h || h->fd < 0)
+			return 1;
+		return (pread(h->fd, buf, size, op->offset) < 0) ? -1 : 0;
+	case STATS_OP_WRITE:
+		if (!h || h->fd < 0)
+			return 1;
+		memset(buf, 0, size);
+		return (pwrite(h->fd, buf, size, op->offset) < 0) ? -1 : 0;
+	case STATS_OP_FSYNC:
+		if (!h || h->fd < 0)
+			return 1;
+		return ((op->size) ? fdatasync(h->fd) : fsync(h->fd)) < 0 ? -1 : 0;
+	case STATS_OP_FLUSH:
+		/* done by close() when the file is released */
+		return 1;
+	case STATS_OP_RELEASE:
+		if (!h || h->fd < 0)
+			return 1;
+		close(h->fd);
+		handles_remove(h);
+		return 0;
+	case STATS_OP_TRUNCATE:
+		return ((h && h->fd >= 0) ? ftruncate(h->fd, op->offset) : truncate(path, op->offset)) < 0 ? -1 : 0;
+	case STATS_OP_READLINK:
+		return (readlink(path, buf, buf_size) < 0) ? -1 : 0;
+	case STATS_OP_SYMLINK:
+		return (!o) ? 1 : (symlink(o, path) < 0) ? -1 : 0;
+	case STATS_OP_LINK:
+		return (!o) ? 1 : (link(other, path) < 0) ? -1 : 0;
+	case STATS_OP_UNLINK:
+		return (unlink(path) < 0) ? -1 : 0;
+	case STATS_OP_RMDIR:
+		return (rmdir(path) < 0) ? -1 : 0;
+	case STATS_OP_RENAME:
+		return (!o) ? 1 : (rename(path, other) < 0) ? -1 : 0;
+	case STATS_OP_MKDIR:
+		return (mkdir(path, (mode_t)op->offset) < 0) ? -1 : 0;
+	case STATS_OP_UTIMENS:
+		return (utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW) < 0) ? -1 : 0;
+	case STATS_OP_CHMOD:
+		return (chmod(path, (mode_t)op->offset) < 0) ? -1 : 0;
+	case STATS_OP_CHOWN:
+		return (lchown(path, (uid_t)op->offset, (gid_t)op->size) < 0) ? -1 : 0;
+	case STATS_OP_GETXATTR:
+		return (!o) ? 1 : (lgetxattr(path, o, buf, size) < 0) ? -1 : 0;
+	case STATS_OP_SETXATTR:
+		/* the value is not recorded, the ones ifuse knows ignore it */
+		return (!o) ? 1 : (lsetxattr(path, o, "", 0, 0) < 0) ? -1 : 0;
+	case STATS_OP_LISTXATTR:
+		return (llistxattr(path, buf, size) < 0) ? -1 : 0;
+	default:
+		return 1;
+	}
+}
+
+static void print_report(double recorded_s, double replayed_s)
+{
+	unsigned int i;
+
+	printf("%-11s %8s %7s  %-36s  %-36s\n", "", "", "", "recorded latency (us)", "replayed latency (us)");
+	printf("%-11s %8s %7s  %8s %8s %8s %9s  %8s %8s %8s %9s\n", "operation", "count", "errors", "avg", "p50", "p99", "max", "avg", "p50", "p99", "max");
+	for (i = 0; i < STATS_OP_COUNT; i++) {
+		struct op_latencies *l = &latencies[i];
+		uint64_t recorded_sum = 0;
+		uint64_t replayed_sum = 0;
+		size_t j;
+		if (l->count == 0) {
+			if (l->skipped > 0)
+				printf("%-11s %8s %7s  (%zu skipped)\n", stats_op_name(i), "-", "-", l->skipped);
+			continue;
+		}
+		qsort(l->recorded, l->count, sizeof(uint64_t), compare_u64);
+		qsort(l->replayed, l->count, sizeof(uint64_t), compare_u64);
+		for (j = 0; j < l->count; j++) {
+			recorded_sum += l->recorded[j];
+			replayed_sum += l->replayed[j];
+		}
+		printf("%-11s %8zu %7zu  %8.1f %8.1f %8.1f %9.1f  %8.1f %8.1f %8.1f %9.1f",
+			stats_op_name(i), l->count, l->errors,
+			recorded_sum / 1e3 / l->count, l->recorded[l->count / 2] / 1e3, l->recorded[(l->count * 99) / 100] / 1e3, l->recorded[l->count - 1] / 1e3,
+			replayed_sum / 1e3 / l->count, l->replayed[l->count / 2] / 1e3, l->replayed[(l->count * 99) / 100] / 1e3, l->replayed[l->count - 1] / 1e3);
+		if (l->skipped > 0)
+			printf("  (%zu skipped)", l->skipped);
+		printf("\n");
+	}
+	printf("\ntrace spans %.2f s, replay took %.2f s\n", recorded_s, replayed_s);
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: trace-replay [OPTIONS] TRACE MOUNTPOINT\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Play a trace recorded with the ifuse mount option trace_file=TRACE back\n");
+	fprintf(stderr, "against MOUNTPOINT, one operation after another, and compare the latency\n");
+	fprintf(stderr, "of every kind of operation with the recorded one. Operations that change\n");
+	fprintf(stderr, "the file system are skipped unless --allow-writes is given.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "  -f, --fast\t\tdo not wait for the recorded start of each operation\n");
+	fprintf(stderr, "  -w, --allow-writes\talso create, write, remove and rename files like the\n");
+	fprintf(stderr, "\t\t\ttrace did; written data is zeros\n");
+	fprintf(stderr, "  -h, --help\t\tprint usage information\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longopts[] = {
+		{ "fast", no_argument, NULL, 'f' },
+		{ "allow-writes", no_argument, NULL, 'w' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct trace_op *ops = NULL;
+	size_t count = 0;
+	size_t buf_size = 0;
+	char *buf;
+	uint64_t start;
+	size_t i;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "fwh", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			opts.fast = 1;
+			break;
+		case 'w':
+			opts.allow_writes = 1;
+			break;
+		case 'h':
+			print_usage();
+			return EXIT_SUCCESS;
+		default:
+			print_usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2) {
+		print_usage();
+		return EXIT_FAILURE;
+	}
+	opts.mount_point = argv[optind + 1];
+
+	if (read_trace(argv[optind], &ops, &count) < 0)
+		return EXIT_FAILURE;
+	if (count == 0) {
+		fprintf(stderr, "ERROR: The trace contains no operations\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((ops[i].op == STATS_OP_READ || ops[i].op == STATS_OP_WRITE) && ops[i].size > buf_size && ops[i].size <= 64 * 1024 * 1024) {
+			buf_size = ops[i].size;
+		}
+	}
+	if (buf_size < PATH_MAX) {
+		buf_size = PATH_MAX;
+	}
+	buf = malloc(buf_size);
+	if (!buf) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		uint64_t begin;
+		int res;
+
+		if (!opts.fast) {
+			/* operations that were concurrent are done when the ones
+			 * before them are finished */
+			uint64_t due = start + (ops[i].start - ops[0].start);
+			uint64_t now = now_ns();
+			if (due > now) {
+				struct timespec ts;
+				ts.tv_sec = (due - now) / 1000000000ULL;
+				ts.tv_nsec = (due - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		begin = now_ns();
+		res = replay_op(&ops[i], buf, buf_size);
+		if (res == 1) {
+			latencies[ops[i].op].skipped++;
+		} else if (latencies_add(ops[i].op, ops[i].duration, now_ns() - begin, res < 0) < 0) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	print_report((ops[count - 1].start + ops[count - 1].duration - ops[0].start) / 1e9, (now_ns() - start) / 1e9);
+	free(buf);
+	free(ops);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ * afc_connect.c
+ * Connection setup shared by ifuse and ifuse-cp.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <plist/plist.h>
+
+#include "afc_connect.h"
+
+/**
+ * Connects to lockdownd and pairs with the device if needed. The reason of
+ * a failure is printed to stderr.
+ *
+ * @param dev The device.
+ * @param label The name the client identifies itself with.
+ * @param lockdown Receives the lockdownd client.
+ *
+ * @return 0 on success, -EACCES if the device is locked or asks the user
+ *    to trust this computer, or another negative errno value.
+ */
+int afc_connect_lockdown(idevice_t dev, const char *label, lockdownd_client_t *lockdown)
+{
+	lockdownd_error_t lerr;
+	char *udid = NULL;
+
+	lerr = lockdownd_client_new_with_handshake(dev, lockdown, label);
+	if (lerr == LOCKDOWN_E_SUCCESS)
+		return 0;
+
+	*lockdown = NULL;
+	idevice_get_udid(dev, &udid);
+	if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED) {
+		fprintf(stderr, "Please disable the password protection on device %s and try again.\n", udid);
+		fprintf(stderr, "The device does not allow pairing as long as a password has been set.\n");
+		fprintf(stderr, "You can enable it again after the connection succeeded.\n");
+	} else if (lerr == LOCKDOWN_E_PAIRING_DIALOG_RESPONSE_PENDING) {
+		fprintf(stderr, "Please dismiss the trust dialog on device %s and try again.\n", udid);
+		fprintf(stderr, "The device does not allow pairing as long as the dialog has not been accepted.\n");
+	} else {
+		fprintf(stderr, "Failed to connect to lockdownd service on device %s (%d).\n", udid, lerr);
+		fprintf(stderr, "Try again. If it still fails try rebooting your device.\n");
+	}
+	free(udid);
+
+	if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED || lerr == LOCKDOWN_E_PAIRING_DIALOG_RESPONSE_PENDING)
+		return -EACCES;
+
+	return -EIO;
+}
+
+/**
+ * Starts instances of the service of target, one for each AFC connection.
+ * They are started one after another, since they share the lockdownd
+ * connection.
+ *
+ * @param dev The device.
+ * @param lockdown A lockdownd client returned by afc_connect_lockdown().
+ * @param target The file system to connect to.
+ * @param count Number of instances to start.
+ * @param services Receives up to count service descriptors.
+ *
+ * @return Number of services started, which might be less than count, or a
+ *    negative errno value if none could be started.
+ */
+int afc_connect_start_services(idevice_t dev, lockdownd_client_t lockdown, const struct afc_target *target, unsigned int count, lockdownd_service_descriptor_t *services)
+{
+	unsigned int started = 0;
+	char *udid = NULL;
+
+	while (started < count) {
+		services[started] = NULL;
+		if ((lockdownd_start_service(lockdown, target->service_name, &services[started]) != LOCKDOWN_E_SUCCESS) || !services[started])
+			break;
+		started++;
+	}
+	if (started == count)
+		return started;
+
+	idevice_get_udid(dev, &udid);
+	if (started == 0) {
+		fprintf(stderr, "Failed to start AFC service '%s' on device %s.\n", target->service_name, udid);
+		if (!strcmp(target->service_name, AFC2_SERVICE_NAME)) {
+			fprintf(stderr, "This service enables access to the root filesystem of your device.\n");
+			fprintf(stderr, "Your device needs to be jailbroken and have the AFC2 service installed.\n");
+		}
+	} else {
+		fprintf(stderr, "WARNING: Could only start %u of %u AFC services on device %s\n", started, count, udid);
+	}
+	free(udid);
+
+	return (started > 0) ? (int)started : -EIO;
+}
+
+/**
+ * Sends the house_arrest command to vend the container or documents of the
+ * app of target.
+ *
+ * @param client The house_arrest client to use.
+ * @param target The file system to connect to.
+ * @param verbose Whether to print errors to stderr.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int house_arrest_vend(house_arrest_client_t client, const struct afc_target *target, int verbose)
+{
+	/* FIXME: iOS 3.x house_arrest does not know about VendDocuments yet, thus use VendContainer and chroot manually with fuse subdir module */
+	if (house_arrest_send_command(client, target->use_container ? "VendContainer": "VendDocuments", target->appid) != HOUSE_ARREST_E_SUCCESS) {
+		if (verbose)
+			fprintf(stderr, "Could not send house_arrest command!\n");
+		return -1;
+	}
+
+	plist_t dict = NULL;
+	if (house_arrest_get_result(client, &dict) != HOUSE_ARREST_E_SUCCESS) {
+		if (verbose)
+			fprintf(stderr, "Could not get result from document sharing service!\n");
+		return -1;
+	}
+	plist_t node = plist_dict_get_item(dict, "Error");
+	if (node) {
+		char *str = NULL;
+		plist_get_string_val(node, &str);
+		if (verbose) {
+			fprintf(stderr, "ERROR: %s\n", str);
+			if (str && !strcmp(str, "InstallationLookupFailed")) {
+				fprintf(stderr, "The App '%s' is either not present on the device, or the 'UIFileSharingEnabled' key is not set in its Info.plist. Starting with iOS 8.3 this key is mandatory to allow access to an app's Documents folder.\n", target->appid);
+			}
+		}
+		free(str);
+		plist_free(dict);
+		return -1;
+	}
+	plist_free(dict);
+
+	return 0;
+}
+
+/**
+ * Connects to an AFC service instance that was started through lockdownd.
+ * For an app's folder it is vended through house_arrest first.
+ *
+ * @param dev The device to connect to.
+ * @param target The file system to connect to.
+ * @param service The started service.
+ * @param verbose Whether to print errors to stderr.
+ * @param house_arrest_out Receives the house_arrest client that owns the
+ *    connection if target has an appid, NULL otherwise.
+ *
+ * @return A new AFC client or NULL on error.
+ */
+afc_client_t afc_connect_client(idevice_t dev, const struct afc_target *target, lockdownd_service_descriptor_t service, int verbose, house_arrest_client_t *house_arrest_out)
+{
+	house_arrest_client_t ha = NULL;
+	afc_client_t afc = NULL;
+
+	*house_arrest_out = NULL;
+
+	if (target->appid) {
+		house_arrest_client_new(dev, service, &ha);
+		if (!ha) {
+			if (verbose)
+				fprintf(stderr, "Could not start document sharing service!\n");
+			return NULL;
+		}
+		if (house_arrest_vend(ha, target, verbose) == 0) {
+			afc_client_new_from_house_arrest_client(ha, &afc);
+		}
+		if (afc) {
+			*house_arrest_out = ha;
+		} else {
+			house_arrest_client_free(ha);
+		}
+	} else {
+		afc_client_new(dev, service, &afc);
+	}
+
+	return afc;
+}
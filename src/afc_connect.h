@@ -0,0 +1,48 @@
+/*
+ * afc_connect.h
+ * Connection setup shared by ifuse and ifuse-cp.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __AFC_CONNECT_H
+#define __AFC_CONNECT_H
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/house_arrest.h>
+
+#define AFC_SERVICE_NAME "com.apple.afc"
+#define AFC2_SERVICE_NAME "com.apple.afc2"
+#define HOUSE_ARREST_SERVICE_NAME "com.apple.mobile.house_arrest"
+
+/* the file system to connect to */
+struct afc_target {
+	/* AFC_SERVICE_NAME, AFC2_SERVICE_NAME or HOUSE_ARREST_SERVICE_NAME */
+	const char *service_name;
+	/* the app whose folder is vended through house_arrest, NULL otherwise */
+	const char *appid;
+	/* vend the whole container instead of the Documents folder */
+	int use_container;
+};
+
+int afc_connect_lockdown(idevice_t dev, const char *label, lockdownd_client_t *lockdown);
+int afc_connect_start_services(idevice_t dev, lockdownd_client_t lockdown, const struct afc_target *target, unsigned int count, lockdownd_service_descriptor_t *services);
+afc_client_t afc_connect_client(idevice_t dev, const struct afc_target *target, lockdownd_service_descriptor_t service, int verbose, house_arrest_client_t *house_arrest_out);
+
+#endif
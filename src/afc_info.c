@@ -0,0 +1,208 @@
+/*
+ * afc_info.c
+ * Decoding of AFC file information and error codes.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "afc_info.h"
+
+/* indexed by the AFC error code, 0 marks codes without a mapping */
+static const int afc_errno_map[] = {
+	[AFC_E_UNKNOWN_ERROR]         = EIO,
+	[AFC_E_OP_HEADER_INVALID]     = EIO,
+	[AFC_E_NO_RESOURCES]          = EMFILE,
+	[AFC_E_READ_ERROR]            = ENOTDIR,
+	[AFC_E_WRITE_ERROR]           = EIO,
+	[AFC_E_UNKNOWN_PACKET_TYPE]   = EIO,
+	[AFC_E_INVALID_ARG]           = EINVAL,
+	[AFC_E_OBJECT_NOT_FOUND]      = ENOENT,
+	[AFC_E_OBJECT_IS_DIR]         = EISDIR,
+	[AFC_E_PERM_DENIED]           = EPERM,
+	[AFC_E_SERVICE_NOT_CONNECTED] = ENXIO,
+	[AFC_E_OP_TIMEOUT]            = ETIMEDOUT,
+	[AFC_E_TOO_MUCH_DATA]         = EFBIG,
+	[AFC_E_END_OF_DATA]           = ENODATA,
+	[AFC_E_OP_NOT_SUPPORTED]      = ENOSYS,
+	[AFC_E_OBJECT_EXISTS]         = EEXIST,
+	[AFC_E_OBJECT_BUSY]           = EBUSY,
+	[AFC_E_NO_SPACE_LEFT]         = ENOSPC,
+	[AFC_E_OP_WOULD_BLOCK]        = EWOULDBLOCK,
+	[AFC_E_IO_ERROR]              = EIO,
+	[AFC_E_OP_INTERRUPTED]        = EINTR,
+	[AFC_E_OP_IN_PROGRESS]        = EALREADY,
+	[AFC_E_INTERNAL_ERROR]        = EIO,
+	[AFC_E_MUX_ERROR]             = EIO,
+	[AFC_E_NO_MEM]                = ENOMEM,
+	[AFC_E_NOT_ENOUGH_DATA]       = EIO,
+	[AFC_E_DIR_NOT_EMPTY]         = ENOTEMPTY,
+};
+
+/**
+ * Tries to convert the AFC error value into a meaningful errno value.
+ *
+ * @param error The AFC error code.
+ *
+ * @return errno value, 0 for AFC_E_SUCCESS.
+ */
+int afc_info_errno(afc_error_t error)
+{
+	if (error == AFC_E_SUCCESS)
+		return 0;
+
+	if (error > 0 && (size_t)error < sizeof(afc_errno_map) / sizeof(afc_errno_map[0]) && afc_errno_map[error])
+		return afc_errno_map[error];
+
+	fprintf(stderr, "Unknown AFC status %d.\n", error);
+	return EIO;
+}
+
+/**
+ * Converts the st_ifmt value of a file information reply, e.g. "S_IFDIR",
+ * into the file type bits of st_mode. Only the character that tells the
+ * names apart is looked at before the one comparison that confirms it.
+ *
+ * @return The file type or 0 if it is not known.
+ */
+mode_t afc_info_ifmt(const char *ifmt)
+{
+	const char *name;
+	mode_t mode;
+
+	if (strncmp(ifmt, "S_IF", 4) != 0)
+		return 0;
+
+	switch (ifmt[4]) {
+	case 'R':
+		name = "REG";
+		mode = S_IFREG;
+		break;
+	case 'D':
+		name = "DIR";
+		mode = S_IFDIR;
+		break;
+	case 'L':
+		name = "LNK";
+		mode = S_IFLNK;
+		break;
+	case 'B':
+		name = "BLK";
+		mode = S_IFBLK;
+		break;
+	case 'C':
+		name = "CHR";
+		mode = S_IFCHR;
+		break;
+	case 'I':
+		name = "IFO";
+		mode = S_IFIFO;
+		break;
+	case 'S':
+		name = "SOCK";
+		mode = S_IFSOCK;
+		break;
+	default:
+		return 0;
+	}
+
+	return strcmp(ifmt + 4, name) ? 0 : mode;
+}
+
+static uint64_t parse_uint(const char *str)
+{
+	uint64_t val = 0;
+
+	while (*str >= '0' && *str <= '9') {
+		val = val * 10 + (uint64_t)(*str - '0');
+		str++;
+	}
+
+	return val;
+}
+
+/**
+ * Fills stbuf from the key/value list returned by afc_get_file_info() in a
+ * single pass without allocating memory. Like for st_ifmt, the key is told
+ * apart by one character and confirmed with one comparison. Only the type
+ * bits of st_mode are set; unknown keys are ignored.
+ *
+ * @param info The list of alternating keys and values.
+ * @param stbuf Receives the attributes, it has to be zeroed by the caller.
+ *
+ * @return The LinkTarget value if present, pointing into info, or NULL.
+ */
+const char *afc_info_decode(char **info, struct stat *stbuf)
+{
+	const char *link_target = NULL;
+	const char *key;
+	const char *val;
+	int i;
+
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		key = info[i];
+		val = info[i+1];
+		if (key[0] == 'L') {
+			if (!strcmp(key, "LinkTarget"))
+				link_target = val;
+			continue;
+		}
+		if (strncmp(key, "st_", 3) != 0)
+			continue;
+		switch (key[3]) {
+		case 's':
+			if (!strcmp(key + 3, "size"))
+				stbuf->st_size = parse_uint(val);
+			break;
+		case 'b':
+			if (!strcmp(key + 3, "blocks")) {
+				stbuf->st_blocks = parse_uint(val);
+			}
+#ifdef _DARWIN_FEATURE_64_BIT_INODE
+			/* available on iOS 7+ */
+			else if (!strcmp(key + 3, "birthtime")) {
+				stbuf->st_birthtime = (time_t)(parse_uint(val) / 1000000000);
+			}
+#endif
+			break;
+		case 'n':
+			if (!strcmp(key + 3, "nlink"))
+				stbuf->st_nlink = parse_uint(val);
+			break;
+		case 'i':
+			if (!strcmp(key + 3, "ifmt"))
+				stbuf->st_mode = afc_info_ifmt(val);
+			break;
+		case 'm':
+			if (!strcmp(key + 3, "mtime"))
+				stbuf->st_mtime = (time_t)(parse_uint(val) / 1000000000);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return link_target;
+}
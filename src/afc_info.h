@@ -0,0 +1,32 @@
+/*
+ * afc_info.h
+ * Decoding of AFC file information and error codes.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __AFC_INFO_H
+#define __AFC_INFO_H
+
+#include <sys/stat.h>
+#include <libimobiledevice/afc.h>
+
+int afc_info_errno(afc_error_t error);
+mode_t afc_info_ifmt(const char *ifmt);
+const char *afc_info_decode(char **info, struct stat *stbuf);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * afc_pool.c
+ * A pool of AFC connections shared by the fuse worker threads.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "afc_pool.h"
+
+/**
+ * Creates a new, empty connection pool.
+ *
+ * @param capacity Maximum number of connections the pool can hold.
+ *
+ * @return The new pool or NULL on error.
+ */
+afc_pool_t afc_pool_new(unsigned int capacity)
+{
+	afc_pool_t pool;
+
+	if (capacity == 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(struct afc_pool));
+	if (!pool)
+		return NULL;
+
+	pool->conns = calloc(capacity, sizeof(struct afc_conn));
+	if (!pool->conns) {
+		free(pool);
+		return NULL;
+	}
+	pool->capacity = capacity;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	return pool;
+}
+
+/**
+ * Frees the pool and all AFC clients it holds.
+ */
+void afc_pool_free(afc_pool_t pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->count; i++) {
+		afc_client_free(pool->conns[i].client);
+		if (pool->conns[i].house_arrest) {
+			house_arrest_client_free(pool->conns[i].house_arrest);
+		}
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->conns);
+	free(pool);
+}
+
+/**
+ * Adds an already connected AFC client to the pool. The pool takes
+ * ownership of the client.
+ *
+ * @param pool The pool to add the client to.
+ * @param client The connected AFC client.
+ * @param house_arrest The house_arrest client the AFC client was created
+ *    from, or NULL. It owns the underlying connection and is freed together
+ *    with the AFC client.
+ *
+ * @return 0 on success, -1 if the pool is full.
+ */
+int afc_pool_add(afc_pool_t pool, afc_client_t client, house_arrest_client_t house_arrest)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->count < pool->capacity) {
+		pool->conns[pool->count].client = client;
+		pool->conns[pool->count].house_arrest = house_arrest;
+		pool->conns[pool->count].users = 0;
+		pool->count++;
+		res = 0;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return res;
+}
+
+static struct afc_conn *find_idle(afc_pool_t pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->count; i++) {
+		if (pool->conns[i].users == 0)
+			return &pool->conns[i];
+	}
+	return NULL;
+}
+
+/**
+ * Checks out an idle connection of the pool for one operation. If every
+ * connection is busy, the request waits in a queue shared by all
+ * connections and is served by whichever connection becomes idle first,
+ * in the order the requests arrived. This keeps all connections busy,
+ * while a request queued on a specific connection might wait behind a
+ * large transfer although another connection is idle already.
+ *
+ * A pool without connections is waited on until afc_pool_add() adds the
+ * first one, so this never returns NULL.
+ *
+ * @return The connection; must be handed back with afc_pool_release().
+ */
+struct afc_conn *afc_pool_acquire(afc_pool_t pool)
+{
+	struct afc_conn *conn = NULL;
+	unsigned long ticket;
+
+	pthread_mutex_lock(&pool->mutex);
+	ticket = pool->next_ticket++;
+	while (ticket != pool->serving || !(conn = find_idle(pool))) {
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+	pool->serving++;
+	conn->users++;
+	/* the next request in line might find another idle connection */
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return conn;
+}
+
+/**
+ * Checks out an idle connection without waiting, and only if no other
+ * request is waiting for one. Background work uses this so that it never
+ * delays regular operations.
+ *
+ * @return The connection; must be handed back with afc_pool_release().
+ *    NULL if no connection is available right now.
+ */
+struct afc_conn *afc_pool_try_acquire(afc_pool_t pool)
+{
+	struct afc_conn *conn = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->next_ticket == pool->serving && (conn = find_idle(pool))) {
+		pool->next_ticket++;
+		pool->serving++;
+		conn->users++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return conn;
+}
+
+/**
+ * Marks a specific connection as busy, used for operations on file
+ * handles which are bound to the connection that opened them.
+ */
+void afc_pool_hold(afc_pool_t pool, struct afc_conn *conn)
+{
+	pthread_mutex_lock(&pool->mutex);
+	conn->users++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Hands a connection back after afc_pool_acquire() or afc_pool_hold().
+ */
+void afc_pool_release(afc_pool_t pool, struct afc_conn *conn)
+{
+	if (!conn)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (conn->users > 0)
+		conn->users--;
+	if (conn->users == 0)
+		pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Marks the pool as used by someone who does not hold a connection right
+ * now, e.g. an open file. The owner of the pool must not free it while it
+ * is in use, see afc_pool_in_use().
+ */
+void afc_pool_ref(afc_pool_t pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->refs++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Drops a use of the pool taken with afc_pool_ref(). This does not free
+ * the pool.
+ */
+void afc_pool_unref(afc_pool_t pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->refs > 0)
+		pool->refs--;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Checks whether the pool is still used, i.e. it is referenced, one of
+ * its connections is checked out or a request waits for one.
+ *
+ * @return 1 if the pool is in use, 0 if it can be freed.
+ */
+int afc_pool_in_use(afc_pool_t pool)
+{
+	unsigned int i;
+	int res;
+
+	pthread_mutex_lock(&pool->mutex);
+	res = (pool->refs > 0 || pool->next_ticket != pool->serving);
+	for (i = 0; i < pool->count && !res; i++) {
+		res = (pool->conns[i].users > 0);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return res;
+}
@@ -0,0 +1,65 @@
+/*
+ * afc_pool.h
+ * A pool of AFC connections shared by the fuse worker threads.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __AFC_POOL_H
+#define __AFC_POOL_H
+
+#include <pthread.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/house_arrest.h>
+
+/* upper limit for the afc_connections mount option */
+#define AFC_POOL_MAX_CONNECTIONS 16
+
+struct afc_conn {
+	afc_client_t client;
+	house_arrest_client_t house_arrest;
+	unsigned int users;
+};
+
+struct afc_pool {
+	pthread_mutex_t mutex;
+	/* signalled when a connection becomes idle */
+	pthread_cond_t cond;
+	unsigned int count;
+	unsigned int capacity;
+	struct afc_conn *conns;
+	/* requests waiting for an idle connection are served in this order */
+	unsigned long next_ticket;
+	unsigned long serving;
+	/* users that keep the pool without holding a connection */
+	unsigned int refs;
+};
+
+typedef struct afc_pool *afc_pool_t;
+
+afc_pool_t afc_pool_new(unsigned int capacity);
+void afc_pool_free(afc_pool_t pool);
+int afc_pool_add(afc_pool_t pool, afc_client_t client, house_arrest_client_t house_arrest);
+struct afc_conn *afc_pool_acquire(afc_pool_t pool);
+struct afc_conn *afc_pool_try_acquire(afc_pool_t pool);
+void afc_pool_hold(afc_pool_t pool, struct afc_conn *conn);
+void afc_pool_release(afc_pool_t pool, struct afc_conn *conn);
+void afc_pool_ref(afc_pool_t pool);
+void afc_pool_unref(afc_pool_t pool);
+int afc_pool_in_use(afc_pool_t pool);
+
+#endif
@@ -0,0 +1,436 @@
+/*
+ * checksum.c
+ * SHA-256 and CRC32C of file content, computed while it is read.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CHECKSUM_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++) {
+			w[i] = ((uint32_t)data[4*i] << 24) | ((uint32_t)data[4*i+1] << 16) | ((uint32_t)data[4*i+2] << 8) | data[4*i+3];
+		}
+		for (i = 16; i < 64; i++) {
+			uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += 64;
+	}
+}
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len--) {
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+#ifdef CHECKSUM_X86
+/* the SHA extensions do four rounds per pair of instructions, see Intel's
+ * "New Instructions Supporting the Secure Hash Algorithm on Intel
+ * Architecture Processors" */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp;
+	__m128i m[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16*i)), mask);
+			} else {
+				tmp = _mm_alignr_epi8(m[(i-1) & 3], m[(i-2) & 3], 4);
+				m[i & 3] = _mm_sha256msg1_epu32(m[i & 3], m[(i-3) & 3]);
+				m[i & 3] = _mm_add_epi32(m[i & 3], tmp);
+				m[i & 3] = _mm_sha256msg2_epu32(m[i & 3], m[(i-1) & 3]);
+			}
+			msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[4*i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#ifdef __x86_64__
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = (uint32_t)_mm_crc32_u64(crc, v);
+		p += 8;
+		len -= 8;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+
+	return ~crc;
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t state[8], const uint8_t *data, size_t blocks) = sha256_blocks_generic;
+static uint32_t (*crc32c_blocks)(uint32_t crc, const uint8_t *p, size_t len) = crc32c_generic;
+static const char *impl_name = "generic";
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the fastest implementations the CPU supports.
+ */
+static void checksum_setup(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+
+#ifdef CHECKSUM_X86
+	unsigned int eax, ebx, ecx, edx;
+	int sse42 = 0, ssse3 = 0, sse41 = 0, sha = 0;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		ssse3 = (ecx & bit_SSSE3) != 0;
+		sse41 = (ecx & bit_SSE4_1) != 0;
+		sse42 = (ecx & bit_SSE4_2) != 0;
+	}
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		sha = (ebx & (1 << 29)) != 0;
+	}
+	if (sse42) {
+		crc32c_blocks = crc32c_sse42;
+		impl_name = "sse4.2";
+	}
+	if (sha && ssse3 && sse41) {
+		sha256_blocks = sha256_blocks_shani;
+		impl_name = sse42 ? "sha-ni+sse4.2" : "sha-ni";
+	}
+#endif
+}
+
+/**
+ * @return The name of the implementation in use, e.g. for debug output.
+ */
+const char *checksum_impl(void)
+{
+	pthread_once(&checksum_once, checksum_setup);
+	return impl_name;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	pthread_once(&checksum_once, checksum_setup);
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	size_t used = ctx->count % 64;
+
+	ctx->count += len;
+	if (used > 0) {
+		size_t n = 64 - used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_blocks(ctx->state, ctx->buf, 1);
+	}
+	if (len >= 64) {
+		sha256_blocks(ctx->state, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+	if (len > 0) {
+		memcpy(ctx->buf, p, len);
+	}
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[CHECKSUM_SHA256_LEN])
+{
+	uint64_t bits = ctx->count * 8;
+	uint8_t pad[72];
+	size_t padlen = 64 - (ctx->count % 64);
+	int i;
+
+	if (padlen < 9) {
+		padlen += 64;
+	}
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) {
+		pad[padlen - 1 - i] = (uint8_t)(bits >> (8 * i));
+	}
+	sha256_update(ctx, pad, padlen);
+
+	for (i = 0; i < 8; i++) {
+		digest[4*i] = (uint8_t)(ctx->state[i] >> 24);
+		digest[4*i+1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[4*i+2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[4*i+3] = (uint8_t)ctx->state[i];
+	}
+}
+
+/**
+ * Continues a CRC32C (Castagnoli) computation.
+ *
+ * @param crc 0 for the first piece, the previous result for the others.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&checksum_once, checksum_setup);
+	return crc32c_blocks(crc, (const uint8_t*)data, len);
+}
+
+/* data that arrived ahead of the position the checksums got to */
+struct checksum_piece {
+	uint64_t offset;
+	size_t len;
+	struct checksum_piece *next;
+	char data[];
+};
+
+/*
+ * The kernel reads a file in order, but with asynchronous reads the
+ * requests can arrive slightly reordered. Data ahead of the current
+ * position is therefore held back up to CHECKSUM_MAX_AHEAD bytes; reads
+ * further ahead or going back before the position end the computation.
+ */
+struct checksum_stream {
+	struct sha256_ctx sha;
+	uint32_t crc;
+	uint64_t pos;
+	uint64_t size;
+	struct checksum_piece *ahead;
+	size_t ahead_bytes;
+	int failed;
+};
+
+/**
+ * Starts computing the checksums of a file.
+ *
+ * @param size The size of the file.
+ *
+ * @return A new stream or NULL when out of memory.
+ */
+checksum_stream_t checksum_stream_new(uint64_t size)
+{
+	checksum_stream_t s = calloc(1, sizeof(struct checksum_stream));
+
+	if (!s)
+		return NULL;
+	sha256_init(&s->sha);
+	s->size = size;
+
+	return s;
+}
+
+static void checksum_stream_drop(checksum_stream_t s)
+{
+	while (s->ahead) {
+		struct checksum_piece *next = s->ahead->next;
+		free(s->ahead);
+		s->ahead = next;
+	}
+	s->ahead_bytes = 0;
+}
+
+void checksum_stream_free(checksum_stream_t s)
+{
+	if (!s)
+		return;
+	checksum_stream_drop(s);
+	free(s);
+}
+
+static void checksum_stream_add(checksum_stream_t s, const char *buf, size_t len, uint64_t offset)
+{
+	if (offset + len <= s->pos)
+		return;
+	buf += s->pos - offset;
+	len -= s->pos - offset;
+	sha256_update(&s->sha, buf, len);
+	s->crc = crc32c_update(s->crc, buf, len);
+	s->pos += len;
+}
+
+/**
+ * Passes data read from the file to the checksums.
+ *
+ * @param s The stream.
+ * @param buf The data.
+ * @param len Its length.
+ * @param offset Its position in the file.
+ *
+ * @return 1 once the whole file was seen, -1 if the checksums can not be
+ *    computed from the reads done so far, 0 otherwise.
+ */
+int checksum_stream_feed(checksum_stream_t s, const char *buf, size_t len, uint64_t offset)
+{
+	struct checksum_piece **pp, *piece;
+
+	if (s->failed)
+		return -1;
+	if (s->pos == s->size)
+		return 1;
+
+	if (offset > s->pos) {
+		if (s->ahead_bytes + len > CHECKSUM_MAX_AHEAD || !(piece = malloc(sizeof(struct checksum_piece) + len))) {
+			s->failed = 1;
+			checksum_stream_drop(s);
+			return -1;
+		}
+		piece->offset = offset;
+		piece->len = len;
+		memcpy(piece->data, buf, len);
+		for (pp = &s->ahead; *pp && (*pp)->offset < offset; pp = &(*pp)->next);
+		piece->next = *pp;
+		*pp = piece;
+		s->ahead_bytes += len;
+		return 0;
+	}
+
+	checksum_stream_add(s, buf, len, offset);
+	while (s->ahead && s->ahead->offset <= s->pos) {
+		piece = s->ahead;
+		s->ahead = piece->next;
+		s->ahead_bytes -= piece->len;
+		checksum_stream_add(s, piece->data, piece->len, piece->offset);
+		free(piece);
+	}
+
+	if (s->pos > s->size) {
+		/* the file grew, the checksums would not match what was stat'ed */
+		s->failed = 1;
+		checksum_stream_drop(s);
+		return -1;
+	}
+
+	return (s->pos == s->size) ? 1 : 0;
+}
+
+/**
+ * Gets the checksums of a stream for which checksum_stream_feed() returned
+ * 1. The stream can not be fed afterwards.
+ */
+void checksum_stream_result(checksum_stream_t s, struct checksum *sum)
+{
+	sha256_final(&s->sha, sum->sha256);
+	sum->crc32c = s->crc;
+}
@@ -0,0 +1,58 @@
+/*
+ * checksum.h
+ * SHA-256 and CRC32C of file content, computed while it is read.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHECKSUM_SHA256_LEN 32
+/* data arriving out of order is kept up to this amount */
+#define CHECKSUM_MAX_AHEAD (8 * 1024 * 1024)
+
+struct checksum {
+	uint8_t sha256[CHECKSUM_SHA256_LEN];
+	uint32_t crc32c;
+};
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[CHECKSUM_SHA256_LEN]);
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+const char *checksum_impl(void);
+
+typedef struct checksum_stream *checksum_stream_t;
+
+checksum_stream_t checksum_stream_new(uint64_t size);
+void checksum_stream_free(checksum_stream_t s);
+int checksum_stream_feed(checksum_stream_t s, const char *buf, size_t len, uint64_t offset);
+void checksum_stream_result(checksum_stream_t s, struct checksum *sum);
+
+#endif
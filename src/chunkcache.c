@@ -0,0 +1,556 @@
+/*
+ * chunkcache.c
+ * Persistent on-disk cache for the content of device files.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "chunkcache.h"
+
+/* "ichk" */
+#define CHUNK_MAGIC 0x6b686369
+
+/* every chunk file starts with this header, followed by the key and the data;
+ * the key guards against hash collisions */
+struct chunk_header {
+	uint32_t magic;
+	uint32_t keylen;
+	uint64_t datalen;
+};
+
+struct chunk_entry {
+	/* relative to the cache directory, e.g. "3f/3f0123456789abcd-42" */
+	char name[48];
+	uint32_t hash;
+	uint64_t size;
+	time_t mtime;
+	struct chunk_entry *hnext;
+	struct chunk_entry *lru_prev;
+	struct chunk_entry *lru_next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	char *dir;
+	struct chunk_entry **buckets;
+	uint32_t bucket_mask;
+	/* most recently used chunk is at lru_head */
+	struct chunk_entry *lru_head;
+	struct chunk_entry *lru_tail;
+	uint64_t used;
+	uint64_t max_size;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, NULL, NULL, 0, 0 };
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* 64 bit FNV-1a, names the chunk files of a key */
+static uint64_t key_hash(const char *key)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void chunk_name(const char *key, uint64_t index, char *name, size_t size)
+{
+	uint64_t h = key_hash(key);
+
+	snprintf(name, size, "%02x/%016" PRIx64 "-%" PRIu64, (unsigned int)(h >> 56), h, index);
+}
+
+static void lru_unlink(struct chunk_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		cache.lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		cache.lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct chunk_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache.lru_head;
+	if (cache.lru_head)
+		cache.lru_head->lru_prev = e;
+	cache.lru_head = e;
+	if (!cache.lru_tail)
+		cache.lru_tail = e;
+}
+
+static struct chunk_entry *lookup(const char *name, uint32_t hash)
+{
+	struct chunk_entry *e;
+
+	for (e = cache.buckets[hash & cache.bucket_mask]; e; e = e->hnext) {
+		if (e->hash == hash && !strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+static void insert(struct chunk_entry *e)
+{
+	e->hnext = cache.buckets[e->hash & cache.bucket_mask];
+	cache.buckets[e->hash & cache.bucket_mask] = e;
+	lru_push_front(e);
+	cache.used += e->size;
+}
+
+/* drops the entry and, if unlink_file is set, its file */
+static void remove_entry(struct chunk_entry *e, int unlink_file)
+{
+	struct chunk_entry **pp = &cache.buckets[e->hash & cache.bucket_mask];
+
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+	lru_unlink(e);
+	cache.used -= e->size;
+	if (unlink_file) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", cache.dir, e->name);
+		unlink(path);
+	}
+	free(e);
+}
+
+static void evict(void)
+{
+	while (cache.used > cache.max_size && cache.lru_tail) {
+		remove_entry(cache.lru_tail, 1);
+	}
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t r = read(fd, (char*)buf + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t r = write(fd, (const char*)buf + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+
+static int compare_mtime(const void *a, const void *b)
+{
+	const struct chunk_entry *ea = *(struct chunk_entry * const *)a;
+	const struct chunk_entry *eb = *(struct chunk_entry * const *)b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* checks that name, found in the directory of bucket, is one that
+ * chunk_name() gives, so that eviction removes the file it was read from */
+static int is_chunk_name(const char *name, unsigned int bucket)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t digits;
+
+	if (strspn(name, hex) != 16 || name[16] != '-')
+		return 0;
+	digits = strspn(name + 17, "0123456789");
+	if (digits == 0 || digits > 20 || name[17 + digits] != '\0')
+		return 0;
+
+	return name[0] == hex[bucket >> 4] && name[1] == hex[bucket & 15];
+}
+
+/* picks up the chunks left by earlier mounts, least recently used first */
+static void scan(void)
+{
+	struct chunk_entry **found = NULL;
+	size_t count = 0, capacity = 0;
+	char path[PATH_MAX];
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < 256; i++) {
+		struct dirent *ent;
+		DIR *dir;
+
+		snprintf(path, sizeof(path), "%s/%02x", cache.dir, i);
+		dir = opendir(path);
+		if (!dir)
+			continue;
+		while ((ent = readdir(dir))) {
+			struct chunk_entry *e;
+			struct stat st;
+			size_t len;
+
+			if (ent->d_name[0] == '.') {
+				/* a chunk that was still being written */
+				if (!strncmp(ent->d_name, ".tmp", 4) && unlinkat(dirfd(dir), ent->d_name, 0) < 0) {
+					fprintf(stderr, "WARNING: Could not remove %s/%s from the cache\n", path, ent->d_name);
+				}
+				continue;
+			}
+			len = strlen(ent->d_name);
+			if (!is_chunk_name(ent->d_name, i) || 3 + len >= sizeof(e->name))
+				continue;
+			if (fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+				continue;
+			if (count == capacity) {
+				struct chunk_entry **grown = realloc(found, (capacity ? capacity * 2 : 256) * sizeof(struct chunk_entry*));
+				if (!grown)
+					break;
+				found = grown;
+				capacity = capacity ? capacity * 2 : 256;
+			}
+			e = calloc(1, sizeof(struct chunk_entry));
+			if (!e)
+				break;
+			snprintf(e->name, 4, "%02x/", i);
+			memcpy(e->name + 3, ent->d_name, len + 1);
+			e->hash = name_hash(e->name);
+			e->size = st.st_size;
+			e->mtime = st.st_mtime;
+			found[count++] = e;
+		}
+		closedir(dir);
+	}
+
+	if (!found)
+		return;
+	qsort(found, count, sizeof(struct chunk_entry*), compare_mtime);
+	for (j = 0; j < count; j++) {
+		insert(found[j]);
+	}
+	free(found);
+}
+
+/**
+ * Sets up the cache in dir, which is created if needed. Chunks cached by
+ * earlier mounts are reused.
+ *
+ * @param dir The cache directory.
+ * @param max_size Upper limit of the disk space used by cached chunks.
+ *
+ * @return 0 on success or -1 if the directory can not be used.
+ */
+int chunkcache_init(const char *dir, uint64_t max_size)
+{
+	uint32_t nbuckets = 64;
+
+	if (!dir || !*dir || max_size == 0)
+		return -1;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+	if (access(dir, R_OK | W_OK | X_OK) < 0)
+		return -1;
+
+	pthread_mutex_lock(&cache.mutex);
+	cache.dir = strdup(dir);
+	cache.max_size = max_size;
+	while (nbuckets < max_size / CHUNKCACHE_CHUNK_SIZE && nbuckets < (1 << 20))
+		nbuckets <<= 1;
+	cache.buckets = calloc(nbuckets, sizeof(struct chunk_entry*));
+	cache.bucket_mask = nbuckets - 1;
+	if (!cache.dir || !cache.buckets) {
+		free(cache.dir);
+		free(cache.buckets);
+		cache.dir = NULL;
+		cache.buckets = NULL;
+		pthread_mutex_unlock(&cache.mutex);
+		return -1;
+	}
+	scan();
+	evict();
+	pthread_mutex_unlock(&cache.mutex);
+
+	return 0;
+}
+
+/**
+ * Releases the memory used by the cache. The cached chunks stay on disk.
+ */
+void chunkcache_cleanup(void)
+{
+	pthread_mutex_lock(&cache.mutex);
+	while (cache.lru_head) {
+		remove_entry(cache.lru_head, 0);
+	}
+	free(cache.buckets);
+	cache.buckets = NULL;
+	free(cache.dir);
+	cache.dir = NULL;
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Checks whether the cache was set up with chunkcache_init().
+ */
+int chunkcache_enabled(void)
+{
+	return cache.buckets != NULL;
+}
+
+/**
+ * Builds the key the chunks of a file are cached under. It changes whenever
+ * the file is modified, so stale chunks are never returned; they are evicted
+ * eventually.
+ *
+ * @param device Identifies the device and the service the file belongs to.
+ * @param path The path of the file on the device.
+ * @param size The size of the file.
+ * @param mtime The modification time of the file.
+ *
+ * @return The key, which has to be freed, or NULL on error.
+ */
+char *chunkcache_key(const char *device, const char *path, uint64_t size, int64_t mtime)
+{
+	size_t len = strlen(device) + strlen(path) + 48;
+	char *key = malloc(len);
+
+	if (!key)
+		return NULL;
+	snprintf(key, len, "%s\n%s\n%" PRIu64 "\n%" PRId64, device, path, size, mtime);
+
+	return key;
+}
+
+/**
+ * Opens a cached chunk for reading, e.g. to splice it.
+ *
+ * @param key The key of the file, see chunkcache_key().
+ * @param index The number of the chunk in the file.
+ * @param data_offset Receives the offset of the data in the chunk file.
+ * @param data_size Receives the size of the chunk.
+ *
+ * @return A file descriptor the caller has to close, or -1 if the chunk is
+ *    not cached.
+ */
+int chunkcache_open(const char *key, uint64_t index, uint64_t *data_offset, uint64_t *data_size)
+{
+	struct chunk_header hdr;
+	struct chunk_entry *e;
+	char name[48];
+	char path[PATH_MAX];
+	size_t keylen = strlen(key);
+	char *stored;
+	uint32_t hash;
+	int valid = 0;
+	int fd;
+
+	if (!chunkcache_enabled())
+		return -1;
+
+	chunk_name(key, index, name, sizeof(name));
+	hash = name_hash(name);
+
+	pthread_mutex_lock(&cache.mutex);
+	e = (cache.buckets) ? lookup(name, hash) : NULL;
+	if (e) {
+		lru_unlink(e);
+		lru_push_front(e);
+	}
+	pthread_mutex_unlock(&cache.mutex);
+	if (!e)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s", cache.dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	stored = malloc(keylen);
+	if (!stored) {
+		close(fd);
+		return -1;
+	}
+	if (read_all(fd, &hdr, sizeof(hdr)) == 0 && hdr.magic == CHUNK_MAGIC && hdr.keylen == keylen
+	    && read_all(fd, stored, keylen) == 0 && !memcmp(stored, key, keylen)) {
+		valid = 1;
+	}
+	free(stored);
+
+	if (!valid) {
+		/* a different file with the same hash, or a broken chunk */
+		close(fd);
+		pthread_mutex_lock(&cache.mutex);
+		e = (cache.buckets) ? lookup(name, hash) : NULL;
+		if (e)
+			remove_entry(e, 1);
+		pthread_mutex_unlock(&cache.mutex);
+		return -1;
+	}
+
+	/* the modification time orders the chunks for the next mount */
+	futimens(fd, NULL);
+	*data_offset = sizeof(hdr) + keylen;
+	*data_size = hdr.datalen;
+
+	return fd;
+}
+
+/**
+ * Reads from a cached chunk.
+ *
+ * @param key The key of the file, see chunkcache_key().
+ * @param index The number of the chunk in the file.
+ * @param offset Where to start reading in the chunk.
+ * @param buf Receives the data.
+ * @param size Number of bytes to read.
+ *
+ * @return Number of bytes read, which is only less than size at the end of
+ *    the chunk, or -1 if the chunk is not cached.
+ */
+ssize_t chunkcache_get(const char *key, uint64_t index, uint64_t offset, char *buf, size_t size)
+{
+	uint64_t data_offset = 0, data_size = 0;
+	ssize_t res = -1;
+	int fd;
+
+	fd = chunkcache_open(key, index, &data_offset, &data_size);
+	if (fd < 0)
+		return -1;
+
+	if (offset >= data_size) {
+		size = 0;
+	} else if (size > data_size - offset) {
+		size = data_size - offset;
+	}
+	if (size == 0 || pread(fd, buf, size, data_offset + offset) == (ssize_t)size) {
+		res = size;
+	}
+	close(fd);
+
+	return res;
+}
+
+/**
+ * Stores a chunk of a file, replacing what was cached for it before. The
+ * least recently used chunks are removed if the cache grows too large.
+ *
+ * @param key The key of the file, see chunkcache_key().
+ * @param index The number of the chunk in the file.
+ * @param buf The data.
+ * @param size The size of the chunk.
+ */
+void chunkcache_put(const char *key, uint64_t index, const char *buf, size_t size)
+{
+	struct chunk_header hdr;
+	struct chunk_entry *e, *old;
+	char name[48];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (!chunkcache_enabled())
+		return;
+
+	chunk_name(key, index, name, sizeof(name));
+
+	/* written to a temporary file first, so readers never see half a chunk */
+	snprintf(tmp, sizeof(tmp), "%s/%.2s", cache.dir, name);
+	if (mkdir(tmp, 0700) < 0 && errno != EEXIST)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s/%.2s/.tmpXXXXXX", cache.dir, name);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	hdr.magic = CHUNK_MAGIC;
+	hdr.keylen = strlen(key);
+	hdr.datalen = size;
+	snprintf(path, sizeof(path), "%s/%s", cache.dir, name);
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 || write_all(fd, key, hdr.keylen) < 0 || write_all(fd, buf, size) < 0) {
+		/* most likely the disk is full */
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return;
+	}
+
+	e = calloc(1, sizeof(struct chunk_entry));
+	if (!e) {
+		unlink(path);
+		return;
+	}
+	strcpy(e->name, name);
+	e->hash = name_hash(name);
+	e->size = sizeof(hdr) + hdr.keylen + size;
+
+	pthread_mutex_lock(&cache.mutex);
+	if (!cache.buckets) {
+		pthread_mutex_unlock(&cache.mutex);
+		free(e);
+		return;
+	}
+	old = lookup(e->name, e->hash);
+	if (old)
+		remove_entry(old, 0);
+	insert(e);
+	evict();
+	pthread_mutex_unlock(&cache.mutex);
+}
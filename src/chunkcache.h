@@ -0,0 +1,42 @@
+/*
+ * chunkcache.h
+ * Persistent on-disk cache for the content of device files.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHUNKCACHE_H
+#define __CHUNKCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* files are cached in pieces of this size */
+#define CHUNKCACHE_CHUNK_SIZE (1024 * 1024)
+/* default upper limit of the disk space used by the cache */
+#define CHUNKCACHE_DEFAULT_MAX_SIZE (1024 * 1024 * 1024)
+
+int chunkcache_init(const char *dir, uint64_t max_size);
+void chunkcache_cleanup(void);
+int chunkcache_enabled(void);
+
+char *chunkcache_key(const char *device, const char *path, uint64_t size, int64_t mtime);
+int chunkcache_open(const char *key, uint64_t index, uint64_t *data_offset, uint64_t *data_size);
+ssize_t chunkcache_get(const char *key, uint64_t index, uint64_t offset, char *buf, size_t size);
+void chunkcache_put(const char *key, uint64_t index, const char *buf, size_t size);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * dirsnap.c
+ * Compact, shared snapshots of directory listings.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirsnap.h"
+
+/*
+ * A snapshot is a single allocation: the header, the offset of every name
+ * and the names themselves back to back, each NUL terminated. This needs a
+ * fraction of the memory of a NULL terminated array of separately allocated
+ * strings for large directories, and freeing it is a single call. Snapshots
+ * never change once created, so an open directory and the listing cache can
+ * share one.
+ */
+struct dirsnap {
+	unsigned int refs;
+	uint32_t count;
+	uint32_t offsets[];
+};
+
+/**
+ * Creates a snapshot of a directory listing.
+ *
+ * @param names NULL terminated list of names, as returned by
+ *    afc_read_directory(). It is copied and can be freed afterwards.
+ *
+ * @return The snapshot with one reference, or NULL when out of memory.
+ */
+dirsnap_t dirsnap_new(char **names)
+{
+	struct dirsnap *snap;
+	size_t count = 0;
+	size_t size = 0;
+	size_t pos = 0;
+	char *arena;
+	size_t i;
+
+	while (names[count]) {
+		size += strlen(names[count]) + 1;
+		count++;
+	}
+	if (count > UINT32_MAX || size > UINT32_MAX)
+		return NULL;
+
+	snap = malloc(sizeof(struct dirsnap) + count * sizeof(uint32_t) + size);
+	if (!snap)
+		return NULL;
+	snap->refs = 1;
+	snap->count = count;
+	arena = (char*)&snap->offsets[count];
+	for (i = 0; i < count; i++) {
+		size_t len = strlen(names[i]) + 1;
+		snap->offsets[i] = pos;
+		memcpy(arena + pos, names[i], len);
+		pos += len;
+	}
+
+	return snap;
+}
+
+/**
+ * Takes another reference to a snapshot.
+ *
+ * @return snap
+ */
+dirsnap_t dirsnap_ref(dirsnap_t snap)
+{
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+
+	return snap;
+}
+
+/**
+ * Drops a reference to a snapshot, which is freed with the last one.
+ */
+void dirsnap_unref(dirsnap_t snap)
+{
+	if (!snap)
+		return;
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(snap);
+	}
+}
+
+/**
+ * Returns the number of names in a snapshot.
+ */
+uint32_t dirsnap_count(dirsnap_t snap)
+{
+	return snap->count;
+}
+
+/**
+ * Returns a name of a snapshot, which stays valid as long as the caller
+ * holds a reference.
+ *
+ * @param snap The snapshot.
+ * @param index The position of the name, less than dirsnap_count().
+ */
+const char *dirsnap_name(dirsnap_t snap, uint32_t index)
+{
+	return (const char*)&snap->offsets[snap->count] + snap->offsets[index];
+}
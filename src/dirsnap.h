@@ -0,0 +1,35 @@
+/*
+ * dirsnap.h
+ * Compact, shared snapshots of directory listings.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __DIRSNAP_H
+#define __DIRSNAP_H
+
+#include <stdint.h>
+
+typedef struct dirsnap *dirsnap_t;
+
+dirsnap_t dirsnap_new(char **names);
+dirsnap_t dirsnap_ref(dirsnap_t snap);
+void dirsnap_unref(dirsnap_t snap);
+uint32_t dirsnap_count(dirsnap_t snap);
+const char *dirsnap_name(dirsnap_t snap, uint32_t index);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * filetab.c
+ * Table of open files, indexed by the handle passed to fuse.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "filetab.h"
+
+/*
+ * A handle is the slot index plus one in the lower 32 bits and the slot's
+ * generation in the upper 32 bits. The generation changes whenever a slot
+ * is freed, so a handle that was already released is not mistaken for the
+ * file that reuses its slot. Slabs stay where they are once allocated,
+ * which lets filetab_get() work without taking a lock; only adding and
+ * removing files is serialized.
+ */
+struct filetab_slot {
+	void *file;
+	uint32_t generation;
+	/* next free slot index plus one, 0 ends the list */
+	uint32_t next_free;
+};
+
+static pthread_mutex_t filetab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct filetab_slot *slabs[FILETAB_MAX_SLABS];
+static uint32_t num_slabs = 0;
+static uint32_t free_head = 0;
+
+static struct filetab_slot *filetab_slot(uint32_t index)
+{
+	struct filetab_slot *slab;
+
+	if (index / FILETAB_SLAB_SIZE >= FILETAB_MAX_SLABS)
+		return NULL;
+	slab = __atomic_load_n(&slabs[index / FILETAB_SLAB_SIZE], __ATOMIC_ACQUIRE);
+	if (!slab)
+		return NULL;
+
+	return &slab[index % FILETAB_SLAB_SIZE];
+}
+
+/**
+ * Adds an open file to the table.
+ *
+ * @param file The file, must not be NULL.
+ *
+ * @return The handle to store in fi->fh, or 0 if the table is full or out
+ *    of memory.
+ */
+uint64_t filetab_add(void *file)
+{
+	struct filetab_slot *slot;
+	uint32_t index;
+	uint32_t i;
+	uint64_t fh;
+
+	pthread_mutex_lock(&filetab_mutex);
+	if (free_head == 0) {
+		struct filetab_slot *slab;
+		if (num_slabs == FILETAB_MAX_SLABS || !(slab = calloc(FILETAB_SLAB_SIZE, sizeof(struct filetab_slot)))) {
+			pthread_mutex_unlock(&filetab_mutex);
+			return 0;
+		}
+		for (i = 0; i < FILETAB_SLAB_SIZE; i++) {
+			slab[i].generation = 1;
+			slab[i].next_free = (i + 1 < FILETAB_SLAB_SIZE) ? num_slabs * FILETAB_SLAB_SIZE + i + 2 : 0;
+		}
+		__atomic_store_n(&slabs[num_slabs], slab, __ATOMIC_RELEASE);
+		free_head = num_slabs * FILETAB_SLAB_SIZE + 1;
+		num_slabs++;
+	}
+	index = free_head - 1;
+	slot = filetab_slot(index);
+	free_head = slot->next_free;
+	slot->next_free = 0;
+	__atomic_store_n(&slot->file, file, __ATOMIC_RELEASE);
+	fh = ((uint64_t)slot->generation << 32) | (index + 1);
+	pthread_mutex_unlock(&filetab_mutex);
+
+	return fh;
+}
+
+/**
+ * Looks up an open file in constant time without locking.
+ *
+ * @param fh A handle returned by filetab_add().
+ *
+ * @return The file or NULL if the handle is not valid (any more).
+ */
+void *filetab_get(uint64_t fh)
+{
+	struct filetab_slot *slot;
+	uint32_t index = (uint32_t)fh;
+	void *file;
+
+	if (index == 0 || !(slot = filetab_slot(index - 1)))
+		return NULL;
+	file = __atomic_load_n(&slot->file, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != (uint32_t)(fh >> 32))
+		return NULL;
+
+	return file;
+}
+
+/**
+ * Removes an open file from the table. Its handle becomes invalid and the
+ * slot is reused by a later filetab_add().
+ *
+ * @param fh A handle returned by filetab_add().
+ *
+ * @return The file that was stored under fh or NULL if fh is not valid.
+ */
+void *filetab_remove(uint64_t fh)
+{
+	struct filetab_slot *slot;
+	uint32_t index = (uint32_t)fh;
+	void *file = NULL;
+
+	pthread_mutex_lock(&filetab_mutex);
+	if (index > 0 && (slot = filetab_slot(index - 1)) && slot->file && slot->generation == (uint32_t)(fh >> 32)) {
+		file = slot->file;
+		/* skip 0 so that a zeroed handle never matches */
+		__atomic_store_n(&slot->generation, (slot->generation + 1) ? slot->generation + 1 : 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->file, NULL, __ATOMIC_RELEASE);
+		slot->next_free = free_head;
+		free_head = index;
+	}
+	pthread_mutex_unlock(&filetab_mutex);
+
+	return file;
+}
+
+/**
+ * Frees the table. Files still in it are not freed.
+ */
+void filetab_cleanup(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&filetab_mutex);
+	for (i = 0; i < num_slabs; i++) {
+		free(slabs[i]);
+		slabs[i] = NULL;
+	}
+	num_slabs = 0;
+	free_head = 0;
+	pthread_mutex_unlock(&filetab_mutex);
+}
@@ -0,0 +1,36 @@
+/*
+ * filetab.h
+ * Table of open files, indexed by the handle passed to fuse.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FILETAB_H
+#define __FILETAB_H
+
+#include <stdint.h>
+
+/* open files per slab, slabs are allocated as needed and never moved */
+#define FILETAB_SLAB_SIZE 256
+#define FILETAB_MAX_SLABS 1024
+
+uint64_t filetab_add(void *file);
+void *filetab_get(uint64_t fh);
+void *filetab_remove(uint64_t fh);
+void filetab_cleanup(void);
+
+#endif
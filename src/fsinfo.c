@@ -0,0 +1,290 @@
+/*
+ * fsinfo.c
+ * Cached file system size information of the device.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fsinfo.h"
+
+/*
+ * statfs is called very often by file managers and df, so the device is only
+ * asked once the cached information is older than the timeout. Even then the
+ * cached figures are returned right away and a helper thread refreshes them
+ * in the background. In between, space used or released through this mount
+ * is accounted locally with fsinfo_adjust().
+ */
+struct fsinfo_cache {
+	fsinfo_fetch_cb_t fetch;
+	void *ctx;
+	int valid;
+	/* queued for the refresh thread */
+	int refresh;
+	/* being refreshed by the refresh thread right now */
+	int busy;
+	double fetched;
+	struct fsinfo info;
+	struct fsinfo_cache *next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	pthread_t thread;
+	int running;
+	double timeout;
+	/* caches waiting for a refresh */
+	struct fsinfo_cache *queue;
+} refresher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *refresh_worker(void *arg)
+{
+	struct fsinfo_cache *fs;
+	struct fsinfo info;
+	int res;
+
+	pthread_mutex_lock(&refresher.mutex);
+	while (refresher.running) {
+		fs = refresher.queue;
+		if (!fs) {
+			pthread_cond_wait(&refresher.cond, &refresher.mutex);
+			continue;
+		}
+		refresher.queue = fs->next;
+		fs->next = NULL;
+		fs->busy = 1;
+		pthread_mutex_unlock(&refresher.mutex);
+
+		res = fs->fetch(fs->ctx, &info);
+
+		pthread_mutex_lock(&refresher.mutex);
+		if (res == 0) {
+			fs->info = info;
+			fs->valid = 1;
+		}
+		/* on failure keep the old figures and retry after another timeout */
+		fs->fetched = now();
+		fs->refresh = 0;
+		fs->busy = 0;
+		pthread_cond_broadcast(&refresher.done);
+	}
+	pthread_mutex_unlock(&refresher.mutex);
+
+	return NULL;
+}
+
+/**
+ * Sets the refresh interval and starts the refresh thread.
+ *
+ * @param timeout Seconds the information is used before it is refreshed,
+ *     0 to ask the device on every call.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+int fsinfo_init(double timeout)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&refresher.mutex);
+	refresher.timeout = timeout;
+	refresher.queue = NULL;
+	refresher.running = 0;
+	if (timeout > 0) {
+		refresher.running = 1;
+		if (pthread_create(&refresher.thread, NULL, refresh_worker, NULL) != 0) {
+			refresher.running = 0;
+			res = -EAGAIN;
+		}
+	}
+	pthread_mutex_unlock(&refresher.mutex);
+
+	return res;
+}
+
+void fsinfo_cleanup(void)
+{
+	int running;
+
+	pthread_mutex_lock(&refresher.mutex);
+	running = refresher.running;
+	refresher.running = 0;
+	pthread_cond_signal(&refresher.cond);
+	pthread_mutex_unlock(&refresher.mutex);
+
+	if (running) {
+		pthread_join(refresher.thread, NULL);
+	}
+}
+
+/**
+ * Creates the cached information of one device.
+ *
+ * @param fetch Callback that queries the device.
+ * @param ctx Passed to fetch.
+ *
+ * @return The new cache or NULL if out of memory.
+ */
+fsinfo_t fsinfo_new(fsinfo_fetch_cb_t fetch, void *ctx)
+{
+	fsinfo_t fs = calloc(1, sizeof(struct fsinfo_cache));
+
+	if (!fs)
+		return NULL;
+	fs->fetch = fetch;
+	fs->ctx = ctx;
+
+	return fs;
+}
+
+/**
+ * Frees the cache, waiting for a refresh of it that is in progress.
+ */
+void fsinfo_free(fsinfo_t fs)
+{
+	struct fsinfo_cache **p;
+
+	if (!fs)
+		return;
+
+	pthread_mutex_lock(&refresher.mutex);
+	for (p = &refresher.queue; *p; p = &(*p)->next) {
+		if (*p == fs) {
+			*p = fs->next;
+			break;
+		}
+	}
+	while (fs->busy) {
+		pthread_cond_wait(&refresher.done, &refresher.mutex);
+	}
+	pthread_mutex_unlock(&refresher.mutex);
+
+	free(fs);
+}
+
+/**
+ * Stores information that was obtained elsewhere, e.g. while connecting.
+ *
+ * @param fs The cache.
+ * @param info The current file system information.
+ */
+void fsinfo_set(fsinfo_t fs, const struct fsinfo *info)
+{
+	if (!fs)
+		return;
+
+	pthread_mutex_lock(&refresher.mutex);
+	fs->info = *info;
+	fs->valid = 1;
+	fs->fetched = now();
+	pthread_mutex_unlock(&refresher.mutex);
+}
+
+/**
+ * Returns the file system information. Only the first call for a device,
+ * or any call if caching is disabled, waits for the device.
+ *
+ * @param fs The cache.
+ * @param info Receives the information.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+int fsinfo_get(fsinfo_t fs, struct fsinfo *info)
+{
+	int res;
+
+	if (!fs)
+		return -EIO;
+
+	pthread_mutex_lock(&refresher.mutex);
+	if (fs->valid && refresher.running) {
+		if (!fs->refresh && now() - fs->fetched >= refresher.timeout) {
+			fs->refresh = 1;
+			fs->next = refresher.queue;
+			refresher.queue = fs;
+			pthread_cond_signal(&refresher.cond);
+		}
+		*info = fs->info;
+		pthread_mutex_unlock(&refresher.mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&refresher.mutex);
+
+	res = fs->fetch(fs->ctx, info);
+	if (res == 0) {
+		fsinfo_set(fs, info);
+	}
+
+	return res;
+}
+
+/**
+ * Accounts space used or released through this mount until the next refresh.
+ *
+ * @param fs The cache.
+ * @param used Number of bytes now in use, negative if space was released.
+ */
+void fsinfo_adjust(fsinfo_t fs, int64_t used)
+{
+	if (!fs)
+		return;
+
+	pthread_mutex_lock(&refresher.mutex);
+	if (fs->valid) {
+		if (used > 0 && (uint64_t)used > fs->info.free) {
+			fs->info.free = 0;
+		} else if (used < 0 && fs->info.free + (uint64_t)(-used) > fs->info.total) {
+			fs->info.free = fs->info.total;
+		} else {
+			fs->info.free -= used;
+		}
+	}
+	pthread_mutex_unlock(&refresher.mutex);
+}
+
+/**
+ * Discards the cached information after a change whose size is not known,
+ * so that the next fsinfo_get() asks the device again.
+ *
+ * @param fs The cache.
+ */
+void fsinfo_invalidate(fsinfo_t fs)
+{
+	if (!fs)
+		return;
+
+	pthread_mutex_lock(&refresher.mutex);
+	fs->valid = 0;
+	pthread_mutex_unlock(&refresher.mutex);
+}
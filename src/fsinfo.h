@@ -0,0 +1,59 @@
+/*
+ * fsinfo.h
+ * Cached file system size information of the device.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FSINFO_H
+#define __FSINFO_H
+
+#include <stdint.h>
+
+/* default time in seconds before the device is asked again */
+#define FSINFO_DEFAULT_TIMEOUT 5.0
+
+struct fsinfo {
+	uint64_t total;
+	uint64_t free;
+	uint32_t blocksize;
+};
+
+typedef struct fsinfo_cache *fsinfo_t;
+
+/**
+ * Queries the device for its current file system information.
+ *
+ * @param ctx The context passed to fsinfo_new().
+ * @param info Receives the information.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+typedef int (*fsinfo_fetch_cb_t)(void *ctx, struct fsinfo *info);
+
+int fsinfo_init(double timeout);
+void fsinfo_cleanup(void);
+
+fsinfo_t fsinfo_new(fsinfo_fetch_cb_t fetch, void *ctx);
+void fsinfo_free(fsinfo_t fs);
+
+void fsinfo_set(fsinfo_t fs, const struct fsinfo *info);
+int fsinfo_get(fsinfo_t fs, struct fsinfo *info);
+void fsinfo_adjust(fsinfo_t fs, int64_t used);
+void fsinfo_invalidate(fsinfo_t fs);
+
+#endif
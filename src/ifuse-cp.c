@@ -0,0 +1,592 @@
+/*
+ * ifuse-cp.c
+ * Copies directory trees from an iOS device without mounting it.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "afc_connect.h"
+#include "afc_info.h"
+
+#define DEFAULT_JOBS 4
+#define MAX_JOBS 16
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
+/* a remote path that still has to be looked at */
+struct cp_item {
+	char *remote;
+	char *local;
+	/* the path given on the command line */
+	int top;
+	struct cp_item *next;
+};
+
+static struct {
+	const char *udid;
+	int use_network;
+	int jobs;
+	uint32_t chunk_size;
+	int verbose;
+	struct afc_target target;
+	/* prepended to remote paths, "/Documents" with --documents */
+	const char *prefix;
+} opts;
+
+static idevice_t device = NULL;
+
+/* the work queue shared by all transfer threads */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct cp_item *queue_head = NULL;
+static struct cp_item *queue_tail = NULL;
+/* items queued or being processed */
+static unsigned int pending = 0;
+
+/* totals, protected by queue_mutex */
+static unsigned int files_copied = 0;
+static unsigned int files_skipped = 0;
+static unsigned int files_failed = 0;
+static uint64_t bytes_copied = 0;
+
+static double monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t len = dlen + strlen(name) + 2;
+	char *path = malloc(len);
+
+	if (!path)
+		return NULL;
+	if (dlen > 0 && dir[dlen-1] == '/')
+		snprintf(path, len, "%s%s", dir, name);
+	else
+		snprintf(path, len, "%s/%s", dir, name);
+
+	return path;
+}
+
+/**
+ * Adds a remote path to the work queue. Takes ownership of remote and local.
+ */
+static void queue_push(char *remote, char *local, int top)
+{
+	struct cp_item *item = calloc(1, sizeof(struct cp_item));
+
+	if (!item || !remote || !local) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(item);
+		free(remote);
+		free(local);
+		pthread_mutex_lock(&queue_mutex);
+		files_failed++;
+		pthread_mutex_unlock(&queue_mutex);
+		return;
+	}
+	item->remote = remote;
+	item->local = local;
+	item->top = top;
+
+	pthread_mutex_lock(&queue_mutex);
+	if (queue_tail)
+		queue_tail->next = item;
+	else
+		queue_head = item;
+	queue_tail = item;
+	pending++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Takes the next item off the work queue, waiting while other threads may
+ * still add more.
+ *
+ * @return The item or NULL when everything has been processed.
+ */
+static struct cp_item *queue_pop(void)
+{
+	struct cp_item *item;
+
+	pthread_mutex_lock(&queue_mutex);
+	while (!queue_head && pending > 0)
+		pthread_cond_wait(&queue_cond, &queue_mutex);
+	item = queue_head;
+	if (item) {
+		queue_head = item->next;
+		if (!queue_head)
+			queue_tail = NULL;
+	}
+	pthread_mutex_unlock(&queue_mutex);
+
+	return item;
+}
+
+static void queue_done(struct cp_item *item)
+{
+	free(item->remote);
+	free(item->local);
+	free(item);
+
+	pthread_mutex_lock(&queue_mutex);
+	if (--pending == 0)
+		pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+static void count_file(int copied, int failed, uint64_t bytes)
+{
+	pthread_mutex_lock(&queue_mutex);
+	if (failed)
+		files_failed++;
+	else if (copied)
+		files_copied++;
+	else
+		files_skipped++;
+	bytes_copied += bytes;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Lists a remote directory and queues all of its entries, so that they are
+ * looked at by all threads in parallel.
+ */
+static int copy_dir(afc_client_t afc, struct cp_item *item)
+{
+	char **list = NULL;
+	afc_error_t err;
+	int i;
+
+	if (mkdir(item->local, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "ERROR: Could not create directory %s: %s\n", item->local, strerror(errno));
+		return -1;
+	}
+
+	err = afc_read_directory(afc, item->remote, &list);
+	if (err != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not read directory %s (%d)\n", item->remote, err);
+		return -1;
+	}
+	for (i = 0; list[i]; i++) {
+		if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+			continue;
+		queue_push(join_path(item->remote, list[i]), join_path(item->local, list[i]), 0);
+	}
+	afc_dictionary_free(list);
+
+	return 0;
+}
+
+/**
+ * Copies a regular file in chunks of the configured size, unless the local
+ * copy already has the same size and modification time.
+ */
+static void copy_file(afc_client_t afc, struct cp_item *item, uint64_t size, time_t mtime, char *buf)
+{
+	struct timespec times[2];
+	struct stat st;
+	uint64_t handle = 0;
+	uint64_t total = 0;
+	uint32_t bytes;
+	afc_error_t err;
+	int fd;
+
+	if (lstat(item->local, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == size && st.st_mtime == mtime) {
+		count_file(0, 0, 0);
+		return;
+	}
+
+	err = afc_file_open(afc, item->remote, AFC_FOPEN_RDONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not open %s (%d)\n", item->remote, err);
+		count_file(0, 1, 0);
+		return;
+	}
+	fd = open(item->local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not create %s: %s\n", item->local, strerror(errno));
+		afc_file_close(afc, handle);
+		count_file(0, 1, 0);
+		return;
+	}
+
+	while (1) {
+		bytes = 0;
+		err = afc_file_read(afc, handle, buf, opts.chunk_size, &bytes);
+		if (err != AFC_E_SUCCESS || bytes == 0)
+			break;
+		if (write(fd, buf, bytes) != (ssize_t)bytes) {
+			fprintf(stderr, "ERROR: Could not write %s: %s\n", item->local, strerror(errno));
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		total += bytes;
+	}
+	afc_file_close(afc, handle);
+
+	if (err == AFC_E_SUCCESS && total != size) {
+		fprintf(stderr, "WARNING: %s changed while it was copied\n", item->remote);
+	}
+	if (err == AFC_E_SUCCESS) {
+		times[0].tv_sec = times[1].tv_sec = mtime;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		futimens(fd, times);
+	}
+	if (close(fd) != 0 && err == AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not write %s: %s\n", item->local, strerror(errno));
+		err = AFC_E_IO_ERROR;
+	}
+	if (err != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not copy %s (%d)\n", item->remote, err);
+		unlink(item->local);
+		count_file(0, 1, total);
+		return;
+	}
+	if (opts.verbose)
+		printf("%s\n", item->local);
+	count_file(1, 0, total);
+}
+
+static void copy_link(struct cp_item *item, const char *target)
+{
+	char buf[4096];
+	ssize_t len;
+
+	len = readlink(item->local, buf, sizeof(buf)-1);
+	if (len >= 0) {
+		buf[len] = '\0';
+		if (!strcmp(buf, target)) {
+			count_file(0, 0, 0);
+			return;
+		}
+		unlink(item->local);
+	}
+	if (symlink(target, item->local) != 0) {
+		fprintf(stderr, "ERROR: Could not create symlink %s: %s\n", item->local, strerror(errno));
+		count_file(0, 1, 0);
+		return;
+	}
+	if (opts.verbose)
+		printf("%s -> %s\n", item->local, target);
+	count_file(1, 0, 0);
+}
+
+static void copy_item(afc_client_t afc, struct cp_item *item, char *buf)
+{
+	char **info = NULL;
+	const char *target;
+	struct stat st;
+	afc_error_t err;
+
+	err = afc_get_file_info(afc, item->remote, &info);
+	if (err != AFC_E_SUCCESS || !info) {
+		fprintf(stderr, "ERROR: Could not get information about %s (%d)\n", item->remote, err);
+		count_file(0, 1, 0);
+		return;
+	}
+
+	memset(&st, 0, sizeof(st));
+	target = afc_info_decode(info, &st);
+	if (S_ISDIR(st.st_mode)) {
+		if (copy_dir(afc, item) < 0)
+			count_file(0, 1, 0);
+	} else if (S_ISREG(st.st_mode)) {
+		/* a single file is copied into LOCAL_DIR */
+		if (item->top) {
+			const char *name = strrchr(item->remote, '/');
+			char *local = join_path(item->local, name ? name+1 : item->remote);
+			if (local) {
+				free(item->local);
+				item->local = local;
+			}
+		}
+		copy_file(afc, item, st.st_size, st.st_mtime, buf);
+	} else if (S_ISLNK(st.st_mode)) {
+		if (target)
+			copy_link(item, target);
+		else
+			count_file(0, 1, 0);
+	} else if (opts.verbose) {
+		fprintf(stderr, "Skipping %s, not a regular file\n", item->remote);
+	}
+	afc_dictionary_free(info);
+}
+
+struct cp_worker {
+	lockdownd_service_descriptor_t service;
+	int index;
+	pthread_t thread;
+};
+
+/**
+ * Opens an AFC connection of its own and processes items from the work
+ * queue until all of them are done.
+ */
+static void *cp_worker(void *arg)
+{
+	struct cp_worker *worker = (struct cp_worker*)arg;
+	house_arrest_client_t ha = NULL;
+	struct cp_item *item;
+	afc_client_t afc;
+	char *buf;
+
+	afc = afc_connect_client(device, &opts.target, worker->service, worker->index == 0, &ha);
+	if (!afc) {
+		if (worker->index > 0)
+			fprintf(stderr, "WARNING: Could not open AFC connection %d\n", worker->index + 1);
+		return NULL;
+	}
+	buf = malloc(opts.chunk_size);
+	if (!buf) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+	} else {
+		while ((item = queue_pop())) {
+			copy_item(afc, item, buf);
+			queue_done(item);
+		}
+		free(buf);
+	}
+	afc_client_free(afc);
+	if (ha)
+		house_arrest_client_free(ha);
+
+	return NULL;
+}
+
+static size_t parse_size(const char *str)
+{
+	char *end = NULL;
+	unsigned long long val = strtoull(str, &end, 10);
+
+	if (end) {
+		switch (*end) {
+		case 'g':
+		case 'G':
+			val *= 1024;
+			/* fall through */
+		case 'm':
+		case 'M':
+			val *= 1024;
+			/* fall through */
+		case 'k':
+		case 'K':
+			val *= 1024;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return (size_t)val;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: ifuse-cp [OPTIONS] REMOTE_PATH LOCAL_DIR\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Copy files and directory trees from an iOS device to LOCAL_DIR.\n");
+	fprintf(stderr, "The content of a directory REMOTE_PATH is copied into LOCAL_DIR, a file is\n");
+	fprintf(stderr, "copied to LOCAL_DIR/NAME. Files that exist locally with the same size and\n");
+	fprintf(stderr, "modification time are skipped.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "  -u, --udid UDID\tcopy from specific device by UDID\n");
+	fprintf(stderr, "  -n, --network\t\tconnect to network device\n");
+	fprintf(stderr, "  -j, --jobs N\t\tnumber of parallel transfers (default: %d)\n", DEFAULT_JOBS);
+	fprintf(stderr, "  -c, --chunk-size SIZE\tbytes requested from the device at once (default: 4M)\n");
+	fprintf(stderr, "  -v, --verbose\t\tprint the name of every file copied\n");
+	fprintf(stderr, "  -d, --debug\t\tenable libimobiledevice communication debugging\n");
+	fprintf(stderr, "  -h, --help\t\tprint usage information\n");
+	fprintf(stderr, "  -V, --version\t\tprint version\n");
+	fprintf(stderr, "  --documents APPID\tcopy from 'Documents' folder of app identified by APPID\n");
+	fprintf(stderr, "  --container APPID\tcopy from sandbox root of an app identified by APPID\n");
+	fprintf(stderr, "  --root\t\tcopy from root file system (jailbroken device required)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Example:\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  $ ifuse-cp -j 8 /DCIM ~/Pictures/iPhone\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Homepage:    <" PACKAGE_URL ">\n");
+	fprintf(stderr, "Bug Reports: <" PACKAGE_BUGREPORT ">\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longopts[] = {
+		{ "udid", required_argument, NULL, 'u' },
+		{ "network", no_argument, NULL, 'n' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "chunk-size", required_argument, NULL, 'c' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "documents", required_argument, NULL, 'D' },
+		{ "container", required_argument, NULL, 'C' },
+		{ "root", no_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
+	lockdownd_service_descriptor_t services[MAX_JOBS];
+	struct cp_worker workers[MAX_JOBS];
+	lockdownd_client_t lockdown = NULL;
+	const char *remote;
+	double start, elapsed;
+	int count;
+	int c, i;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = DEFAULT_JOBS;
+	opts.chunk_size = DEFAULT_CHUNK_SIZE;
+	opts.target.service_name = AFC_SERVICE_NAME;
+	opts.prefix = "";
+
+	while ((c = getopt_long(argc, argv, "u:nj:c:vdhV", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				return EXIT_FAILURE;
+			}
+			opts.udid = optarg;
+			break;
+		case 'n':
+			opts.use_network = 1;
+			break;
+		case 'j':
+			opts.jobs = atoi(optarg);
+			if (opts.jobs < 1 || opts.jobs > MAX_JOBS) {
+				fprintf(stderr, "ERROR: --jobs must be between 1 and %d\n", MAX_JOBS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			opts.chunk_size = parse_size(optarg);
+			if (opts.chunk_size < 4096 || opts.chunk_size > MAX_CHUNK_SIZE) {
+				fprintf(stderr, "ERROR: --chunk-size must be between 4K and 64M\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			opts.verbose = 1;
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage();
+			return EXIT_SUCCESS;
+		case 'V':
+			printf("ifuse-cp %s\n", PACKAGE_VERSION);
+			return EXIT_SUCCESS;
+		case 'D':
+		case 'C':
+			opts.target.service_name = HOUSE_ARREST_SERVICE_NAME;
+			opts.target.appid = optarg;
+			opts.target.use_container = (c == 'C');
+			/* VendDocuments still shows the container */
+			opts.prefix = (c == 'D') ? "/Documents" : "";
+			break;
+		case 'R':
+			opts.target.service_name = AFC2_SERVICE_NAME;
+			break;
+		default:
+			print_usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2) {
+		print_usage();
+		return EXIT_FAILURE;
+	}
+	remote = argv[optind];
+
+	if (idevice_new_with_options(&device, opts.udid, (opts.use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		if (opts.udid) {
+			fprintf(stderr, "ERROR: Device %s not found!\n", opts.udid);
+		} else {
+			fprintf(stderr, "ERROR: No device found!\n");
+		}
+		fprintf(stderr, "Is the device properly connected?\n");
+		return EXIT_FAILURE;
+	}
+
+	if (afc_connect_lockdown(device, "ifuse-cp", &lockdown) < 0) {
+		idevice_free(device);
+		return EXIT_FAILURE;
+	}
+	count = afc_connect_start_services(device, lockdown, &opts.target, opts.jobs, services);
+	lockdownd_client_free(lockdown);
+	if (count < 0) {
+		idevice_free(device);
+		return EXIT_FAILURE;
+	}
+
+	queue_push(join_path(opts.prefix, (*remote == '/') ? remote+1 : remote), strdup(argv[optind+1]), 1);
+
+	start = monotonic_now();
+	for (i = 0; i < count; i++) {
+		workers[i].service = services[i];
+		workers[i].index = i;
+		if (pthread_create(&workers[i].thread, NULL, cp_worker, &workers[i]) != 0) {
+			lockdownd_service_descriptor_free(services[i]);
+			workers[i].service = NULL;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (!workers[i].service)
+			continue;
+		pthread_join(workers[i].thread, NULL);
+		lockdownd_service_descriptor_free(workers[i].service);
+	}
+	elapsed = monotonic_now() - start;
+	idevice_free(device);
+
+	/* every thread failed to connect */
+	if (pending > 0) {
+		fprintf(stderr, "ERROR: Could not connect to AFC service\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%u files copied, %u unchanged, %u failed; %.1f MB in %.2f s (%.1f MB/s)\n",
+		files_copied, files_skipped, files_failed,
+		bytes_copied / 1e6, elapsed, (elapsed > 0) ? bytes_copied / 1e6 / elapsed : 0.0);
+
+	return (files_failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -34,10 +34,9 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
-
-#define AFC_SERVICE_NAME "com.apple.afc"
-#define AFC2_SERVICE_NAME "com.apple.afc2"
-#define HOUSE_ARREST_SERVICE_NAME "com.apple.mobile.house_arrest"
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -45,18 +44,33 @@
 #include <libimobiledevice/house_arrest.h>
 #include <libimobiledevice/installation_proxy.h>
 
+#include "afc_connect.h"
+#include "afc_info.h"
+#include "afc_pool.h"
+#include "metacache.h"
+#include "readahead.h"
+#include "stats.h"
+#include "fsinfo.h"
+#include "chunkcache.h"
+#include "filetab.h"
+#include "dirsnap.h"
+#include "trace.h"
+#include "checksum.h"
+#include "sumcache.h"
+#include "treeindex.h"
+
 /* FreeBSD and others don't have ENODATA, so let's fake it */
 #ifndef ENODATA
 #define ENODATA EIO
 #endif
 
-house_arrest_client_t house_arrest = NULL;
-
 /* assume this is the default block size */
 int g_blocksize = 4096;
 
 idevice_t device = NULL;
-lockdownd_client_t control = NULL;
+
+/* when ifuse was started, for the startup time breakdown */
+static double startup_time = 0;
 
 int debug = 0;
 
@@ -67,10 +81,236 @@ static struct {
 	int use_container;
 	int should_list_apps;
 	char *service_name;
-	lockdownd_service_descriptor_t service;
 	int use_network;
+	int all_devices;
+	int all_apps;
+	unsigned int apps_max;
+	unsigned int afc_connections;
+	double attr_timeout;
+	double entry_timeout;
+	double negative_timeout;
+	size_t readahead_max;
+	size_t readahead_memory;
+	size_t writeback_max;
+	char *stats_file;
+	char *trace_file;
+	double statfs_timeout;
+	double reconnect_timeout;
+	char *cache_dir;
+	uint64_t cache_size;
+	char *index_dir;
+	double index_timeout;
+	int checksum_reads;
 } opts;
 
+/* number of AFC connections opened by default, more over the network
+ * where each request waits longer for its reply */
+#define DEFAULT_AFC_CONNECTIONS 4
+#define DEFAULT_NETWORK_AFC_CONNECTIONS 8
+
+/* default for attr_timeout, entry_timeout and negative_timeout in seconds */
+#define DEFAULT_CACHE_TIMEOUT 1.0
+
+/* number of apps that keep their connections with --apps by default */
+#define DEFAULT_APPS_MAX 8
+
+/* default time in seconds operations wait for a dropped device to come back */
+#define DEFAULT_RECONNECT_TIMEOUT 30.0
+
+/* default amount of written data collected per open file before it is sent */
+#define DEFAULT_WRITEBACK_MAX (1024 * 1024)
+
+/* size of read and write requests we ask the kernel for */
+#define DEFAULT_MAX_TRANSFER (1024 * 1024)
+/* number of requests the kernel may have outstanding in the background */
+#define DEFAULT_MAX_BACKGROUND 64
+
+/* connection options given with -o, applied on top of our defaults in ifuse_init */
+static struct fuse_conn_info_opts *conn_opts = NULL;
+
+/* set if the kernel caches writes, see ifuse_open */
+static int writeback_cache = 0;
+
+/* virtual directory with runtime information, not shown in listings */
+#define IFUSE_CONTROL_DIR "/.ifuse"
+#define IFUSE_STATS_FILE IFUSE_CONTROL_DIR "/stats"
+
+enum {
+	VIRTUAL_NONE = 0,
+	VIRTUAL_DIR,
+	VIRTUAL_STATS
+};
+
+/* prepended to virtual paths when the subdir module is used */
+static const char *control_prefix = "";
+
+/* time in seconds before connecting to a device that failed is tried again,
+ * also the upper limit of the delay between reconnection attempts */
+#define DEVICE_RETRY_INTERVAL 5.0
+
+/* delay in seconds before the first reconnection attempt, doubled each time */
+#define RECONNECT_MIN_DELAY 0.25
+
+/* how often an operation is repeated after the connection dropped */
+#define RECONNECT_MAX_RETRIES 3
+
+enum {
+	DEVICE_IDLE = 0,
+	DEVICE_CONNECTING,
+	DEVICE_READY
+};
+
+/* a connection to a device that dropped; open files may still point to
+ * it, see ifuse_device_prune() */
+struct ifuse_session {
+	idevice_t device;
+	afc_pool_t pool;
+	struct connect_job *connect_jobs;
+	struct ifuse_session *next;
+};
+
+/* a device whose file system is served, see ifuse_device_get; with --apps
+ * one entry per app */
+struct ifuse_device {
+	char *udid;
+	/* the app whose Documents are served with --apps, NULL otherwise */
+	char *appid;
+	/* the directory below the mount point, the UDID or the appid */
+	const char *name;
+	idevice_t device;
+	/* NULL until the device is accessed for the first time */
+	afc_pool_t pool;
+	/* set up by the background connection workers */
+	struct connect_job *connect_jobs;
+	fsinfo_t fsinfo;
+	/* protects the connection state */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int state;
+	int error;
+	double retry_at;
+	double started;
+	/* incremented with every established connection */
+	unsigned int generation;
+	/* set while a dropped connection is being re-established */
+	double lost_at;
+	int gone;
+	struct ifuse_session *dropped;
+	/* protected by devices.mutex */
+	unsigned int refs;
+	/* when it was looked up last, to find the app that was idle longest */
+	double used;
+	/* the tree index with index_dir, NULL otherwise */
+	treeindex_t index;
+	/* set while the tree is crawled, and once it was crawled completely;
+	 * protected by mutex */
+	int indexing;
+	int indexed;
+	struct ifuse_device *next;
+};
+
+/* the served devices; with --all every attached device, otherwise exactly one */
+static struct {
+	pthread_mutex_t mutex;
+	struct ifuse_device *list;
+	struct fuse *fuse;
+	idevice_subscription_context_t events;
+} devices = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL };
+
+/* the threads crawling the tree of a device for its index */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int running;
+	int stopping;
+} indexer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+/* the files open for writing, whose buffered data counts towards the size
+ * of their path; busy files are being flushed by a truncate and stay listed */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct ifuse_file *list;
+} writers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL };
+
+/* milliseconds the crawler waits when all connections are busy */
+#define INDEX_YIELD_MS 20
+
+/* interval in seconds at which the index is saved while it is crawled */
+#define INDEX_SAVE_INTERVAL 30.0
+
+/* interval in seconds after which the root directory of --apps lists the
+ * installed apps again */
+#define APPS_REFRESH_INTERVAL 60.0
+
+/* the device whose apps are served with --apps */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char *udid;
+	/* the lockdown session all apps start their services on, protected by
+	 * mutex; set up on first use and again after it failed */
+	idevice_t device;
+	lockdownd_client_t lockdown;
+	/* set while the apps are enumerated */
+	int listing;
+	double listed_at;
+	int error;
+	double retry_at;
+	/* enumerates the apps after mounting, see ifuse_apps_worker */
+	pthread_t worker;
+	int has_worker;
+} apps = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+struct ifuse_file {
+	struct ifuse_device *dev;
+	afc_pool_t pool;
+	struct afc_conn *conn;
+	uint64_t handle;
+	/* to open the file again after the connection dropped */
+	char *devpath;
+	afc_file_mode_t mode;
+	unsigned int generation;
+	pthread_mutex_t lock;
+	/* current device side file position, only valid if pos_valid is set */
+	uint64_t pos;
+	int pos_valid;
+	int append;
+	/* NULL if the file is not readable or readahead is disabled */
+	struct readahead *ra;
+	/* contiguous data written by the application but not yet sent to the device */
+	char *wb_data;
+	uint64_t wb_offset;
+	size_t wb_len;
+	/* errno of a failed write-back, reported by the next write, flush or fsync */
+	int wb_err;
+	/* set by a write and cleared once it was sent to the device, the
+	 * cached and indexed attributes are then forgotten */
+	int written;
+	/* where the buffered data ends in the file, -1 if nothing is buffered;
+	 * read without file->lock by getattr */
+	int64_t wb_end;
+	/* the path below the mount point and the link in writers.list, only
+	 * set if the file is open for writing */
+	char *path;
+	struct ifuse_file *wnext;
+	unsigned int busy;
+	/* size of the file on the device as far as we know, -1 if unknown */
+	int64_t size;
+	/* the file's content is cached under this key if set, see chunkcache.c */
+	char *cache_key;
+	/* checksums of the data read so far, NULL unless checksum_reads is
+	 * set, the file is read from its start and they are not known yet;
+	 * protected by sum_lock, so that hashing does not hold up reads */
+	checksum_stream_t sum;
+	pthread_mutex_t sum_lock;
+	/* the checksums are stored under this key, see sumcache.c */
+	char *sum_key;
+	/* content of a virtual file, conn is NULL in that case */
+	char *vdata;
+	size_t vlen;
+};
+
 enum {
 	KEY_HELP = 1,
 	KEY_VERSION,
@@ -79,11 +319,31 @@ enum {
 	KEY_UDID_LONG,
 	KEY_NETWORK,
 	KEY_NETWORK_LONG,
+	KEY_ALL,
+	KEY_ALL_LONG,
 	KEY_VENDOR_DOCUMENTS_LONG,
 	KEY_VENDOR_CONTAINER_LONG,
 	KEY_LIST_APPS_LONG,
+	KEY_APPS_LONG,
 	KEY_DEBUG,
-	KEY_DEBUG_LONG
+	KEY_DEBUG_LONG,
+	KEY_AFC_CONNECTIONS,
+	KEY_ATTR_TIMEOUT,
+	KEY_ENTRY_TIMEOUT,
+	KEY_NEGATIVE_TIMEOUT,
+	KEY_READAHEAD_MAX,
+	KEY_READAHEAD_MEMORY,
+	KEY_WRITEBACK_MAX,
+	KEY_STATS_FILE,
+	KEY_TRACE_FILE,
+	KEY_STATFS_TIMEOUT,
+	KEY_RECONNECT_TIMEOUT,
+	KEY_CACHE_DIR,
+	KEY_CACHE_SIZE,
+	KEY_INDEX_DIR,
+	KEY_INDEX_TIMEOUT,
+	KEY_CHECKSUM_READS,
+	KEY_APPS_MAX
 };
 
 static struct fuse_opt ifuse_opts[] = {
@@ -95,12 +355,32 @@ static struct fuse_opt ifuse_opts[] = {
 	FUSE_OPT_KEY("--udid %s",      KEY_UDID_LONG),
 	FUSE_OPT_KEY("-n",             KEY_NETWORK),
 	FUSE_OPT_KEY("--network",      KEY_NETWORK_LONG),
+	FUSE_OPT_KEY("-a",             KEY_ALL),
+	FUSE_OPT_KEY("--all",          KEY_ALL_LONG),
 	FUSE_OPT_KEY("--root",         KEY_ROOT),
 	FUSE_OPT_KEY("-d",             KEY_DEBUG),
 	FUSE_OPT_KEY("--debug",        KEY_DEBUG_LONG),
 	FUSE_OPT_KEY("--documents %s", KEY_VENDOR_DOCUMENTS_LONG),
 	FUSE_OPT_KEY("--container %s", KEY_VENDOR_CONTAINER_LONG),
 	FUSE_OPT_KEY("--list-apps",    KEY_LIST_APPS_LONG),
+	FUSE_OPT_KEY("--apps",         KEY_APPS_LONG),
+	FUSE_OPT_KEY("afc_connections=%u", KEY_AFC_CONNECTIONS),
+	FUSE_OPT_KEY("attr_timeout=%s", KEY_ATTR_TIMEOUT),
+	FUSE_OPT_KEY("entry_timeout=%s", KEY_ENTRY_TIMEOUT),
+	FUSE_OPT_KEY("negative_timeout=%s", KEY_NEGATIVE_TIMEOUT),
+	FUSE_OPT_KEY("readahead_max=%s", KEY_READAHEAD_MAX),
+	FUSE_OPT_KEY("readahead_memory=%s", KEY_READAHEAD_MEMORY),
+	FUSE_OPT_KEY("writeback_max=%s", KEY_WRITEBACK_MAX),
+	FUSE_OPT_KEY("stats_file=%s", KEY_STATS_FILE),
+	FUSE_OPT_KEY("trace_file=%s", KEY_TRACE_FILE),
+	FUSE_OPT_KEY("statfs_timeout=%s", KEY_STATFS_TIMEOUT),
+	FUSE_OPT_KEY("reconnect_timeout=%s", KEY_RECONNECT_TIMEOUT),
+	FUSE_OPT_KEY("cache_dir=%s", KEY_CACHE_DIR),
+	FUSE_OPT_KEY("cache_size=%s", KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("index_dir=%s", KEY_INDEX_DIR),
+	FUSE_OPT_KEY("index_timeout=%s", KEY_INDEX_TIMEOUT),
+	FUSE_OPT_KEY("checksum_reads", KEY_CHECKSUM_READS),
+	FUSE_OPT_KEY("apps_max=%u", KEY_APPS_MAX),
 	FUSE_OPT_END
 };
 
@@ -117,62 +397,59 @@ static void free_dictionary(char **dictionary)
 	free(dictionary);
 }
 
-struct afc_error_mapping {
-	afc_error_t from;
-	int to;
-} static afc_error_to_errno_map[] = {
-	{AFC_E_SUCCESS               , 0},
-	{AFC_E_OP_HEADER_INVALID     , EIO},
-	{AFC_E_NO_RESOURCES          , EMFILE},
-	{AFC_E_READ_ERROR            , ENOTDIR},
-	{AFC_E_WRITE_ERROR           , EIO},
-	{AFC_E_UNKNOWN_PACKET_TYPE   , EIO},
-	{AFC_E_INVALID_ARG           , EINVAL},
-	{AFC_E_OBJECT_NOT_FOUND      , ENOENT},
-	{AFC_E_OBJECT_IS_DIR         , EISDIR},
-	{AFC_E_DIR_NOT_EMPTY         , ENOTEMPTY},
-	{AFC_E_PERM_DENIED           , EPERM},
-	{AFC_E_SERVICE_NOT_CONNECTED , ENXIO},
-	{AFC_E_OP_TIMEOUT            , ETIMEDOUT},
-	{AFC_E_TOO_MUCH_DATA         , EFBIG},
-	{AFC_E_END_OF_DATA           , ENODATA},
-	{AFC_E_OP_NOT_SUPPORTED      , ENOSYS},
-	{AFC_E_OBJECT_EXISTS         , EEXIST},
-	{AFC_E_OBJECT_BUSY           , EBUSY},
-	{AFC_E_NO_SPACE_LEFT         , ENOSPC},
-	{AFC_E_OP_WOULD_BLOCK        , EWOULDBLOCK},
-	{AFC_E_IO_ERROR              , EIO},
-	{AFC_E_OP_INTERRUPTED        , EINTR},
-	{AFC_E_OP_IN_PROGRESS        , EALREADY},
-	{AFC_E_INTERNAL_ERROR        , EIO},
-	{-1}
-};
-
 /**
- * Tries to convert the AFC error value into a meaningful errno value.
+ * Parses a size given as a number of bytes with an optional K, M or G suffix.
  *
- * @param client AFC client to retrieve status value from.
- *
- * @return errno value.
+ * @return The size in bytes.
  */
-static int get_afc_error_as_errno(afc_error_t error)
+static size_t parse_size(const char *str)
 {
-	int i = 0;
-	int res = -1;
+	char *end = NULL;
+	unsigned long long val = strtoull(str, &end, 10);
 
-	while (afc_error_to_errno_map[i++].from != -1) {
-		if (afc_error_to_errno_map[i].from == error) {
-			res = afc_error_to_errno_map[i++].to;
+	if (end) {
+		switch (*end) {
+		case 'g':
+		case 'G':
+			val *= 1024;
+			/* fall through */
+		case 'm':
+		case 'M':
+			val *= 1024;
+			/* fall through */
+		case 'k':
+		case 'K':
+			val *= 1024;
+			break;
+		default:
 			break;
 		}
 	}
 
-	if (res == -1) {
-		fprintf(stderr, "Unknown AFC status %d.\n", error);
-		res = EIO;
-	}
+	return (size_t)val;
+}
 
-	return res;
+/**
+ * Checks whether path refers to one of the virtual files below
+ * IFUSE_CONTROL_DIR.
+ *
+ * @return VIRTUAL_DIR, VIRTUAL_STATS or VIRTUAL_NONE.
+ */
+static int get_virtual_path_type(const char *path)
+{
+	size_t plen = strlen(control_prefix);
+
+	if (strncmp(path, control_prefix, plen) != 0)
+		return VIRTUAL_NONE;
+	path += plen;
+	if (strncmp(path, IFUSE_CONTROL_DIR, sizeof(IFUSE_CONTROL_DIR)-1) != 0)
+		return VIRTUAL_NONE;
+	if (!strcmp(path, IFUSE_CONTROL_DIR))
+		return VIRTUAL_DIR;
+	if (!strcmp(path, IFUSE_STATS_FILE))
+		return VIRTUAL_STATS;
+
+	return VIRTUAL_NONE;
 }
 
 static int get_afc_file_mode(afc_file_mode_t *afc_mode, int flags)
@@ -206,231 +483,3385 @@ static int get_afc_file_mode(afc_file_mode_t *afc_mode, int flags)
 	return 0;
 }
 
-static int ifuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+/**
+ * Describes the file system of a device entry for afc_connect_client(), the
+ * one selected with --documents, --container or --root, or the Documents of
+ * the app of the entry with --apps.
+ */
+static void ifuse_target(struct ifuse_device *dev, struct afc_target *target)
 {
-	int res = 0;
-	plist_t info = NULL;
+	if (dev->appid) {
+		target->service_name = HOUSE_ARREST_SERVICE_NAME;
+		target->appid = dev->appid;
+		target->use_container = 0;
+		return;
+	}
+	target->service_name = opts.service_name;
+	target->appid = opts.appid;
+	target->use_container = opts.use_container;
+}
 
-	afc_client_t afc = fuse_get_context()->private_data;
-	afc_error_t ret = afc_get_file_info_plist(afc, path, &info);
+/**
+ * Reads the file system information from a device info dictionary.
+ */
+static void ifuse_parse_fsinfo(plist_t dict, struct fsinfo *info)
+{
+	info->total = plist_dict_get_uint(dict, "FSTotalBytes");
+	info->free = plist_dict_get_uint(dict, "FSFreeBytes");
+	info->blocksize = plist_dict_get_uint(dict, "FSBlockSize");
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
-	if (ret != AFC_E_SUCCESS) {
-		int e = get_afc_error_as_errno(ret);
-		return -e;
-	} else if (!info) {
-		return -1;
+static double monotonic_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* milliseconds since start, for the startup time breakdown */
+#define ELAPSED_MS(start) ((monotonic_now() - (start)) * 1000.0)
+
+/**
+ * Creates the entry of a device. It starts with one reference, which is
+ * owned by the device list.
+ *
+ * @param udid The UDID of the device.
+ * @param appid The app whose Documents are served with --apps, or NULL.
+ *
+ * @return The new entry or NULL if out of memory.
+ */
+static struct ifuse_device *ifuse_device_new(const char *udid, const char *appid)
+{
+	struct ifuse_device *dev = calloc(1, sizeof(struct ifuse_device));
+	pthread_condattr_t cattr;
+
+	if (!dev)
+		return NULL;
+	dev->udid = strdup(udid);
+	dev->appid = (appid) ? strdup(appid) : NULL;
+	if (!dev->udid || (appid && !dev->appid)) {
+		free(dev->udid);
+		free(dev);
+		return NULL;
 	}
+	dev->name = (dev->appid) ? dev->appid : dev->udid;
+	pthread_mutex_init(&dev->mutex, NULL);
+	/* waits for a reconnection are timed */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	dev->state = DEVICE_IDLE;
+	dev->refs = 1;
 
-	stbuf->st_size = plist_dict_get_uint(info, "st_size");
-	stbuf->st_blocks = plist_dict_get_uint(info, "st_blocks");
-	const char* s_ifmt = plist_get_string_ptr(plist_dict_get_item(info, "st_ifmt"), NULL);
-	if (s_ifmt) {
-		if (!strcmp(s_ifmt, "S_IFREG")) {
-			stbuf->st_mode = S_IFREG;
-		} else if (!strcmp(s_ifmt, "S_IFDIR")) {
-			stbuf->st_mode = S_IFDIR;
-		} else if (!strcmp(s_ifmt, "S_IFLNK")) {
-			stbuf->st_mode = S_IFLNK;
-		} else if (!strcmp(s_ifmt, "S_IFBLK")) {
-			stbuf->st_mode = S_IFBLK;
-		} else if (!strcmp(s_ifmt, "S_IFCHR")) {
-			stbuf->st_mode = S_IFCHR;
-		} else if (!strcmp(s_ifmt, "S_IFIFO")) {
-			stbuf->st_mode = S_IFIFO;
-		} else if (!strcmp(s_ifmt, "S_IFSOCK")) {
-			stbuf->st_mode = S_IFSOCK;
-		}
-	}
-	stbuf->st_nlink = plist_dict_get_uint(info, "st_nlink");
-	stbuf->st_mtime = (time_t)(plist_dict_get_uint(info, "st_mtime") / 1000000000);
-#ifdef _DARWIN_FEATURE_64_BIT_INODE
-	/* available on iOS 7+ */
-	stbuf->st_birthtime = (time_t)(plist_dict_get_uint(info, "st_birthtime") / 1000000000);
-#endif
-	plist_free(info);
+	if (opts.index_dir && *dev->udid) {
+		struct afc_target target;
+		char file[PATH_MAX];
 
-	// set permission bits according to the file type
-	if (S_ISDIR(stbuf->st_mode)) {
-		stbuf->st_mode |= 0755;
-	} else if (S_ISLNK(stbuf->st_mode)) {
-		stbuf->st_mode |= 0777;
-	} else {
-		stbuf->st_mode |= 0644;
+		/* one index per file system of the device */
+		ifuse_target(dev, &target);
+		snprintf(file, sizeof(file), "%s/%s-%s%s%s%s.index", opts.index_dir, dev->udid, target.service_name,
+			(target.appid) ? "-" : "", (target.appid) ? target.appid : "", (target.use_container) ? "-container" : "");
+		dev->index = treeindex_open(file, opts.index_timeout);
 	}
 
-	// and set some additional info
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
+	return dev;
+}
 
-	stbuf->st_blksize = g_blocksize;
+static void ifuse_session_free(struct ifuse_session *session)
+{
+	afc_pool_free(session->pool);
+	free(session->connect_jobs);
+	if (session->device) {
+		idevice_free(session->device);
+	}
+	free(session);
+}
 
-	return res;
+/**
+ * Frees the dropped sessions of a device that are not used anymore. The
+ * newest one is kept while the device has no current session, as
+ * ifuse_device_pool() hands it out then. Must be called with dev->mutex
+ * held.
+ */
+static void ifuse_device_prune(struct ifuse_device *dev)
+{
+	struct ifuse_session **pp = &dev->dropped;
+
+	while (*pp) {
+		struct ifuse_session *session = *pp;
+		if ((session == dev->dropped && !dev->pool) || afc_pool_in_use(session->pool)) {
+			pp = &session->next;
+			continue;
+		}
+		*pp = session->next;
+		ifuse_session_free(session);
+	}
 }
 
-static int ifuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+/**
+ * Drops a reference to a device. The connections of a device that was
+ * detached are closed once its last open file is released.
+ */
+static void ifuse_device_put(struct ifuse_device *dev)
 {
-	int i;
-	char **dirs = NULL;
-	afc_client_t afc = fuse_get_context()->private_data;
+	unsigned int refs;
 
-	afc_read_directory(afc, path, &dirs);
+	if (!dev)
+		return;
 
-	if (!dirs)
-		return -ENOENT;
+	pthread_mutex_lock(&devices.mutex);
+	refs = --dev->refs;
+	pthread_mutex_unlock(&devices.mutex);
+	if (refs > 0)
+		return;
 
-	for (i = 0; dirs[i]; i++) {
-		filler(buf, dirs[i], NULL, 0, 0);
+	/* the refresh thread may still use the pool */
+	fsinfo_free(dev->fsinfo);
+	if (dev->index && treeindex_save(dev->index) < 0) {
+		fprintf(stderr, "WARNING: Could not save the index of device %s in %s\n", dev->name, opts.index_dir);
+	}
+	treeindex_free(dev->index);
+	afc_pool_free(dev->pool);
+	free(dev->connect_jobs);
+	if (dev->device) {
+		idevice_free(dev->device);
 	}
+	while (dev->dropped) {
+		struct ifuse_session *session = dev->dropped;
+		dev->dropped = session->next;
+		ifuse_session_free(session);
+	}
+	pthread_cond_destroy(&dev->cond);
+	pthread_mutex_destroy(&dev->mutex);
+	free(dev->udid);
+	free(dev->appid);
+	free(dev);
+}
 
-	free_dictionary(dirs);
+/**
+ * Finds a device in the device list by the name of its directory.
+ *
+ * @param name The UDID, or the appid with --apps, not necessarily NUL
+ *    terminated.
+ * @param len Length of name.
+ *
+ * @return The device with a reference taken, or NULL if it is not attached.
+ */
+static struct ifuse_device *ifuse_device_lookup(const char *name, size_t len)
+{
+	struct ifuse_device *dev;
 
-	return 0;
+	pthread_mutex_lock(&devices.mutex);
+	for (dev = devices.list; dev; dev = dev->next) {
+		if (strlen(dev->name) == len && !strncmp(dev->name, name, len)) {
+			dev->refs++;
+			dev->used = monotonic_now();
+			break;
+		}
+	}
+	pthread_mutex_unlock(&devices.mutex);
+
+	return dev;
 }
 
-static int ifuse_open(const char *path, struct fuse_file_info *fi)
+/**
+ * Takes another reference to a device the caller already holds.
+ */
+static void ifuse_device_hold(struct ifuse_device *dev)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
-	afc_error_t err;
-	afc_file_mode_t mode = 0;
+	pthread_mutex_lock(&devices.mutex);
+	dev->refs++;
+	pthread_mutex_unlock(&devices.mutex);
+}
 
-	err = get_afc_file_mode(&mode, fi->flags);
-	if (err != AFC_E_SUCCESS || (mode == 0)) {
-		return -EPERM;
-	}
+/**
+ * Returns the connection pool of the current session of a device, which
+ * must have been ready before, see ifuse_device_get(). If the connection
+ * dropped in the meantime the pool of the dropped session is returned;
+ * operations on it fail and can then wait for the reconnection.
+ *
+ * @return The pool with a reference taken, drop it with afc_pool_unref().
+ */
+static afc_pool_t ifuse_device_pool(struct ifuse_device *dev)
+{
+	afc_pool_t pool;
 
-	err = afc_file_open(afc, path, mode, &fi->fh);
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->dropped) {
+		ifuse_device_prune(dev);
 	}
+	pool = (dev->pool) ? dev->pool : dev->dropped->pool;
+	afc_pool_ref(pool);
+	pthread_mutex_unlock(&dev->mutex);
 
-	return 0;
+	return pool;
 }
 
-static int ifuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+/**
+ * Checks out a connection of the current session of a device, waiting
+ * for one to become idle.
+ *
+ * @param dev The device.
+ * @param pool Receives the pool the connection has to be handed back to.
+ *
+ * @return The connection, never NULL; must be handed back with
+ *    ifuse_device_release() or afc_pool_release().
+ */
+static struct afc_conn *ifuse_device_acquire(struct ifuse_device *dev, afc_pool_t *pool)
 {
-	return ifuse_open(path, fi);
+	struct afc_conn *conn;
+
+	*pool = ifuse_device_pool(dev);
+	conn = afc_pool_acquire(*pool);
+	/* the checked out connection keeps the pool in use from now on */
+	afc_pool_unref(*pool);
+
+	return conn;
 }
 
-static int ifuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/**
+ * Queries the file system information from the device, called by fsinfo.
+ */
+static int ifuse_fetch_fsinfo(void *ctx, struct fsinfo *info)
 {
-	uint32_t bytes = 0;
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev = (struct ifuse_device*)ctx;
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+	plist_t dict = NULL;
 
-	if (size == 0)
-		return 0;
-
-	afc_error_t err = afc_file_seek(afc, fi->fh, offset, SEEK_SET);
+	afc_error_t err = afc_get_device_info_plist(conn->client, &dict);
+	afc_pool_release(pool, conn);
 	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+		return -afc_info_errno(err);
 	}
+	if (!dict)
+		return -ENOENT;
 
-	err = afc_file_read(afc, fi->fh, buf, size, &bytes);
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
-	}
+	ifuse_parse_fsinfo(dict, info);
+	plist_free(dict);
 
-	return bytes;
+	return 0;
 }
 
-static int ifuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
-{
-	uint32_t bytes = 0;
-	afc_client_t afc = fuse_get_context()->private_data;
+struct connect_job {
+	struct ifuse_device *dev;
+	idevice_t device;
+	afc_pool_t pool;
+	lockdownd_service_descriptor_t service;
+	pthread_t thread;
+};
 
-	if (size == 0)
-		return 0;
+/**
+ * Opens one of the additional connections of a device in the background and
+ * adds it to the pool once it is usable.
+ */
+static void *ifuse_connect_worker(void *arg)
+{
+	struct connect_job *job = (struct connect_job*)arg;
+	struct ifuse_device *dev = job->dev;
+	afc_pool_t pool = job->pool;
+	struct afc_target target;
+	house_arrest_client_t ha = NULL;
+	afc_client_t afc;
 
-	afc_error_t err = afc_file_seek(afc, fi->fh, offset, SEEK_SET);
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+	ifuse_target(dev, &target);
+	afc = afc_connect_client(job->device, &target, job->service, 0, &ha);
+	if (afc) {
+		afc_pool_add(pool, afc, ha);
+		if (debug)
+			fprintf(stderr, "%s: additional AFC connection after %.1f ms\n", dev->name, ELAPSED_MS(dev->started));
+	} else {
+		fprintf(stderr, "WARNING: Could not open an additional AFC connection to device %s\n", dev->udid);
 	}
+	lockdownd_service_descriptor_free(job->service);
+	job->service = NULL;
+	/* the job goes away with its session once the pool is not used */
+	afc_pool_unref(pool);
+	pthread_mutex_lock(&dev->mutex);
+	ifuse_device_prune(dev);
+	pthread_mutex_unlock(&dev->mutex);
+	ifuse_device_put(dev);
 
-	err = afc_file_write(afc, fi->fh, buf, size, &bytes);
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+	return NULL;
+}
+
+/**
+ * Fetches the device information in the background. It provides the block
+ * size and primes the statfs cache.
+ */
+static void *ifuse_devinfo_worker(void *arg)
+{
+	struct ifuse_device *dev = (struct ifuse_device*)arg;
+	struct fsinfo fsi;
+	double start = monotonic_now();
+
+	if (ifuse_fetch_fsinfo(dev, &fsi) == 0) {
+		if (fsi.blocksize > 0) {
+			g_blocksize = fsi.blocksize;
+		}
+		fsinfo_set(dev->fsinfo, &fsi);
 	}
+	if (debug)
+		fprintf(stderr, "%s: device info %.1f ms\n", dev->name, ELAPSED_MS(start));
+	ifuse_device_put(dev);
 
-	return bytes;
+	return NULL;
 }
 
-static int ifuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+/**
+ * Runs fn on dev in a detached thread that holds a reference to dev.
+ *
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+static int ifuse_device_spawn(struct ifuse_device *dev, void *(*fn)(void*), void *arg)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
-	uint64_t mtime = (uint64_t)tv[1].tv_sec * (uint64_t)1000000000 + (uint64_t)tv[1].tv_nsec;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int res;
 
-	afc_error_t err = afc_set_file_time(afc, path, mtime);
-	if (err == AFC_E_UNKNOWN_PACKET_TYPE) {
-		/* ignore error for pre-3.1 devices as they do not support setting file modification times */
-		return 0;
-	}
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+	ifuse_device_hold(dev);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	res = pthread_create(&thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	if (res != 0) {
+		ifuse_device_put(dev);
+		return -1;
 	}
 
 	return 0;
 }
 
-static int ifuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+/**
+ * Starts services on the lockdown session shared by all apps with --apps.
+ * The session is set up on first use, and again if starting the services
+ * failed, since the device might have been attached again in the meantime.
+ *
+ * @return Number of services started or a negative errno value, see
+ *    afc_connect_start_services().
+ */
+static int ifuse_apps_start_services(const struct afc_target *target, unsigned int count, lockdownd_service_descriptor_t *services)
 {
-	return 0;
+	int attempt;
+	int res = -EIO;
+
+	pthread_mutex_lock(&apps.mutex);
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (!apps.lockdown) {
+			if (attempt > 0 || !apps.device) {
+				if (apps.device) {
+					idevice_free(apps.device);
+				}
+				if (idevice_new_with_options(&apps.device, apps.udid, (opts.use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+					apps.device = NULL;
+					fprintf(stderr, "WARNING: Device %s not found\n", apps.udid);
+					res = -ENODEV;
+					break;
+				}
+			}
+			res = afc_connect_lockdown(apps.device, "ifuse", &apps.lockdown);
+			if (res < 0)
+				break;
+		}
+		res = afc_connect_start_services(apps.device, apps.lockdown, target, count, services);
+		if (res >= 0)
+			break;
+		lockdownd_client_free(apps.lockdown);
+		apps.lockdown = NULL;
+	}
+	pthread_mutex_unlock(&apps.mutex);
+
+	return res;
 }
 
-static int ifuse_release(const char *path, struct fuse_file_info *fi)
+/**
+ * Closes the connections of the app that was not used for the longest time
+ * as long as more than apps_max apps are connected with --apps. Only apps
+ * without open files or running operations are closed; they are connected
+ * again on their next access.
+ *
+ * @param keep The app that was just connected.
+ */
+static void ifuse_apps_evict(struct ifuse_device *keep)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	for (;;) {
+		struct ifuse_device *dev;
+		struct ifuse_device *victim = NULL;
+		unsigned int connected = 1;
+		afc_pool_t pool;
+		struct connect_job *jobs;
+
+		pthread_mutex_lock(&devices.mutex);
+		for (dev = devices.list; dev; dev = dev->next) {
+			int ready;
+			if (dev == keep)
+				continue;
+			pthread_mutex_lock(&dev->mutex);
+			ready = (dev->state == DEVICE_READY);
+			pthread_mutex_unlock(&dev->mutex);
+			if (!ready)
+				continue;
+			connected++;
+			/* the list holds the only reference of an idle app */
+			if (dev->refs == 1 && (!victim || dev->used < victim->used)) {
+				victim = dev;
+			}
+		}
+		if (connected <= opts.apps_max || !victim) {
+			pthread_mutex_unlock(&devices.mutex);
+			return;
+		}
 
-	afc_file_close(afc, fi->fh);
+		/* nobody can take a reference while devices.mutex is held, only
+		 * the statfs refresh thread might still use the connections */
+		fsinfo_free(victim->fsinfo);
+		victim->fsinfo = NULL;
+		pthread_mutex_lock(&victim->mutex);
+		pool = victim->pool;
+		jobs = victim->connect_jobs;
+		victim->pool = NULL;
+		victim->connect_jobs = NULL;
+		victim->state = DEVICE_IDLE;
+		victim->error = 0;
+		victim->retry_at = 0;
+		victim->started = 0;
+		pthread_mutex_unlock(&victim->mutex);
+		pthread_mutex_unlock(&devices.mutex);
 
-	return 0;
+		if (debug)
+			fprintf(stderr, "%s: closing connections of idle app\n", victim->name);
+		afc_pool_free(pool);
+		free(jobs);
+	}
 }
 
-void *ifuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+/**
+ * Checks whether an AFC error means that the connection to the device is
+ * gone, as it happens when the cable is pulled or the device goes to sleep.
+ */
+static int is_connection_error(afc_error_t err)
 {
-	afc_client_t afc = NULL;
+	return (err == AFC_E_SERVICE_NOT_CONNECTED || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA);
+}
+
+/**
+ * Retrieves the attributes of path from the device.
+ *
+ * @param afc The AFC client to use.
+ * @param devpath The path on the device.
+ * @param stbuf Receives the attributes.
+ *
+ * @return AFC_E_SUCCESS or an AFC error code.
+ */
+static afc_error_t ifuse_query_attr(afc_client_t afc, const char *devpath, struct stat *stbuf)
+{
+	char **info = NULL;
+
+	afc_error_t ret = afc_get_file_info(afc, devpath, &info);
+
+	memset(stbuf, 0, sizeof(struct stat));
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	} else if (!info) {
+		return AFC_E_IO_ERROR;
+	}
+
+	afc_info_decode(info, stbuf);
+	free_dictionary(info);
+
+	// set permission bits according to the file type
+	if (S_ISDIR(stbuf->st_mode)) {
+		stbuf->st_mode |= 0755;
+	} else if (S_ISLNK(stbuf->st_mode)) {
+		stbuf->st_mode |= 0777;
+	} else {
+		stbuf->st_mode |= 0644;
+	}
+
+	// and set some additional info
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
 
-	conn->want &= FUSE_CAP_ASYNC_READ;
+	stbuf->st_blksize = g_blocksize;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Checks out a connection of a device for the index crawler. It only gets
+ * an idle one while no regular operation waits, so it never delays them.
+ *
+ * @param dev The device.
+ * @param pool Receives the pool the connection has to be handed back to.
+ *
+ * @return The connection, or NULL if the crawl has to stop since the mount
+ *    goes away, the device was detached or its connection dropped.
+ */
+static struct afc_conn *ifuse_index_acquire(struct ifuse_device *dev, afc_pool_t *pool)
+{
+	struct afc_conn *conn = NULL;
+	struct timespec ts;
+	int stop;
+
+	while (!conn) {
+		pthread_mutex_lock(&indexer.mutex);
+		stop = indexer.stopping;
+		pthread_mutex_unlock(&indexer.mutex);
+		pthread_mutex_lock(&dev->mutex);
+		*pool = dev->pool;
+		stop |= dev->gone;
+		/* checked out under the lock, before the session can be retired */
+		if (!stop && *pool)
+			conn = afc_pool_try_acquire(*pool);
+		pthread_mutex_unlock(&dev->mutex);
+		if (stop || !*pool)
+			return NULL;
+
+		if (!conn) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = INDEX_YIELD_MS * 1000000L;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return conn;
+}
+
+/**
+ * Brings the index of one directory up to date. If its modification time
+ * still matches this takes one request, otherwise the directory is listed
+ * and the attributes of its entries are retrieved one after another.
+ *
+ * @param dev The device.
+ * @param dir The directory on the device.
+ * @param listed Incremented if the directory had to be listed.
+ *
+ * @return 0 on success or if the directory is gone, -1 if the crawl has
+ *    to stop.
+ */
+static int ifuse_index_dir(struct ifuse_device *dev, const char *dir, unsigned int *listed)
+{
+	struct afc_conn *conn;
+	struct stat *stats;
+	struct stat st;
+	char **names = NULL;
+	afc_pool_t pool;
+	afc_error_t err;
+	int count;
+	int i;
+
+	conn = ifuse_index_acquire(dev, &pool);
+	if (!conn)
+		return -1;
+	err = ifuse_query_attr(conn->client, dir, &st);
+	afc_pool_release(pool, conn);
+	if (is_connection_error(err))
+		return -1;
+	if (err != AFC_E_SUCCESS || !S_ISDIR(st.st_mode) || treeindex_check_dir(dev->index, dir, &st))
+		return 0;
+
+	conn = ifuse_index_acquire(dev, &pool);
+	if (!conn)
+		return -1;
+	err = afc_read_directory(conn->client, dir, &names);
+	afc_pool_release(pool, conn);
+	if (is_connection_error(err))
+		return -1;
+	if (!names)
+		return 0;
+
+	for (count = 0; names[count]; count++);
+	stats = calloc(count + 1, sizeof(struct stat));
+	if (!stats) {
+		free_dictionary(names);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		char path[PATH_MAX];
+
+		if (!strcmp(names[i], ".") || !strcmp(names[i], ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", (strcmp(dir, "/")) ? dir : "", names[i]);
+		conn = ifuse_index_acquire(dev, &pool);
+		if (!conn)
+			break;
+		/* an entry that could not be looked up is indexed without attributes */
+		err = ifuse_query_attr(conn->client, path, &stats[i]);
+		afc_pool_release(pool, conn);
+		if (is_connection_error(err))
+			break;
+	}
+	if (i == count) {
+		treeindex_put_dir(dev->index, dir, &st, names, stats);
+		(*listed)++;
+	}
+	free(stats);
+	free_dictionary(names);
+
+	return (i == count) ? 0 : -1;
+}
+
+/**
+ * Crawls the tree of a device at low priority to bring its index up to
+ * date, depth first so that few directories are pending at a time. What
+ * was crawled is saved every now and then, so an interrupted crawl is not
+ * lost; the next one only checks the directories again.
+ */
+static void *ifuse_index_worker(void *arg)
+{
+	struct ifuse_device *dev = (struct ifuse_device*)arg;
+	double start = monotonic_now();
+	double saved = start;
+	unsigned int checked = 0;
+	unsigned int listed = 0;
+	char **pending = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	int res = -1;
+
+	pending = malloc(sizeof(char*));
+	if (pending) {
+		pending[0] = strdup("/");
+		count = (pending[0]) ? 1 : 0;
+		capacity = 1;
+	}
+	while (count > 0) {
+		char *dir = pending[--count];
+		char **subdirs;
+		size_t i;
+
+		res = ifuse_index_dir(dev, dir, &listed);
+		if (res < 0) {
+			free(dir);
+			break;
+		}
+		checked++;
+		subdirs = treeindex_subdirs(dev->index, dir);
+		free(dir);
+		for (i = 0; subdirs && subdirs[i]; i++) {
+			if (count == capacity) {
+				char **grown = realloc(pending, 2 * capacity * sizeof(char*));
+				if (!grown) {
+					free(subdirs[i]);
+					continue;
+				}
+				pending = grown;
+				capacity *= 2;
+			}
+			pending[count++] = subdirs[i];
+		}
+		free(subdirs);
+
+		if (monotonic_now() - saved >= INDEX_SAVE_INTERVAL) {
+			treeindex_save(dev->index);
+			saved = monotonic_now();
+		}
+	}
+	while (count > 0) {
+		free(pending[--count]);
+	}
+	free(pending);
+
+	if (treeindex_save(dev->index) < 0) {
+		fprintf(stderr, "WARNING: Could not save the index of device %s in %s\n", dev->name, opts.index_dir);
+	}
+	if (debug)
+		fprintf(stderr, "%s: index %s after %.1f s, %u directories checked, %u listed\n", dev->name, (res < 0) ? "crawl stopped" : "up to date", monotonic_now() - start, checked, listed);
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->indexing = 0;
+	dev->indexed = (res == 0);
+	pthread_mutex_unlock(&dev->mutex);
+	ifuse_device_put(dev);
+
+	/* the device might have been freed now, which saved its index */
+	pthread_mutex_lock(&indexer.mutex);
+	indexer.running--;
+	pthread_cond_broadcast(&indexer.cond);
+	pthread_mutex_unlock(&indexer.mutex);
+
+	return NULL;
+}
+
+/**
+ * Starts crawling the tree of a device for its index, unless it is being
+ * crawled already or was crawled completely during this mount.
+ */
+static void ifuse_index_start(struct ifuse_device *dev)
+{
+	int start;
+
+	if (!dev->index)
+		return;
+
+	pthread_mutex_lock(&indexer.mutex);
+	start = !indexer.stopping;
+	if (start) {
+		indexer.running++;
+	}
+	pthread_mutex_unlock(&indexer.mutex);
+	if (!start)
+		return;
+
+	pthread_mutex_lock(&dev->mutex);
+	start = (!dev->indexing && !dev->indexed);
+	if (start) {
+		dev->indexing = 1;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (start && ifuse_device_spawn(dev, ifuse_index_worker, dev) < 0) {
+		pthread_mutex_lock(&dev->mutex);
+		dev->indexing = 0;
+		pthread_mutex_unlock(&dev->mutex);
+		start = 0;
+	}
+	if (!start) {
+		pthread_mutex_lock(&indexer.mutex);
+		indexer.running--;
+		pthread_cond_broadcast(&indexer.cond);
+		pthread_mutex_unlock(&indexer.mutex);
+	}
+}
+
+/**
+ * Connects to a device. The lockdown handshake and the service starts are
+ * done in order, since they share the lockdown connection. After that, the
+ * device becomes ready as soon as its first AFC connection is established;
+ * the other connections and the device information are set up concurrently
+ * in the background.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_device_connect(struct ifuse_device *dev)
+{
+	lockdownd_service_descriptor_t services[AFC_POOL_MAX_CONNECTIONS];
+	lockdownd_client_t lockdown = NULL;
+	struct afc_target target;
+	house_arrest_client_t ha = NULL;
+	afc_client_t afc = NULL;
+	afc_pool_t pool;
+	struct connect_job *jobs;
+	unsigned int count = 0;
+	unsigned int i;
+	double start;
+	int res;
+
+	if (!dev->device) {
+		start = monotonic_now();
+		if (idevice_new_with_options(&dev->device, dev->udid, (opts.use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+			dev->device = NULL;
+			fprintf(stderr, "WARNING: Device %s not found\n", dev->udid);
+			return -ENODEV;
+		}
+		if (debug)
+			fprintf(stderr, "%s: device lookup %.1f ms\n", dev->name, ELAPSED_MS(start));
+	}
+
+	ifuse_target(dev, &target);
+	if (dev->appid) {
+		/* all apps share one lockdown session */
+		start = monotonic_now();
+		res = ifuse_apps_start_services(&target, opts.afc_connections, services);
+	} else {
+		start = monotonic_now();
+		res = afc_connect_lockdown(dev->device, "ifuse", &lockdown);
+		if (res < 0)
+			return res;
+		if (debug)
+			fprintf(stderr, "%s: lockdown handshake %.1f ms\n", dev->name, ELAPSED_MS(start));
+
+		start = monotonic_now();
+		res = afc_connect_start_services(dev->device, lockdown, &target, opts.afc_connections, services);
+		lockdownd_client_free(lockdown);
+	}
+	if (res < 0)
+		return res;
+	count = res;
+	if (debug)
+		fprintf(stderr, "%s: started %u services in %.1f ms\n", dev->name, count, ELAPSED_MS(start));
+
+	pool = afc_pool_new(opts.afc_connections);
+	jobs = calloc(count, sizeof(struct connect_job));
+	if (!pool || !jobs) {
+		for (i = 0; i < count; i++) {
+			lockdownd_service_descriptor_free(services[i]);
+		}
+		afc_pool_free(pool);
+		free(jobs);
+		return -ENOMEM;
+	}
+
+	/* the additional connections do not delay the first one */
+	for (i = 1; i < count; i++) {
+		jobs[i].dev = dev;
+		jobs[i].device = dev->device;
+		jobs[i].pool = pool;
+		jobs[i].service = services[i];
+		ifuse_device_hold(dev);
+		afc_pool_ref(pool);
+		if (pthread_create(&jobs[i].thread, NULL, ifuse_connect_worker, &jobs[i]) != 0) {
+			afc_pool_unref(pool);
+			ifuse_device_put(dev);
+			lockdownd_service_descriptor_free(services[i]);
+			jobs[i].service = NULL;
+			jobs[i].pool = NULL;
+		}
+	}
+
+	start = monotonic_now();
+	afc = afc_connect_client(dev->device, &target, services[0], 1, &ha);
+	lockdownd_service_descriptor_free(services[0]);
+	if (afc) {
+		afc_pool_add(pool, afc, ha);
+		if (debug)
+			fprintf(stderr, "%s: first AFC connection %.1f ms, ready after %.1f ms\n", dev->name, ELAPSED_MS(start), ELAPSED_MS(dev->started));
+	} else {
+		fprintf(stderr, "ERROR: Could not connect to AFC service on device %s\n", dev->udid);
+	}
+
+	/* the connections that are still being set up are added to the pool
+	 * when they are done, unless the device is not usable at all */
+	for (i = 1; i < count; i++) {
+		if (!jobs[i].pool)
+			continue;
+		if (afc)
+			pthread_detach(jobs[i].thread);
+		else
+			pthread_join(jobs[i].thread, NULL);
+	}
+	if (!afc) {
+		afc_pool_free(pool);
+		free(jobs);
+		return -EIO;
+	}
+	/* every worker holds a reference, so they are done when the device goes;
+	 * the pool has its first connection, so acquiring from it never fails */
+	pthread_mutex_lock(&dev->mutex);
+	dev->connect_jobs = jobs;
+	dev->pool = pool;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (!dev->fsinfo) {
+		dev->fsinfo = fsinfo_new(ifuse_fetch_fsinfo, dev);
+	}
+	ifuse_device_spawn(dev, ifuse_devinfo_worker, dev);
+	ifuse_index_start(dev);
+
+	if (dev->appid) {
+		ifuse_apps_evict(dev);
+	}
+
+	return 0;
+}
+
+/**
+ * Tries to connect to a device. Must be called with dev->mutex held and the
+ * device not being connected; the mutex is dropped while connecting.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_device_attempt(struct ifuse_device *dev)
+{
+	int res;
+
+	dev->state = DEVICE_CONNECTING;
+	if (dev->started == 0) {
+		dev->started = monotonic_now();
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	res = ifuse_device_connect(dev);
+
+	pthread_mutex_lock(&dev->mutex);
+	if (res < 0) {
+		dev->state = DEVICE_IDLE;
+		dev->error = res;
+		dev->retry_at = monotonic_now() + DEVICE_RETRY_INTERVAL;
+		dev->started = 0;
+	} else {
+		dev->state = DEVICE_READY;
+		dev->generation++;
+		if (dev->lost_at > 0) {
+			fprintf(stderr, "Reconnected to device %s after %.1f s\n", dev->udid, monotonic_now() - dev->lost_at);
+			dev->lost_at = 0;
+		}
+	}
+	pthread_cond_broadcast(&dev->cond);
+
+	return res;
+}
+
+/**
+ * Waits until a device is ready for use, connecting to it if nobody else
+ * does already. This is the readiness future every operation waits on; a
+ * device that failed to connect is only tried again after a while, and
+ * while a dropped connection is re-established in the background this
+ * waits up to reconnect_timeout seconds for it.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_device_ready(struct ifuse_device *dev)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->gone && (dev->state == DEVICE_CONNECTING || (dev->state == DEVICE_IDLE && dev->lost_at > 0))) {
+		if (dev->state == DEVICE_CONNECTING) {
+			pthread_cond_wait(&dev->cond, &dev->mutex);
+		} else {
+			double deadline = dev->lost_at + opts.reconnect_timeout;
+			struct timespec ts;
+			if (monotonic_now() >= deadline)
+				break;
+			ts.tv_sec = (time_t)deadline;
+			ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+			pthread_cond_timedwait(&dev->cond, &dev->mutex, &ts);
+		}
+	}
+	if (dev->gone) {
+		res = -ENODEV;
+	} else if (dev->state == DEVICE_IDLE) {
+		if (dev->lost_at > 0 || monotonic_now() < dev->retry_at) {
+			/* do not hammer a device that is locked or still asks for trust */
+			res = dev->error;
+		} else {
+			res = ifuse_device_attempt(dev);
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+/**
+ * Re-establishes the connection to a device after it dropped, with a delay
+ * between the attempts that grows up to DEVICE_RETRY_INTERVAL. Gives up
+ * after reconnect_timeout seconds; the device is then connected again on
+ * the next access like one that failed to connect at startup.
+ */
+static void *ifuse_reconnect_worker(void *arg)
+{
+	struct ifuse_device *dev = (struct ifuse_device*)arg;
+	double delay = RECONNECT_MIN_DELAY;
+
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->gone && dev->state == DEVICE_IDLE && dev->lost_at > 0) {
+		double next;
+		struct timespec ts;
+
+		if (ifuse_device_attempt(dev) == 0)
+			break;
+		if (monotonic_now() - dev->lost_at >= opts.reconnect_timeout) {
+			fprintf(stderr, "ERROR: Could not reconnect to device %s\n", dev->udid);
+			dev->lost_at = 0;
+			pthread_cond_broadcast(&dev->cond);
+			break;
+		}
+
+		/* woken up early when the device is detached */
+		next = monotonic_now() + delay;
+		ts.tv_sec = (time_t)next;
+		ts.tv_nsec = (long)((next - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&dev->cond, &dev->mutex, &ts);
+		delay *= 2;
+		if (delay > DEVICE_RETRY_INTERVAL) {
+			delay = DEVICE_RETRY_INTERVAL;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	ifuse_device_put(dev);
+
+	return NULL;
+}
+
+/**
+ * Handles an error of an operation on a connection of a device. If the
+ * connection dropped, all connections of its session are retired and a new
+ * session is set up in the background.
+ *
+ * @param dev The device.
+ * @param pool The pool of the connection the operation was done on.
+ * @param err The error of the operation.
+ *
+ * @return 1 if the connection dropped, 0 otherwise.
+ */
+static int ifuse_device_lost(struct ifuse_device *dev, afc_pool_t pool, afc_error_t err)
+{
+	struct ifuse_session *session;
+
+	if (!is_connection_error(err))
+		return 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->state != DEVICE_READY || dev->pool != pool) {
+		/* somebody else noticed first */
+		pthread_mutex_unlock(&dev->mutex);
+		return 1;
+	}
+	session = calloc(1, sizeof(struct ifuse_session));
+	if (!session) {
+		pthread_mutex_unlock(&dev->mutex);
+		return 1;
+	}
+	fprintf(stderr, "WARNING: Lost connection to device %s, reconnecting\n", dev->udid);
+
+	/* open files and running operations may still use the old session,
+	 * so it is kept until they are done with it */
+	session->device = dev->device;
+	session->pool = dev->pool;
+	session->connect_jobs = dev->connect_jobs;
+	session->next = dev->dropped;
+	dev->dropped = session;
+	dev->device = NULL;
+	dev->pool = NULL;
+	dev->connect_jobs = NULL;
+	ifuse_device_prune(dev);
+	dev->state = DEVICE_IDLE;
+	dev->error = -ENXIO;
+	dev->retry_at = 0;
+	if (opts.reconnect_timeout <= 0) {
+		/* connect again on the next access */
+		pthread_mutex_unlock(&dev->mutex);
+		return 1;
+	}
+	dev->lost_at = monotonic_now();
+	dev->started = dev->lost_at;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (ifuse_device_spawn(dev, ifuse_reconnect_worker, dev) < 0) {
+		/* connect on the next access instead */
+		pthread_mutex_lock(&dev->mutex);
+		dev->lost_at = 0;
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+
+	return 1;
+}
+
+/**
+ * Hands a connection back after ifuse_device_acquire(). If the operation
+ * failed because the connection dropped, the session is retired first,
+ * while the connection still keeps its pool from being freed.
+ *
+ * @param dev The device.
+ * @param pool The pool the connection belongs to.
+ * @param conn The connection.
+ * @param err The result of the operation.
+ */
+static void ifuse_device_release(struct ifuse_device *dev, afc_pool_t pool, struct afc_conn *conn, afc_error_t err)
+{
+	ifuse_device_lost(dev, pool, err);
+	afc_pool_release(pool, conn);
+}
+
+/**
+ * Decides whether an operation that failed should be done again. This is
+ * the case if the connection dropped and the device could be reconnected
+ * in time. Only operations that can safely be repeated may use this. The
+ * connection must have been handed back with ifuse_device_release().
+ *
+ * @param dev The device.
+ * @param err The error of the operation.
+ * @param tries Counts the attempts, initialize with 0.
+ *
+ * @return 1 if the operation should be repeated, 0 otherwise.
+ */
+static int ifuse_device_retry(struct ifuse_device *dev, afc_error_t err, int *tries)
+{
+	if (!is_connection_error(err))
+		return 0;
+	if (opts.reconnect_timeout <= 0 || ++(*tries) > RECONNECT_MAX_RETRIES)
+		return 0;
+
+	return (ifuse_device_ready(dev) == 0);
+}
+
+/**
+ * Connects a device in the background so that the mount is usable right
+ * away; operations wait in ifuse_device_ready() until it is done.
+ */
+static void *ifuse_startup_worker(void *arg)
+{
+	struct ifuse_device *dev = (struct ifuse_device*)arg;
+
+	ifuse_device_ready(dev);
+	ifuse_device_put(dev);
+
+	return NULL;
+}
+
+/**
+ * Looks up the device a path of the mount belongs to and waits until it is
+ * connected. With --all the first path component is the UDID of the device,
+ * with --apps the appid, otherwise all paths belong to the only device.
+ *
+ * @param path A path below the mount point.
+ * @param dev Receives the device, release it with ifuse_device_put().
+ * @param devpath Receives the path on the device, which points into path.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_device_get(const char *path, struct ifuse_device **dev, const char **devpath)
+{
+	struct ifuse_device *d;
+	const char *name = path;
+	size_t len;
+	int res;
+
+	if (!opts.all_devices && !opts.all_apps) {
+		pthread_mutex_lock(&devices.mutex);
+		d = devices.list;
+		if (d) {
+			d->refs++;
+		}
+		pthread_mutex_unlock(&devices.mutex);
+		if (!d)
+			return -ENODEV;
+		*devpath = path;
+	} else {
+		while (*name == '/')
+			name++;
+		len = strcspn(name, "/");
+		if (len == 0)
+			return -ENOENT;
+
+		d = ifuse_device_lookup(name, len);
+		if (!d)
+			return -ENOENT;
+		*devpath = (name[len] != '\0') ? name + len : "/";
+	}
+
+	res = ifuse_device_ready(d);
+	if (res < 0) {
+		ifuse_device_put(d);
+		return res;
+	}
+	*dev = d;
+
+	return 0;
+}
+
+/**
+ * Finds the device whose tree index holds path, without connecting it.
+ *
+ * @param path A path below the mount point.
+ * @param devpath Receives the path on the device.
+ *
+ * @return The device with a reference taken, or NULL.
+ */
+static struct ifuse_device *ifuse_index_device(const char *path, const char **devpath)
+{
+	struct ifuse_device *dev;
+
+	*devpath = path;
+	if (!opts.all_devices && !opts.all_apps) {
+		pthread_mutex_lock(&devices.mutex);
+		dev = devices.list;
+		if (dev) {
+			dev->refs++;
+		}
+		pthread_mutex_unlock(&devices.mutex);
+	} else {
+		const char *name = path + strspn(path, "/");
+		size_t len = strcspn(name, "/");
+		dev = (len > 0) ? ifuse_device_lookup(name, len) : NULL;
+		*devpath = (name[len] != '\0') ? name + len : "/";
+	}
+
+	return dev;
+}
+
+/**
+ * Makes the tree index check the directory of path and everything below
+ * path again, after path was changed through this mount. The device is
+ * not connected for that.
+ *
+ * @param path A path below the mount point.
+ */
+static void ifuse_index_invalidate(const char *path)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+
+	if (!opts.index_dir)
+		return;
+
+	dev = ifuse_index_device(path, &devpath);
+	if (!dev)
+		return;
+	treeindex_invalidate(dev->index, devpath);
+	ifuse_device_put(dev);
+}
+
+/**
+ * Makes the tree index forget the attributes of a file whose content or
+ * attributes were changed through this mount. Its directory is not listed
+ * again for that.
+ *
+ * @param path A path below the mount point.
+ */
+static void ifuse_index_invalidate_attr(const char *path)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+
+	if (!opts.index_dir)
+		return;
+
+	dev = ifuse_index_device(path, &devpath);
+	if (!dev)
+		return;
+	treeindex_invalidate_attr(dev->index, devpath);
+	ifuse_device_put(dev);
+}
+
+/**
+ * Checks whether path is the root or a device directory in --all mode, or
+ * an app directory in --apps mode. These exist without connecting to a
+ * device.
+ */
+static int is_toplevel_path(const char *path)
+{
+	return (opts.all_devices || opts.all_apps) && path[0] == '/' && !strchr(path + 1, '/');
+}
+
+/**
+ * Checks whether path is the root of the mount. With --documents the
+ * subdir module hands it on as the Documents folder of the app, i.e. as
+ * control_prefix, with or without its slashes.
+ */
+static int is_mount_root(const char *path)
+{
+	const char *prefix = control_prefix + strspn(control_prefix, "/");
+	size_t plen = strlen(prefix);
+
+	path += strspn(path, "/");
+	if (strncmp(path, prefix, plen) != 0)
+		return 0;
+	path += plen;
+
+	return path[strspn(path, "/")] == '\0';
+}
+
+/**
+ * Makes a device that was attached, or an app that was found with --apps,
+ * visible below the mount point.
+ *
+ * @param udid The UDID of the device.
+ * @param appid The app with --apps, NULL otherwise.
+ */
+static void ifuse_device_add(const char *udid, const char *appid)
+{
+	struct ifuse_device *dev;
+	const char *name = (appid) ? appid : udid;
+	char path[256];
+
+	dev = ifuse_device_lookup(name, strlen(name));
+	if (dev) {
+		ifuse_device_put(dev);
+		return;
+	}
+
+	dev = ifuse_device_new(udid, appid);
+	if (!dev)
+		return;
+	pthread_mutex_lock(&devices.mutex);
+	dev->next = devices.list;
+	devices.list = dev;
+	pthread_mutex_unlock(&devices.mutex);
+
+	/* forget that the directory did not exist */
+	snprintf(path, sizeof(path), "/%s", name);
+	metacache_invalidate_tree(path);
+	if (devices.fuse) {
+		fuse_invalidate_path(devices.fuse, path);
+	}
+}
+
+/**
+ * Removes the directory of a device that was detached, or of an app that was
+ * uninstalled. Operations that are in progress and open files keep the
+ * entry alive until they are done; they fail since the connection is gone.
+ *
+ * @param name The name of the directory, see ifuse_device_lookup().
+ */
+static void ifuse_device_remove(const char *name)
+{
+	struct ifuse_device **p;
+	struct ifuse_device *dev = NULL;
+	char path[256];
+
+	pthread_mutex_lock(&devices.mutex);
+	for (p = &devices.list; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, name)) {
+			dev = *p;
+			*p = dev->next;
+			dev->next = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&devices.mutex);
+	if (!dev)
+		return;
+
+	/* stop waiting for it to come back, it shows up as a new entry */
+	pthread_mutex_lock(&dev->mutex);
+	dev->gone = 1;
+	pthread_cond_broadcast(&dev->cond);
+	pthread_mutex_unlock(&dev->mutex);
+
+	snprintf(path, sizeof(path), "/%s", name);
+	metacache_invalidate_tree(path);
+	if (devices.fuse) {
+		fuse_invalidate_path(devices.fuse, path);
+	}
+	ifuse_device_put(dev);
+}
+
+static void ifuse_device_event(const idevice_event_t *event, void *user_data)
+{
+	struct ifuse_device *dev;
+
+	/* a device connected via USB and network shows up twice */
+	if (event->conn_type != ((opts.use_network) ? CONNECTION_NETWORK : CONNECTION_USBMUXD))
+		return;
+
+	switch (event->event) {
+	case IDEVICE_DEVICE_ADD:
+		ifuse_device_add(event->udid, NULL);
+		break;
+	case IDEVICE_DEVICE_REMOVE:
+		ifuse_device_remove(event->udid);
+		break;
+	case IDEVICE_DEVICE_PAIRED:
+		/* the user trusted this computer, connecting may work now */
+		dev = ifuse_device_lookup(event->udid, strlen(event->udid));
+		if (dev) {
+			pthread_mutex_lock(&dev->mutex);
+			dev->retry_at = 0;
+			pthread_mutex_unlock(&dev->mutex);
+			ifuse_device_put(dev);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Asks the installation proxy for the installed apps.
+ *
+ * @param ip The installation proxy client.
+ *
+ * @return An array with a dictionary for every app, or NULL on error.
+ */
+static plist_t browse_apps(instproxy_client_t ip)
+{
+	plist_t client_opts = instproxy_client_options_new();
+	plist_t list = NULL;
+
+	instproxy_client_options_add(client_opts, "ApplicationType", "Any", NULL);
+	instproxy_client_options_set_return_attributes(client_opts,
+				"CFBundleIdentifier",
+				"CFBundleDisplayName",
+				"CFBundleVersion",
+				"UIFileSharingEnabled",
+				NULL
+	);
+	instproxy_browse(ip, client_opts, &list);
+	instproxy_client_options_free(client_opts);
+
+	if (list && plist_get_node_type(list) != PLIST_ARRAY) {
+		plist_free(list);
+		list = NULL;
+	}
+
+	return list;
+}
+
+/**
+ * Checks whether an app returned by browse_apps() has file sharing enabled,
+ * which is required to access its Documents folder.
+ */
+static int app_sharing_enabled(plist_t app)
+{
+	uint8_t sharing_enabled = 0;
+	plist_t val;
+
+	if (!app || plist_get_node_type(app) != PLIST_DICT)
+		return 0;
+	val = plist_dict_get_item(app, "UIFileSharingEnabled");
+	if (val && plist_get_node_type(val) == PLIST_BOOLEAN) {
+		plist_get_bool_val(val, &sharing_enabled);
+	}
+
+	return sharing_enabled;
+}
+
+/**
+ * Enumerates the apps with file sharing enabled through the lockdown
+ * session shared by all apps, and makes the directories below the mount
+ * point match them with --apps.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_apps_enumerate(void)
+{
+	struct afc_target target = { INSTPROXY_SERVICE_NAME, NULL, 0 };
+	lockdownd_service_descriptor_t service = NULL;
+	idevice_t idev = NULL;
+	instproxy_client_t ip = NULL;
+	plist_t list = NULL;
+	char **appids = NULL;
+	uint32_t count = 0;
+	uint32_t i;
+	int res;
+
+	res = ifuse_apps_start_services(&target, 1, &service);
+	if (res < 0)
+		return res;
+	if (idevice_new_with_options(&idev, apps.udid, (opts.use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) == IDEVICE_E_SUCCESS) {
+		instproxy_client_new(idev, service, &ip);
+	}
+	lockdownd_service_descriptor_free(service);
+	if (ip) {
+		list = browse_apps(ip);
+		instproxy_client_free(ip);
+	}
+	if (idev) {
+		idevice_free(idev);
+	}
+	if (!list) {
+		fprintf(stderr, "ERROR: Could not list the apps on device %s\n", apps.udid);
+		return -EIO;
+	}
+
+	appids = calloc(plist_array_get_size(list) + 1, sizeof(char*));
+	if (!appids) {
+		plist_free(list);
+		return -ENOMEM;
+	}
+	for (i = 0; i < plist_array_get_size(list); i++) {
+		plist_t app = plist_array_get_item(list, i);
+		plist_t val;
+		if (!app_sharing_enabled(app))
+			continue;
+		val = plist_dict_get_item(app, "CFBundleIdentifier");
+		if (val && plist_get_node_type(val) == PLIST_STRING) {
+			plist_get_string_val(val, &appids[count]);
+			if (appids[count] && *appids[count] && !strchr(appids[count], '/')) {
+				ifuse_device_add(apps.udid, appids[count]);
+				count++;
+			} else {
+				free(appids[count]);
+				appids[count] = NULL;
+			}
+		}
+	}
+	plist_free(list);
+
+	/* remove the apps that were uninstalled, one at a time since
+	 * ifuse_device_remove() takes devices.mutex itself */
+	for (;;) {
+		struct ifuse_device *dev;
+		char *name = NULL;
+
+		pthread_mutex_lock(&devices.mutex);
+		for (dev = devices.list; dev && !name; dev = dev->next) {
+			for (i = 0; i < count && strcmp(appids[i], dev->name) != 0; i++);
+			if (i == count) {
+				name = strdup(dev->name);
+			}
+		}
+		pthread_mutex_unlock(&devices.mutex);
+		if (!name)
+			break;
+		ifuse_device_remove(name);
+		free(name);
+	}
+	free_dictionary(appids);
+
+	return 0;
+}
+
+/**
+ * Makes sure the apps were enumerated within the last max_age seconds with
+ * --apps. Concurrent callers wait for the enumeration in progress; one that
+ * failed is only repeated after DEVICE_RETRY_INTERVAL.
+ *
+ * @return 0 if the apps are known, even if refreshing them failed, or a
+ *    negative errno value.
+ */
+static int ifuse_apps_update(double max_age)
+{
+	double now;
+	int res;
+
+	pthread_mutex_lock(&apps.mutex);
+	while (apps.listing) {
+		pthread_cond_wait(&apps.cond, &apps.mutex);
+	}
+	now = monotonic_now();
+	if ((apps.listed_at > 0 && now - apps.listed_at < max_age) || now < apps.retry_at) {
+		res = (apps.listed_at > 0) ? 0 : apps.error;
+		pthread_mutex_unlock(&apps.mutex);
+		return res;
+	}
+	apps.listing = 1;
+	pthread_mutex_unlock(&apps.mutex);
+
+	res = ifuse_apps_enumerate();
+
+	pthread_mutex_lock(&apps.mutex);
+	apps.listing = 0;
+	if (res < 0) {
+		apps.error = res;
+		apps.retry_at = monotonic_now() + DEVICE_RETRY_INTERVAL;
+		if (apps.listed_at > 0) {
+			/* keep serving the apps found before */
+			res = 0;
+		}
+	} else {
+		apps.listed_at = monotonic_now();
+	}
+	pthread_cond_broadcast(&apps.cond);
+	pthread_mutex_unlock(&apps.mutex);
+
+	return res;
+}
+
+/**
+ * Enumerates the apps in the background when mounting with --apps, so that
+ * the mount is usable right away.
+ */
+static void *ifuse_apps_worker(void *arg)
+{
+	double start = monotonic_now();
+
+	if (ifuse_apps_update(APPS_REFRESH_INTERVAL) == 0 && debug)
+		fprintf(stderr, "apps listed after %.1f ms\n", ELAPSED_MS(start));
+
+	return NULL;
+}
+
+/**
+ * Moves the device side file position of an open file to offset, unless the
+ * tracked position already matches. This saves a full round trip for every
+ * sequential read or write. Must be called with file->lock held.
+ *
+ * @param file The open file.
+ * @param offset The absolute offset to seek to.
+ *
+ * @return AFC_E_SUCCESS or the error returned by afc_file_seek().
+ */
+static afc_error_t ifuse_file_seek(struct ifuse_file *file, off_t offset)
+{
+	afc_error_t err = AFC_E_SUCCESS;
+
+	if (!file->pos_valid || file->pos != (uint64_t)offset) {
+		err = afc_file_seek(file->conn->client, file->handle, offset, SEEK_SET);
+		file->pos_valid = (err == AFC_E_SUCCESS);
+		file->pos = offset;
+	}
+
+	return err;
+}
+
+/**
+ * Retrieves the attributes of path from the device and stores them in the
+ * metadata cache and the tree index.
+ *
+ * @param afc The AFC client to use.
+ * @param index The tree index of the device, can be NULL.
+ * @param devpath The path on the device.
+ * @param path The path below the mount point, used for caching.
+ * @param stbuf Receives the attributes.
+ *
+ * @return AFC_E_SUCCESS or an AFC error code.
+ */
+static afc_error_t ifuse_fetch_attr(afc_client_t afc, treeindex_t index, const char *devpath, const char *path, struct stat *stbuf)
+{
+	uint64_t since = metacache_begin();
+	afc_error_t ret = ifuse_query_attr(afc, devpath, stbuf);
+
+	if (ret != AFC_E_SUCCESS) {
+		if (ret == AFC_E_OBJECT_NOT_FOUND) {
+			metacache_put_negative(path, ENOENT, since);
+		}
+		return ret;
+	}
+
+	metacache_put_attr(path, stbuf, since);
+	treeindex_put_attr(index, devpath, stbuf);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Looks up the attributes of path in the tree index of its device, which
+ * knows them if the listing of the directory of path was confirmed
+ * recently and, for a file, they were retrieved less than index_timeout
+ * seconds ago.
+ *
+ * @return 1 on a positive hit, a negative errno value on a negative hit,
+ *    or 0 if the index does not know path.
+ */
+static int ifuse_index_attr(treeindex_t index, const char *devpath, struct stat *stbuf)
+{
+	int res = treeindex_get_attr(index, devpath, stbuf);
+
+	if (res > 0) {
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_blksize = g_blocksize;
+	}
+
+	return res;
+}
+
+/**
+ * Opens a file again on the current session of its device after the
+ * connection it was opened on dropped. The operation that failed seeks to
+ * its offset again, so the position is not restored here. Must be called
+ * with file->lock held.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_file_reopen(struct ifuse_file *file)
+{
+	afc_file_mode_t mode = file->mode;
+	unsigned int generation;
+	struct afc_conn *conn;
+	afc_pool_t pool;
+	uint64_t handle = 0;
+	afc_error_t err;
+
+	pthread_mutex_lock(&file->dev->mutex);
+	generation = file->dev->generation;
+	pthread_mutex_unlock(&file->dev->mutex);
+	if (generation == file->generation)
+		return 0;
+
+	/* do not truncate what was written before the connection dropped */
+	if (mode == AFC_FOPEN_WRONLY || mode == AFC_FOPEN_WR) {
+		mode = AFC_FOPEN_RW;
+	}
+	conn = ifuse_device_acquire(file->dev, &pool);
+	err = afc_file_open(conn->client, file->devpath, mode, &handle);
+	if (err == AFC_E_SUCCESS) {
+		afc_pool_ref(pool);
+	}
+	ifuse_device_release(file->dev, pool, conn, err);
+	if (err != AFC_E_SUCCESS) {
+		return -afc_info_errno(err);
+	}
+
+	/* the old handle went away with its connection */
+	afc_pool_unref(file->pool);
+	file->pool = pool;
+	file->conn = conn;
+	file->handle = handle;
+	file->generation = generation;
+	file->pos = 0;
+	file->pos_valid = !file->append;
+
+	return 0;
+}
+
+/**
+ * Decides whether an operation on an open file that failed should be done
+ * again, see ifuse_device_retry(). The file is opened again if the device
+ * was reconnected. Must be called with file->lock held.
+ *
+ * @return 1 if the operation should be repeated, 0 otherwise.
+ */
+static int ifuse_file_retry(struct ifuse_file *file, afc_error_t err, int *tries)
+{
+	/* the file keeps its pool, so it can be checked after the release */
+	ifuse_device_lost(file->dev, file->pool, err);
+	if (!ifuse_device_retry(file->dev, err, tries))
+		return 0;
+
+	return (ifuse_file_reopen(file) == 0);
+}
+
+/**
+ * Reads size bytes at offset from an open file, issuing as many AFC read
+ * requests as needed. Used directly and as fetch function for readahead,
+ * so it may run outside of a fuse worker thread.
+ *
+ * @return Number of bytes read, which is only less than size at the end
+ *    of the file, or a negative errno value.
+ */
+static ssize_t ifuse_file_fetch(void *ctx, char *buf, size_t size, uint64_t offset)
+{
+	struct ifuse_file *file = (struct ifuse_file*)ctx;
+	afc_error_t err;
+	size_t done = 0;
+	int tries = 0;
+
+	pthread_mutex_lock(&file->lock);
+	do {
+		afc_pool_hold(file->pool, file->conn);
+		err = ifuse_file_seek(file, offset + done);
+		while (err == AFC_E_SUCCESS && done < size) {
+			uint32_t bytes = 0;
+			uint32_t chunk = (size - done > UINT32_MAX) ? UINT32_MAX : (uint32_t)(size - done);
+			err = afc_file_read(file->conn->client, file->handle, buf + done, chunk, &bytes);
+			if (err != AFC_E_SUCCESS) {
+				file->pos_valid = 0;
+				break;
+			}
+			file->pos += bytes;
+			if (bytes == 0)
+				break;
+			done += bytes;
+		}
+		afc_pool_release(file->pool, file->conn);
+	} while (err != AFC_E_SUCCESS && ifuse_file_retry(file, err, &tries));
+	pthread_mutex_unlock(&file->lock);
+
+	if (err != AFC_E_SUCCESS && done == 0) {
+		return -afc_info_errno(err);
+	}
+
+	return done;
+}
+
+/**
+ * Returns the size of a regular file if its attributes are cached, so that
+ * space accounting does not cost a round trip.
+ *
+ * @return The size or -1 if it is not known.
+ */
+static int64_t ifuse_cached_size(const char *path)
+{
+	struct stat st;
+
+	if (metacache_get_attr(path, &st) == 1 && S_ISREG(st.st_mode)) {
+		return st.st_size;
+	}
+	return -1;
+}
+
+/**
+ * Accounts the space used by data written to an open file in the cached
+ * free space figure. Must be called with file->lock held.
+ */
+static void ifuse_file_account(struct ifuse_file *file, uint64_t offset, size_t len)
+{
+	uint64_t end;
+
+	if (len == 0) {
+		return;
+	}
+	if (file->size < 0) {
+		/* most writes to files of unknown size are new data */
+		fsinfo_adjust(file->dev->fsinfo, len);
+		return;
+	}
+	if (file->append) {
+		offset = file->size;
+	}
+	end = offset + len;
+	if (end > (uint64_t)file->size) {
+		fsinfo_adjust(file->dev->fsinfo, end - file->size);
+		file->size = end;
+	}
+}
+
+/**
+ * Writes size bytes at offset to an open file, issuing as many AFC write
+ * requests as needed. Must be called with file->lock held.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_file_store(struct ifuse_file *file, const char *buf, size_t size, uint64_t offset)
+{
+	afc_error_t err;
+	size_t done = 0;
+	int tries = 0;
+
+	do {
+		afc_pool_hold(file->pool, file->conn);
+		err = ifuse_file_seek(file, offset + done);
+		while (err == AFC_E_SUCCESS && done < size) {
+			uint32_t bytes = 0;
+			uint32_t chunk = (size - done > UINT32_MAX) ? UINT32_MAX : (uint32_t)(size - done);
+			err = afc_file_write(file->conn->client, file->handle, buf + done, chunk, &bytes);
+			if (err != AFC_E_SUCCESS || bytes == 0)
+				break;
+			done += bytes;
+			file->pos += bytes;
+		}
+		/* in append mode the device writes at the end, wherever we seeked to */
+		if (err != AFC_E_SUCCESS || file->append) {
+			file->pos_valid = 0;
+		}
+		afc_pool_release(file->pool, file->conn);
+		/* writing at an offset can be repeated, appending can not */
+	} while (err != AFC_E_SUCCESS && ifuse_file_retry(file, err, &tries) && !file->append);
+	ifuse_file_account(file, offset, done);
+
+	if (err != AFC_E_SUCCESS) {
+		return -afc_info_errno(err);
+	}
+	if (done < size) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Publishes where the buffered data of an open file ends for getattr. Must
+ * be called with file->lock held whenever the buffer changed.
+ */
+static void ifuse_file_wb_update(struct ifuse_file *file)
+{
+	int64_t end = -1;
+
+	if (file->wb_len > 0) {
+		if (!file->append) {
+			end = file->wb_offset + file->wb_len;
+		} else if (file->size >= 0) {
+			end = file->size + file->wb_len;
+		}
+	}
+	__atomic_store_n(&file->wb_end, end, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sends the buffered data of an open file to the device. A failure is kept
+ * to be reported through the handle later. Must be called with file->lock
+ * held.
+ */
+static void ifuse_file_flush(struct ifuse_file *file)
+{
+	int res;
+
+	if (file->wb_len == 0)
+		return;
+
+	res = ifuse_file_store(file, file->wb_data, file->wb_len, file->wb_offset);
+	file->wb_len = 0;
+	ifuse_file_wb_update(file);
+	if (res < 0 && !file->wb_err) {
+		file->wb_err = -res;
+	}
+}
+
+/**
+ * Sends the buffered data of an open file to the device and reports an
+ * error of an earlier write-back that was not reported yet. Must be called
+ * with file->lock held.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_file_writeback(struct ifuse_file *file)
+{
+	int res = 0;
+
+	ifuse_file_flush(file);
+	if (file->wb_err) {
+		res = -file->wb_err;
+		file->wb_err = 0;
+	}
+
+	return res;
+}
+
+/**
+ * Lists an open file in writers.
+ */
+static void ifuse_writers_add(struct ifuse_file *file)
+{
+	pthread_mutex_lock(&writers.mutex);
+	file->wnext = writers.list;
+	__atomic_store_n(&writers.list, file, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&writers.mutex);
+}
+
+/**
+ * Takes an open file off writers, waiting for a truncate that flushes it.
+ */
+static void ifuse_writers_remove(struct ifuse_file *file)
+{
+	struct ifuse_file **pp;
+
+	pthread_mutex_lock(&writers.mutex);
+	while (file->busy > 0) {
+		pthread_cond_wait(&writers.cond, &writers.mutex);
+	}
+	for (pp = &writers.list; *pp && *pp != file; pp = &(*pp)->wnext);
+	if (*pp)
+		__atomic_store_n(pp, file->wnext, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&writers.mutex);
+}
+
+/**
+ * Extends the size of a regular file to cover the data that open files
+ * still buffer for it, since it only reaches the device later.
+ */
+static void ifuse_writers_size(const char *path, struct stat *st)
+{
+	struct ifuse_file *file;
+	int64_t end;
+
+	if (!__atomic_load_n(&writers.list, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&writers.mutex);
+	for (file = writers.list; file; file = file->wnext) {
+		if (strcmp(file->path, path))
+			continue;
+		end = __atomic_load_n(&file->wb_end, __ATOMIC_ACQUIRE);
+		if (end > st->st_size) {
+			st->st_size = end;
+			st->st_blocks = (end + 511) / 512;
+		}
+	}
+	pthread_mutex_unlock(&writers.mutex);
+}
+
+/**
+ * Returns the files open for writing at path, except skip, and marks them
+ * busy so that they stay open until ifuse_writers_put().
+ *
+ * @param count Receives the number of files.
+ *
+ * @return The files, to be passed to ifuse_writers_put(), or NULL if there
+ *    are none or when out of memory.
+ */
+static struct ifuse_file **ifuse_writers_get(const char *path, struct ifuse_file *skip, int *count)
+{
+	struct ifuse_file **files = NULL;
+	struct ifuse_file *file;
+	int n = 0;
+
+	*count = 0;
+	if (!__atomic_load_n(&writers.list, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pthread_mutex_lock(&writers.mutex);
+	for (file = writers.list; file; file = file->wnext) {
+		if (file != skip && !strcmp(file->path, path))
+			n++;
+	}
+	if (n > 0)
+		files = malloc(n * sizeof(struct ifuse_file*));
+	if (files) {
+		for (file = writers.list; file; file = file->wnext) {
+			if (file != skip && !strcmp(file->path, path)) {
+				file->busy++;
+				files[(*count)++] = file;
+			}
+		}
+	}
+	pthread_mutex_unlock(&writers.mutex);
+
+	return files;
+}
+
+static void ifuse_writers_put(struct ifuse_file **files, int count)
+{
+	int i;
+
+	if (!files)
+		return;
+
+	pthread_mutex_lock(&writers.mutex);
+	for (i = 0; i < count; i++) {
+		files[i]->busy--;
+	}
+	pthread_cond_broadcast(&writers.cond);
+	pthread_mutex_unlock(&writers.mutex);
+	free(files);
+}
+
+/**
+ * Retrieves the attributes of path from its device, bypassing the metadata
+ * cache and the tree index, which are updated with them.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_device_attr(struct ifuse_device *dev, const char *devpath, const char *path, struct stat *stbuf)
+{
+	afc_pool_t pool;
+	afc_error_t err;
+	int tries = 0;
+
+	do {
+		struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+		err = ifuse_fetch_attr(conn->client, dev->index, devpath, path, stbuf);
+		ifuse_device_release(dev, pool, conn, err);
+	} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+
+	return -afc_info_errno(err);
+}
+
+/**
+ * Gets the attributes of path as the device reports them.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_lookup_attr(const char *path, struct stat *stbuf)
+{
+	int vtype = get_virtual_path_type(path);
+	if (vtype != VIRTUAL_NONE) {
+		memset(stbuf, 0, sizeof(struct stat));
+		if (vtype == VIRTUAL_DIR) {
+			stbuf->st_mode = S_IFDIR | 0555;
+			stbuf->st_nlink = 2;
+		} else {
+			/* the content is rendered at open and read with direct_io,
+			 * so the size does not need to be known */
+			stbuf->st_mode = S_IFREG | 0444;
+			stbuf->st_nlink = 1;
+		}
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_blksize = g_blocksize;
+		return 0;
+	}
+
+	if (is_toplevel_path(path)) {
+		/* the device directories do not require a connection */
+		if (path[1] != '\0') {
+			struct ifuse_device *dev;
+			if (opts.all_apps) {
+				int res = ifuse_apps_update(APPS_REFRESH_INTERVAL);
+				if (res < 0)
+					return res;
+			}
+			dev = ifuse_device_lookup(path + 1, strlen(path + 1));
+			if (!dev)
+				return -ENOENT;
+			ifuse_device_put(dev);
+		}
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_blksize = g_blocksize;
+		return 0;
+	}
+
+	int res = metacache_get_attr(path, stbuf);
+	if (res > 0) {
+		return 0;
+	} else if (res < 0) {
+		return res;
+	}
+
+	struct ifuse_device *dev;
+	const char *devpath;
+	res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0)
+		return res;
+	res = ifuse_index_attr(dev->index, devpath, stbuf);
+	if (res == 0) {
+		res = ifuse_device_attr(dev, devpath, path, stbuf);
+	}
+	ifuse_device_put(dev);
+
+	return (res > 0) ? 0 : res;
+}
+
+static int ifuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	int res = ifuse_lookup_attr(path, stbuf);
+
+	if (res == 0 && S_ISREG(stbuf->st_mode)) {
+		ifuse_writers_size(path, stbuf);
+	}
+
+	return res;
+}
+
+/* smaller listings are not worth spreading across connections */
+#define PREFETCH_MIN_ENTRIES 4
+
+struct attr_prefetch {
+	struct ifuse_device *dev;
+	const char *devdir;
+	const char *dir;
+	const char **names;
+	struct stat *stats;
+	int *results;
+	int count;
+	int next;
+	pthread_mutex_t mutex;
+	/* the following are protected by prefetcher.mutex */
+	struct attr_prefetch *queue_next;
+	int queued;
+	int helpers;
+	int active;
+	pthread_cond_t done;
+};
+
+/* the threads helping to fetch the attributes of directory listings */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct attr_prefetch *queue_head;
+	struct attr_prefetch *queue_tail;
+	pthread_t *threads;
+	unsigned int nthreads;
+	int quit;
+} prefetcher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, 0, 0 };
+
+static char *path_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t nlen = strlen(name);
+	char *path = malloc(dlen + nlen + 2);
+
+	if (!path)
+		return NULL;
+
+	memcpy(path, dir, dlen);
+	if (dlen == 0 || dir[dlen-1] != '/') {
+		path[dlen++] = '/';
+	}
+	memcpy(path + dlen, name, nlen + 1);
+
+	return path;
+}
+
+static void attr_prefetch_run(struct attr_prefetch *job)
+{
+	while (1) {
+		int i;
+		char *path;
+		char *devpath;
+
+		pthread_mutex_lock(&job->mutex);
+		i = job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (i >= job->count)
+			break;
+
+		if (!strcmp(job->names[i], ".") || !strcmp(job->names[i], "..")) {
+			job->results[i] = -EINVAL;
+			continue;
+		}
+
+		path = path_join(job->dir, job->names[i]);
+		devpath = path_join(job->devdir, job->names[i]);
+		if (!path || !devpath) {
+			job->results[i] = -ENOMEM;
+		} else if (metacache_get_attr(path, &job->stats[i]) > 0 || ifuse_index_attr(job->dev->index, devpath, &job->stats[i]) > 0) {
+			job->results[i] = 0;
+		} else {
+			/* a dropped connection is reported like for any other request */
+			job->results[i] = ifuse_device_attr(job->dev, devpath, path, &job->stats[i]);
+		}
+		free(path);
+		free(devpath);
+	}
+}
+
+/* unlinks job from the queue, prefetcher.mutex must be held */
+static void attr_prefetch_dequeue(struct attr_prefetch *job)
+{
+	struct attr_prefetch **pp = &prefetcher.queue_head;
+	struct attr_prefetch *prev = NULL;
+
+	while (*pp && *pp != job) {
+		prev = *pp;
+		pp = &(*pp)->queue_next;
+	}
+	if (*pp) {
+		*pp = job->queue_next;
+		if (prefetcher.queue_tail == job)
+			prefetcher.queue_tail = prev;
+	}
+	job->queue_next = NULL;
+	job->queued = 0;
+}
+
+static void *attr_prefetch_worker(void *arg)
+{
+	pthread_mutex_lock(&prefetcher.mutex);
+	while (1) {
+		struct attr_prefetch *job;
+
+		while (!prefetcher.queue_head && !prefetcher.quit) {
+			pthread_cond_wait(&prefetcher.cond, &prefetcher.mutex);
+		}
+		if (prefetcher.quit)
+			break;
+
+		/* a job stays queued until it has all the helpers it wants */
+		job = prefetcher.queue_head;
+		if (--job->helpers == 0)
+			attr_prefetch_dequeue(job);
+		job->active++;
+		pthread_mutex_unlock(&prefetcher.mutex);
+
+		attr_prefetch_run(job);
+
+		pthread_mutex_lock(&prefetcher.mutex);
+		if (--job->active == 0)
+			pthread_cond_signal(&job->done);
+	}
+	pthread_mutex_unlock(&prefetcher.mutex);
+
+	return NULL;
+}
+
+/**
+ * Starts the threads that help fetching the attributes of directory
+ * listings.
+ *
+ * @param nthreads Number of threads.
+ */
+static void ifuse_prefetch_init(unsigned int nthreads)
+{
+	unsigned int i;
+
+	prefetcher.quit = 0;
+	if (nthreads == 0)
+		return;
+	prefetcher.threads = calloc(nthreads, sizeof(pthread_t));
+	if (!prefetcher.threads)
+		return;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&prefetcher.threads[i], NULL, attr_prefetch_worker, NULL) != 0)
+			break;
+	}
+	prefetcher.nthreads = i;
+}
+
+/**
+ * Stops the prefetch threads.
+ */
+static void ifuse_prefetch_cleanup(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&prefetcher.mutex);
+	prefetcher.quit = 1;
+	pthread_cond_broadcast(&prefetcher.cond);
+	pthread_mutex_unlock(&prefetcher.mutex);
+
+	for (i = 0; i < prefetcher.nthreads; i++) {
+		pthread_join(prefetcher.threads[i], NULL);
+	}
+	free(prefetcher.threads);
+	prefetcher.threads = NULL;
+	prefetcher.nthreads = 0;
+}
+
+/**
+ * Fetches the attributes of all entries of a directory listing, spreading
+ * the requests across the connections of the pool so that several of them
+ * are in flight at the same time. The work is shared with the threads
+ * started by ifuse_prefetch_init().
+ *
+ * @param dev The device.
+ * @param pool The connection pool of the device, which sets how many
+ *    requests are in flight.
+ * @param devdir The directory the names belong to, on the device.
+ * @param dir The same directory below the mount point.
+ * @param names The names to look up.
+ * @param count Number of names.
+ * @param stats Receives count attributes.
+ * @param results Receives 0 for each name whose attributes were retrieved,
+ *    or a negative errno value.
+ */
+static void ifuse_prefetch_attrs(struct ifuse_device *dev, afc_pool_t pool, const char *devdir, const char *dir, const char **names, int count, struct stat *stats, int *results)
+{
+	struct attr_prefetch job;
+	int helpers = 0;
+
+	job.dev = dev;
+	job.devdir = devdir;
+	job.dir = dir;
+	job.names = names;
+	job.stats = stats;
+	job.results = results;
+	job.count = count;
+	job.next = 0;
+	pthread_mutex_init(&job.mutex, NULL);
+	job.queue_next = NULL;
+	job.queued = 0;
+	job.active = 0;
+	pthread_cond_init(&job.done, NULL);
+
+	if (count >= PREFETCH_MIN_ENTRIES) {
+		helpers = (int)pool->count - 1;
+		if (helpers > count - 1)
+			helpers = count - 1;
+		if (helpers > (int)prefetcher.nthreads)
+			helpers = prefetcher.nthreads;
+	}
+	if (helpers > 0) {
+		job.helpers = helpers;
+		job.queued = 1;
+		pthread_mutex_lock(&prefetcher.mutex);
+		if (prefetcher.queue_tail)
+			prefetcher.queue_tail->queue_next = &job;
+		else
+			prefetcher.queue_head = &job;
+		prefetcher.queue_tail = &job;
+		pthread_cond_broadcast(&prefetcher.cond);
+		pthread_mutex_unlock(&prefetcher.mutex);
+	}
+
+	/* the calling thread works on the listing, too */
+	attr_prefetch_run(&job);
+
+	if (helpers > 0) {
+		pthread_mutex_lock(&prefetcher.mutex);
+		if (job.queued)
+			attr_prefetch_dequeue(&job);
+		while (job.active > 0) {
+			pthread_cond_wait(&job.done, &prefetcher.mutex);
+		}
+		pthread_mutex_unlock(&prefetcher.mutex);
+	}
+
+	pthread_cond_destroy(&job.done);
+	pthread_mutex_destroy(&job.mutex);
+}
+
+/* number of entries whose attributes are fetched at a time for readdirplus */
+#define READDIR_PLUS_BATCH 256
+
+/**
+ * Checks whether path is a directory that is listed without a snapshot,
+ * i.e. the control directory or the root directory of --all and --apps.
+ */
+static int is_virtual_dir(const char *path)
+{
+	return get_virtual_path_type(path) == VIRTUAL_DIR || ((opts.all_devices || opts.all_apps) && !strcmp(path, "/"));
+}
+
+/**
+ * Lists a directory of a device. The listing in the tree index is used if
+ * the modification time of the directory shows that it is still current,
+ * which takes one small request instead of the listing. A listing taken
+ * from the device replaces the indexed one.
+ *
+ * @param dev The device.
+ * @param path The directory below the mount point.
+ * @param devpath The directory on the device.
+ * @param snap Receives the listing.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_list_dir(struct ifuse_device *dev, const char *path, const char *devpath, dirsnap_t *snap)
+{
+	char **dirs = NULL;
+	struct stat st;
+	afc_pool_t pool;
+	afc_error_t err;
+	int has_attr = 0;
+	int tries = 0;
+
+	*snap = treeindex_get_dir(dev->index, devpath);
+	if (*snap)
+		return 0;
+
+	if (treeindex_listed(dev->index, devpath)) {
+		do {
+			struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+			err = ifuse_query_attr(conn->client, devpath, &st);
+			ifuse_device_release(dev, pool, conn, err);
+		} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+		if (err == AFC_E_SUCCESS && treeindex_check_dir(dev->index, devpath, &st)) {
+			*snap = treeindex_get_dir(dev->index, devpath);
+			if (*snap)
+				return 0;
+		}
+		has_attr = (err == AFC_E_SUCCESS);
+	} else if (dev->index && metacache_get_attr(path, &st) > 0) {
+		/* attributes from before the listing are fine, a change in
+		 * between makes the index list the directory again */
+		has_attr = 1;
+	}
+
+	tries = 0;
+	do {
+		struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+		err = afc_read_directory(conn->client, devpath, &dirs);
+		ifuse_device_release(dev, pool, conn, err);
+	} while (!dirs && ifuse_device_retry(dev, err, &tries));
+	if (!dirs)
+		return (err != AFC_E_SUCCESS) ? -afc_info_errno(err) : -EIO;
+
+	if (has_attr) {
+		treeindex_put_dir(dev->index, devpath, &st, dirs, NULL);
+	}
+	*snap = dirsnap_new(dirs);
+	free_dictionary(dirs);
+
+	return (*snap) ? 0 : -ENOMEM;
+}
+
+/**
+ * Takes a snapshot of the listing of a directory, which readdir pages
+ * through. Each open directory is thus fetched from the device at most
+ * once, however often the kernel comes back for more entries.
+ */
+static int ifuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+	dirsnap_t snap;
+	uint64_t since;
+	int res;
+
+	fi->fh = 0;
+	if (is_virtual_dir(path))
+		return 0;
+
+	snap = metacache_get_dir(path);
+	if (!snap) {
+		since = metacache_begin();
+		res = ifuse_device_get(path, &dev, &devpath);
+		if (res < 0)
+			return res;
+		res = ifuse_list_dir(dev, path, devpath, &snap);
+		ifuse_device_put(dev);
+		if (res < 0)
+			return res;
+		metacache_put_dir(path, snap, since);
+	}
+
+	fi->fh = filetab_add(snap);
+	if (fi->fh == 0) {
+		dirsnap_unref(snap);
+		return -ENFILE;
+	}
+
+	return 0;
+}
+
+static int ifuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct ifuse_device *dev = NULL;
+	const char *devpath = path;
+	afc_pool_t pool;
+	dirsnap_t snap;
+	uint32_t count;
+	uint32_t i;
+	int res;
+
+	if (get_virtual_path_type(path) == VIRTUAL_DIR) {
+		filler(buf, ".", NULL, 0, 0);
+		filler(buf, "..", NULL, 0, 0);
+		filler(buf, IFUSE_STATS_FILE + sizeof(IFUSE_CONTROL_DIR), NULL, 0, 0);
+		return 0;
+	}
+
+	if ((opts.all_devices || opts.all_apps) && !strcmp(path, "/")) {
+		if (opts.all_apps) {
+			res = ifuse_apps_update(APPS_REFRESH_INTERVAL);
+			if (res < 0)
+				return res;
+		}
+		filler(buf, ".", NULL, 0, 0);
+		filler(buf, "..", NULL, 0, 0);
+		pthread_mutex_lock(&devices.mutex);
+		for (dev = devices.list; dev; dev = dev->next) {
+			filler(buf, dev->name, NULL, 0, 0);
+		}
+		pthread_mutex_unlock(&devices.mutex);
+		return 0;
+	}
+
+	snap = (dirsnap_t)filetab_get(fi->fh);
+	if (!snap)
+		return -EBADF;
+	count = dirsnap_count(snap);
+	if (offset < 0 || (uint64_t)offset >= count)
+		return 0;
+
+	/* the offset of an entry tells where the next one starts, so the
+	 * kernel continues right after the last entry that fit */
+	if (!(flags & FUSE_READDIR_PLUS)) {
+		for (i = offset; i < count; i++) {
+			if (filler(buf, dirsnap_name(snap, i), NULL, i + 1, 0))
+				break;
+		}
+		return 0;
+	}
+
+	res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0)
+		return res;
+	pool = ifuse_device_pool(dev);
+
+	/* the attributes are fetched in batches, since the kernel buffer only
+	 * takes a part of a large directory; the rest of a batch that did not
+	 * fit is in the attribute cache for the next call */
+	for (i = offset; i < count; ) {
+		const char *names[READDIR_PLUS_BATCH];
+		struct stat stats[READDIR_PLUS_BATCH];
+		int results[READDIR_PLUS_BATCH];
+		uint32_t n = count - i;
+		uint32_t j;
+		int full = 0;
+
+		if (n > READDIR_PLUS_BATCH) {
+			n = READDIR_PLUS_BATCH;
+		}
+		for (j = 0; j < n; j++) {
+			names[j] = dirsnap_name(snap, i + j);
+		}
+		/* entries whose lookup failed are listed without attributes */
+		ifuse_prefetch_attrs(dev, pool, devpath, path, names, n, stats, results);
+		for (j = 0; j < n && !full; j++) {
+			if (results[j] == 0 && S_ISREG(stats[j].st_mode) && __atomic_load_n(&writers.list, __ATOMIC_ACQUIRE)) {
+				char *entry = path_join(path, names[j]);
+				if (entry) {
+					ifuse_writers_size(entry, &stats[j]);
+					free(entry);
+				}
+			}
+			if (results[j] == 0) {
+				full = filler(buf, names[j], &stats[j], i + j + 1, FUSE_FILL_DIR_PLUS);
+			} else {
+				full = filler(buf, names[j], NULL, i + j + 1, 0);
+			}
+		}
+		if (full)
+			break;
+		i += n;
+	}
+	afc_pool_unref(pool);
+	ifuse_device_put(dev);
+
+	return 0;
+}
+
+static int ifuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	dirsnap_unref((dirsnap_t)filetab_remove(fi->fh));
+
+	return 0;
+}
+
+/**
+ * Builds the key under which the content and the checksums of a file are
+ * cached. It changes when the file is modified.
+ *
+ * @return The key, which has to be freed, or NULL when out of memory.
+ */
+static char *ifuse_file_key(struct ifuse_device *dev, const char *devpath, const struct stat *st)
+{
+	struct afc_target target;
+	char devid[512];
+
+	ifuse_target(dev, &target);
+	snprintf(devid, sizeof(devid), "%s/%s/%s", dev->udid, target.service_name, (target.appid) ? target.appid : "");
+
+	return chunkcache_key(devid, devpath, st->st_size, st->st_mtime);
+}
+
+/**
+ * Passes data read from a file to its checksums and stores them once the
+ * whole file was read.
+ */
+static void ifuse_file_checksum(struct ifuse_file *file, const char *buf, size_t len, uint64_t offset)
+{
+	struct checksum sum;
+	int res = 0;
+
+	if (!__atomic_load_n(&file->sum, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&file->sum_lock);
+	if (file->sum) {
+		res = checksum_stream_feed(file->sum, buf, len, offset);
+		if (res > 0) {
+			checksum_stream_result(file->sum, &sum);
+		}
+		if (res != 0) {
+			checksum_stream_free(file->sum);
+			__atomic_store_n(&file->sum, NULL, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&file->sum_lock);
+
+	if (res > 0) {
+		sumcache_put(file->sum_key, &sum);
+	}
+}
+
+/**
+ * Sends data still buffered for an open file to the device, closes it there
+ * and frees it.
+ *
+ * @return 0 on success or the negative errno value of a failed write-back.
+ */
+static int ifuse_file_free(struct ifuse_file *file)
+{
+	int res;
+
+	if (file->vdata) {
+		pthread_mutex_destroy(&file->lock);
+		free(file->vdata);
+		free(file);
+		return 0;
+	}
+
+	/* wait for background reads before the handle goes away */
+	readahead_free(file->ra);
+
+	pthread_mutex_lock(&file->lock);
+	res = ifuse_file_writeback(file);
+	pthread_mutex_unlock(&file->lock);
+	if (file->path) {
+		ifuse_writers_remove(file);
+	}
+
+	afc_pool_hold(file->pool, file->conn);
+	afc_file_close(file->conn->client, file->handle);
+	afc_pool_release(file->pool, file->conn);
+	afc_pool_unref(file->pool);
+	/* this might have been the last user of a dropped session */
+	pthread_mutex_lock(&file->dev->mutex);
+	ifuse_device_prune(file->dev);
+	pthread_mutex_unlock(&file->dev->mutex);
+	ifuse_device_put(file->dev);
+	pthread_mutex_destroy(&file->lock);
+	pthread_mutex_destroy(&file->sum_lock);
+	free(file->wb_data);
+	free(file->devpath);
+	free(file->path);
+	free(file->cache_key);
+	checksum_stream_free(file->sum);
+	free(file->sum_key);
+	free(file);
+
+	return res;
+}
+
+static int ifuse_open(const char *path, struct fuse_file_info *fi)
+{
+	struct ifuse_device *dev = NULL;
+	const char *devpath = NULL;
+	struct afc_conn *conn = NULL;
+	struct ifuse_file *file = NULL;
+	afc_pool_t pool = NULL;
+	afc_error_t err;
+	int tries = 0;
+	afc_file_mode_t mode = 0;
+	uint64_t handle = 0;
+	int64_t size;
+	int flags = fi->flags;
+	int vtype = get_virtual_path_type(path);
+
+	if (vtype != VIRTUAL_NONE) {
+		if (vtype == VIRTUAL_DIR) {
+			return -EISDIR;
+		}
+		if ((flags & O_ACCMODE) != O_RDONLY) {
+			return -EACCES;
+		}
+		file = calloc(1, sizeof(struct ifuse_file));
+		if (!file) {
+			return -ENOMEM;
+		}
+		/* the content is a snapshot taken at open time */
+		file->vdata = stats_to_json(&file->vlen);
+		if (!file->vdata) {
+			free(file);
+			return -ENOMEM;
+		}
+		pthread_mutex_init(&file->lock, NULL);
+		fi->fh = filetab_add(file);
+		if (!fi->fh) {
+			pthread_mutex_destroy(&file->lock);
+			free(file->vdata);
+			free(file);
+			return -ENFILE;
+		}
+		fi->direct_io = 1;
+		return 0;
+	}
+
+	if (writeback_cache) {
+		/* the kernel reads pages of write-only files to fill partial writes
+		 * and handles O_APPEND itself */
+		if ((flags & O_ACCMODE) == O_WRONLY) {
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+		}
+		flags &= ~O_APPEND;
+	}
+
+	err = get_afc_file_mode(&mode, flags);
+	if (err != AFC_E_SUCCESS || (mode == 0)) {
+		return -EPERM;
+	}
+
+	int res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0) {
+		return res;
+	}
+
+	file = malloc(sizeof(struct ifuse_file));
+	if (!file) {
+		ifuse_device_put(dev);
+		return -ENOMEM;
+	}
+
+	size = ifuse_cached_size(path);
+
+	/* files that are only read can be served from the content cache, and
+	 * with checksum_reads their checksums are computed while they are read.
+	 * The keys are built from attributes asked from the device, since
+	 * cached and indexed ones of a file changed in place on the device can
+	 * be up to attr_timeout or index_timeout seconds old.
+	 * Without either there is no key to build and nothing is asked. */
+	file->cache_key = NULL;
+	file->sum_key = NULL;
+	file->sum = NULL;
+	if ((chunkcache_enabled() || opts.checksum_reads) && (flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC)) {
+		struct stat st;
+		if (ifuse_device_attr(dev, devpath, path, &st) == 0 && S_ISREG(st.st_mode)) {
+			file->sum_key = ifuse_file_key(dev, devpath, &st);
+			if (file->sum_key && chunkcache_enabled()) {
+				file->cache_key = strdup(file->sum_key);
+			}
+			size = st.st_size;
+		}
+	}
+	if (opts.checksum_reads && file->sum_key && size > 0) {
+		struct checksum sum;
+		if (!sumcache_get(file->sum_key, &sum)) {
+			file->sum = checksum_stream_new(size);
+		}
+	}
+
+	/* the handle is only valid on the connection that opened it */
+	do {
+		conn = ifuse_device_acquire(dev, &pool);
+		err = afc_file_open(conn->client, devpath, mode, &handle);
+		if (err == AFC_E_SUCCESS) {
+			/* the open file keeps using the pool */
+			afc_pool_ref(pool);
+		}
+		ifuse_device_release(dev, pool, conn, err);
+	} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+	if (fi->flags & (O_CREAT | O_TRUNC)) {
+		metacache_invalidate(path);
+		metacache_invalidate_parent(path);
+		ifuse_index_invalidate(path);
+	}
+	file->devpath = NULL;
+	file->path = NULL;
+	if (err == AFC_E_SUCCESS) {
+		file->devpath = strdup(devpath);
+		if (mode != AFC_FOPEN_RDONLY) {
+			file->path = strdup(path);
+		}
+		if (!file->devpath || (mode != AFC_FOPEN_RDONLY && !file->path)) {
+			afc_pool_hold(pool, conn);
+			afc_file_close(conn->client, handle);
+			afc_pool_release(pool, conn);
+			afc_pool_unref(pool);
+			err = AFC_E_NO_MEM;
+		}
+	}
+	if (err != AFC_E_SUCCESS) {
+		res = afc_info_errno(err);
+		free(file->devpath);
+		free(file->path);
+		checksum_stream_free(file->sum);
+		free(file->sum_key);
+		free(file->cache_key);
+		free(file);
+		ifuse_device_put(dev);
+		return -res;
+	}
+
+	/* the open file keeps the reference to the device */
+	file->dev = dev;
+	file->pool = pool;
+	file->conn = conn;
+	file->handle = handle;
+	file->mode = mode;
+	pthread_mutex_lock(&dev->mutex);
+	file->generation = dev->generation;
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_mutex_init(&file->lock, NULL);
+	pthread_mutex_init(&file->sum_lock, NULL);
+	/* a freshly opened file is positioned at its start, except in append mode */
+	file->append = (mode == AFC_FOPEN_APPEND || mode == AFC_FOPEN_RDAPPEND);
+	file->pos = 0;
+	file->pos_valid = !file->append;
+	file->ra = NULL;
+	file->wb_data = NULL;
+	file->wb_offset = 0;
+	file->wb_len = 0;
+	file->wb_err = 0;
+	file->written = 0;
+	file->wb_end = -1;
+	file->wnext = NULL;
+	file->busy = 0;
+	if (mode == AFC_FOPEN_WRONLY || mode == AFC_FOPEN_WR) {
+		/* opening truncated the file */
+		if (size > 0) {
+			fsinfo_adjust(dev->fsinfo, -size);
+		}
+		size = 0;
+	}
+	file->size = size;
+	if (opts.readahead_max > 0 && (flags & O_ACCMODE) != O_WRONLY) {
+		file->ra = readahead_new(ifuse_file_fetch, file);
+	}
+	if (file->path) {
+		ifuse_writers_add(file);
+	}
+	fi->fh = filetab_add(file);
+	if (!fi->fh) {
+		ifuse_file_free(file);
+		return -ENFILE;
+	}
+
+	return 0;
+}
+
+static int ifuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	return ifuse_open(path, fi);
+}
+
+/**
+ * Reads from an open file through its readahead buffers, if it has any.
+ *
+ * @return Number of bytes read, which is only less than size at the end
+ *    of the file, or a negative errno value.
+ */
+static ssize_t ifuse_file_load(struct ifuse_file *file, char *buf, size_t size, uint64_t offset)
+{
+	if (file->ra) {
+		return readahead_read(file->ra, buf, size, offset);
+	}
+
+	return ifuse_file_fetch(file, buf, size, offset);
+}
+
+/**
+ * Reads from an open file through the content cache. Chunks that are not
+ * cached yet are read from the device as a whole and stored.
+ *
+ * @return Number of bytes read or a negative errno value.
+ */
+static int ifuse_file_read_cached(struct ifuse_file *file, char *buf, size_t size, uint64_t offset)
+{
+	char *chunk = NULL;
+	size_t done = 0;
+	int res = 0;
+
+	while (done < size && offset + done < (uint64_t)file->size) {
+		uint64_t pos = offset + done;
+		uint64_t index = pos / CHUNKCACHE_CHUNK_SIZE;
+		uint64_t start = index * CHUNKCACHE_CHUNK_SIZE;
+		size_t skip = pos - start;
+		size_t len = CHUNKCACHE_CHUNK_SIZE;
+		size_t want = size - done;
+		ssize_t got;
+
+		if (start + len > (uint64_t)file->size) {
+			len = file->size - start;
+		}
+		if (want > len - skip) {
+			want = len - skip;
+		}
+
+		got = chunkcache_get(file->cache_key, index, skip, buf + done, want);
+		if (got == (ssize_t)want) {
+			done += want;
+			continue;
+		}
+
+		if (!chunk) {
+			chunk = malloc(CHUNKCACHE_CHUNK_SIZE);
+			if (!chunk) {
+				res = -ENOMEM;
+				break;
+			}
+		}
+		got = ifuse_file_load(file, chunk, len, start);
+		if (got < 0) {
+			res = got;
+			break;
+		}
+		/* a short read means the file changed, which the key does not cover */
+		if (got == (ssize_t)len) {
+			chunkcache_put(file->cache_key, index, chunk, len);
+		}
+		if ((size_t)got <= skip)
+			break;
+		if (want > got - skip)
+			want = got - skip;
+		memcpy(buf + done, chunk + skip, want);
+		done += want;
+		if ((size_t)got < len)
+			break;
+	}
+	free(chunk);
+
+	return (done > 0) ? (int)done : res;
+}
+
+static int ifuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct ifuse_file *file = filetab_get(fi->fh);
+	int res;
+
+	if (!file)
+		return -EBADF;
+	if (size == 0)
+		return 0;
+
+	if (file->vdata) {
+		if ((uint64_t)offset >= file->vlen)
+			return 0;
+		if (size > file->vlen - offset)
+			size = file->vlen - offset;
+		memcpy(buf, file->vdata + offset, size);
+		return size;
+	}
+
+	/* make sure data written through this handle is read back */
+	pthread_mutex_lock(&file->lock);
+	if (file->wb_len > 0) {
+		res = ifuse_file_writeback(file);
+		if (res < 0) {
+			pthread_mutex_unlock(&file->lock);
+			return res;
+		}
+		/* the size on the device changed */
+		metacache_invalidate(path);
+	}
+	pthread_mutex_unlock(&file->lock);
+
+	if (file->cache_key) {
+		res = ifuse_file_read_cached(file, buf, size, offset);
+	} else {
+		res = ifuse_file_load(file, buf, size, offset);
+	}
+	if (res > 0) {
+		ifuse_file_checksum(file, buf, res, offset);
+	}
+
+	return res;
+}
+
+/* the cached chunk a fuse worker thread handed out with its last reply */
+static pthread_key_t reply_fd_key;
+
+static void close_reply_fd(void *data)
+{
+	close((int)(intptr_t)data - 1);
+}
+
+/**
+ * Keeps fd open until the thread replies to its next read. fuse sends the
+ * reply before the thread handles another request, but does not close file
+ * descriptors it was given.
+ */
+static void ifuse_set_reply_fd(int fd)
+{
+	void *old = pthread_getspecific(reply_fd_key);
+
+	if (old) {
+		close_reply_fd(old);
+	}
+	pthread_setspecific(reply_fd_key, (void*)(intptr_t)(fd + 1));
+}
+
+/**
+ * Serves a read from the content cache without copying the data through
+ * user space: the chunk file is handed to fuse, which splices it into the
+ * reply if the kernel supports it.
+ *
+ * @return 0 on success, or -1 if the range is not covered by a single
+ *    cached chunk.
+ */
+static int ifuse_read_buf_cached(struct ifuse_file *file, struct fuse_bufvec **bufp, size_t size, uint64_t offset)
+{
+	struct fuse_bufvec *bv;
+	uint64_t index = offset / CHUNKCACHE_CHUNK_SIZE;
+	uint64_t start = index * CHUNKCACHE_CHUNK_SIZE;
+	uint64_t skip = offset - start;
+	uint64_t len = CHUNKCACHE_CHUNK_SIZE;
+	uint64_t data_offset, data_size;
+	int fd;
+
+	if (offset >= (uint64_t)file->size)
+		return -1;
+	if (start + len > (uint64_t)file->size) {
+		len = file->size - start;
+	}
+	if (size > len - skip) {
+		/* spans two chunks, which is rare for aligned kernel requests */
+		if (offset + size < (uint64_t)file->size)
+			return -1;
+		size = len - skip;
+	}
+
+	fd = chunkcache_open(file->cache_key, index, &data_offset, &data_size);
+	if (fd < 0)
+		return -1;
+	bv = malloc(sizeof(struct fuse_bufvec));
+	if (!bv || data_size != len) {
+		free(bv);
+		close(fd);
+		return -1;
+	}
+	*bv = FUSE_BUFVEC_INIT(size);
+	bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	bv->buf[0].fd = fd;
+	bv->buf[0].pos = data_offset + skip;
+	ifuse_set_reply_fd(fd);
+	*bufp = bv;
+
+	return 0;
+}
+
+/**
+ * Serves reads from the content cache as file descriptors, see
+ * ifuse_read_buf_cached(). Only registered with cache_dir, since fuse
+ * uses read_buf for every read once it is set: everything else is read
+ * into a buffer here just like fuse does itself for ifuse_read().
+ */
+static int ifuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct ifuse_file *file = filetab_get(fi->fh);
+	struct fuse_bufvec *bv;
+	int res;
+
+	if (!file)
+		return -EBADF;
+	/* spliced data is not seen by the checksums, which checksum_reads
+	 * computes until the file was read completely */
+	if (file->cache_key && size > 0 && !__atomic_load_n(&file->sum, __ATOMIC_ACQUIRE) && ifuse_read_buf_cached(file, bufp, size, offset) == 0) {
+		return 0;
+	}
+
+	/* not cached, the same copy fuse makes without read_buf */
+	bv = malloc(sizeof(struct fuse_bufvec));
+	if (!bv)
+		return -ENOMEM;
+	*bv = FUSE_BUFVEC_INIT(size);
+	bv->buf[0].mem = malloc((size > 0) ? size : 1);
+	if (!bv->buf[0].mem) {
+		free(bv);
+		return -ENOMEM;
+	}
+
+	res = ifuse_read(path, bv->buf[0].mem, size, offset, fi);
+	if (res < 0) {
+		free(bv->buf[0].mem);
+		free(bv);
+		return res;
+	}
+	bv->buf[0].size = res;
+	*bufp = bv;
+
+	return 0;
+}
+
+static int ifuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct ifuse_file *file = filetab_get(fi->fh);
+	int res = 0;
+
+	if (!file)
+		return -EBADF;
+	if (size == 0)
+		return 0;
+
+	if (file->ra) {
+		readahead_invalidate(file->ra);
+	}
+
+	pthread_mutex_lock(&file->lock);
+	file->written = 1;
+	if (file->wb_err) {
+		res = -file->wb_err;
+		file->wb_err = 0;
+		goto leave_unlock;
+	}
+
+	if (size < opts.writeback_max) {
+		/* send what we have unless this write continues it */
+		if (file->wb_len > 0 && (offset != file->wb_offset + file->wb_len || file->wb_len + size > opts.writeback_max)) {
+			res = ifuse_file_writeback(file);
+			if (res < 0)
+				goto leave_unlock;
+		}
+		if (!file->wb_data) {
+			file->wb_data = malloc(opts.writeback_max);
+		}
+		if (file->wb_data) {
+			if (file->wb_len == 0) {
+				file->wb_offset = offset;
+			}
+			memcpy(file->wb_data + file->wb_len, buf, size);
+			file->wb_len += size;
+			if (file->wb_len == opts.writeback_max) {
+				res = ifuse_file_writeback(file);
+			}
+			goto leave_unlock;
+		}
+	}
+
+	/* large writes, or no buffer available: write through */
+	res = ifuse_file_writeback(file);
+	if (res == 0) {
+		res = ifuse_file_store(file, buf, size, offset);
+	}
+
+leave_unlock:
+	ifuse_file_wb_update(file);
+	pthread_mutex_unlock(&file->lock);
+	metacache_invalidate(path);
+
+	return (res < 0) ? res : (int)size;
+}
+
+static int ifuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0)
+		return res;
+	uint64_t mtime = (uint64_t)tv[1].tv_sec * (uint64_t)1000000000 + (uint64_t)tv[1].tv_nsec;
+	afc_pool_t pool;
+	afc_error_t err;
+	int tries = 0;
+
+	do {
+		struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+		err = afc_set_file_time(conn->client, devpath, mtime);
+		ifuse_device_release(dev, pool, conn, err);
+	} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+	ifuse_device_put(dev);
+	metacache_invalidate(path);
+	ifuse_index_invalidate_attr(path);
+	if (err == AFC_E_UNKNOWN_PACKET_TYPE) {
+		/* ignore error for pre-3.1 devices as they do not support setting file modification times */
+		return 0;
+	}
+	if (err != AFC_E_SUCCESS) {
+		int res = afc_info_errno(err);
+		return -res;
+	}
+
+	return 0;
+}
+
+static int ifuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	struct ifuse_file *file;
+	int written;
+	int res;
+
+	if (!fi)
+		return 0;
+
+	file = filetab_get(fi->fh);
+	if (!file)
+		return -EBADF;
+	pthread_mutex_lock(&file->lock);
+	res = ifuse_file_writeback(file);
+	written = file->written;
+	if (res == 0) {
+		file->written = 0;
+	}
+	pthread_mutex_unlock(&file->lock);
+	/* handles that were only read leave the cached attributes alone */
+	if (written) {
+		metacache_invalidate(path);
+		ifuse_index_invalidate_attr(path);
+	}
+
+	return res;
+}
+
+static int ifuse_release(const char *path, struct fuse_file_info *fi)
+{
+	struct ifuse_file *file = filetab_remove(fi->fh);
+	int written;
+	int res;
+
+	if (!file)
+		return -EBADF;
+
+	written = file->written;
+	res = ifuse_file_free(file);
+	if (written) {
+		metacache_invalidate(path);
+		ifuse_index_invalidate_attr(path);
+	}
+
+	return res;
+}
+
+void *ifuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct ifuse_device *dev = NULL;
+	char *udid = NULL;
+
+	/* ask for everything that helps bulk transfers, options given with -o
+	 * (e.g. sync_read, no_splice_write, max_write=N or writeback_cache) take
+	 * precedence. The writeback cache is only used if requested explicitly,
+	 * since the kernel then trusts its cached file sizes for appending. */
+	conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+	conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	conn->max_write = DEFAULT_MAX_TRANSFER;
+	conn->max_readahead = DEFAULT_MAX_TRANSFER;
+	conn->max_background = DEFAULT_MAX_BACKGROUND;
+	if (conn_opts) {
+		fuse_apply_conn_info_opts(conn_opts, conn);
+	}
+	writeback_cache = (conn->want & FUSE_CAP_WRITEBACK_CACHE) ? 1 : 0;
+
+	cfg->attr_timeout = opts.attr_timeout;
+	cfg->entry_timeout = opts.entry_timeout;
+	cfg->negative_timeout = opts.negative_timeout;
+	metacache_init(opts.attr_timeout, opts.entry_timeout, opts.negative_timeout, METACACHE_DEFAULT_MAX_ENTRIES);
+	stats_init(opts.stats_file);
+	if (opts.trace_file && trace_init(opts.trace_file) < 0) {
+		fprintf(stderr, "WARNING: Could not create trace file %s\n", opts.trace_file);
+	}
+	if (opts.readahead_max > 0) {
+		readahead_init(opts.afc_connections, opts.readahead_max, opts.readahead_memory);
+	}
+	ifuse_prefetch_init(opts.afc_connections - 1);
+	if (opts.cache_dir && chunkcache_init(opts.cache_dir, opts.cache_size) < 0) {
+		fprintf(stderr, "WARNING: Could not use %s as cache directory, file content is not cached\n", opts.cache_dir);
+	}
+	if (debug)
+		fprintf(stderr, "checksums: %s\n", checksum_impl());
+	pthread_key_create(&reply_fd_key, close_reply_fd);
+	if (fsinfo_init(opts.statfs_timeout) < 0) {
+		fprintf(stderr, "WARNING: Could not start statfs refresh thread, statfs is not cached\n");
+	}
+
+	/* to drop what the kernel caches for paths that changed behind its back */
+	devices.fuse = fuse_get_context()->fuse;
+
+	if (opts.all_devices) {
+		/* devices that are already attached are reported right away */
+		if (idevice_events_subscribe(&devices.events, ifuse_device_event, NULL) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not subscribe to device events\n");
+		}
+		return NULL;
+	}
 
-	if (house_arrest) {
-		afc_client_new_from_house_arrest_client(house_arrest, &afc);
-	} else {
-		afc_client_new(device, opts.service, &afc);
+	if (opts.all_apps) {
+		/* the apps share the device and its lockdown session */
+		idevice_get_udid(device, &apps.udid);
+		apps.device = device;
+		device = NULL;
+		if (!apps.udid) {
+			fprintf(stderr, "ERROR: Could not get the UDID of the device\n");
+			return NULL;
+		}
+		if (pthread_create(&apps.worker, NULL, ifuse_apps_worker, NULL) == 0) {
+			apps.has_worker = 1;
+		} else {
+			fprintf(stderr, "WARNING: Could not start listing the apps in the background\n");
+		}
+		return NULL;
 	}
 
-	lockdownd_client_free(control);
-	control = NULL;
+	idevice_get_udid(device, &udid);
+	dev = ifuse_device_new((udid) ? udid : "", NULL);
+	free(udid);
+	if (!dev) {
+		fprintf(stderr, "ERROR: Could not allocate device\n");
+		return NULL;
+	}
+	/* the device entry owns the idevice from now on */
+	dev->device = device;
+	device = NULL;
+	dev->started = startup_time;
+	devices.list = dev;
 
-	if (afc) {
-		// get file system block size
-		plist_t info = NULL;
-		if ((AFC_E_SUCCESS == afc_get_device_info_plist(afc, &info)) && info) {
-			g_blocksize = plist_dict_get_uint(info, "FSBlockSize");
-		}
+	/* the mount is usable while the device is connected in the background */
+	if (ifuse_device_spawn(dev, ifuse_startup_worker, dev) < 0) {
+		fprintf(stderr, "WARNING: Could not start connecting in the background\n");
 	}
 
-	return afc;
+	return NULL;
 }
 
 void ifuse_cleanup(void *data)
 {
-	afc_client_t afc = (afc_client_t) data;
+	struct ifuse_device *dev;
 
-	afc_client_free(afc);
-	if (control) {
-		lockdownd_client_free(control);
+	if (devices.events) {
+		idevice_events_unsubscribe(devices.events);
+		devices.events = NULL;
+	}
+	if (apps.has_worker) {
+		pthread_join(apps.worker, NULL);
+		apps.has_worker = 0;
+	}
+	if (opts.readahead_max > 0) {
+		readahead_cleanup();
+	}
+	ifuse_prefetch_cleanup();
+	/* crawls that are still running save what they have and stop */
+	pthread_mutex_lock(&indexer.mutex);
+	indexer.stopping = 1;
+	while (indexer.running > 0) {
+		pthread_cond_wait(&indexer.cond, &indexer.mutex);
+	}
+	pthread_mutex_unlock(&indexer.mutex);
+	/* all files are closed by now, so this drops the last references */
+	pthread_mutex_lock(&devices.mutex);
+	dev = devices.list;
+	devices.list = NULL;
+	pthread_mutex_unlock(&devices.mutex);
+	while (dev) {
+		struct ifuse_device *next = dev->next;
+		ifuse_device_put(dev);
+		dev = next;
+	}
+	fsinfo_cleanup();
+	metacache_cleanup();
+	sumcache_cleanup();
+	chunkcache_cleanup();
+	filetab_cleanup();
+	trace_cleanup();
+	stats_cleanup();
+	if (apps.lockdown) {
+		lockdownd_client_free(apps.lockdown);
+		apps.lockdown = NULL;
+	}
+	if (apps.device) {
+		idevice_free(apps.device);
+		apps.device = NULL;
+	}
+	free(apps.udid);
+	apps.udid = NULL;
+	if (device) {
+		idevice_free(device);
 	}
-	idevice_free(device);
 }
 
 int ifuse_flush(const char *path, struct fuse_file_info *fi)
 {
-	return 0;
+	return ifuse_fsync(path, 0, fi);
 }
 
 int ifuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -445,33 +3876,33 @@ int ifuse_chown(const char *file, uid_t user, gid_t group, struct fuse_file_info
 
 int ifuse_statfs(const char *path, struct statvfs *stats)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
-	char **info_raw = NULL;
-	uint64_t totalspace = 0, freespace = 0;
-	int i = 0, blocksize = 0;
+	struct ifuse_device *dev;
+	const char *devpath;
+	struct fsinfo info;
+	uint32_t blocksize;
 
-	afc_error_t err = afc_get_device_info(afc, &info_raw);
-	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
-		return -res;
+	if (is_toplevel_path(path) && path[1] == '\0') {
+		/* the root directory of --all mode is on no device */
+		memset(stats, 0, sizeof(struct statvfs));
+		stats->f_bsize = stats->f_frsize = g_blocksize;
+		stats->f_namemax = 255;
+		return 0;
 	}
-	if (!info_raw)
-		return -ENOENT;
 
-	for (i = 0; info_raw[i]; i++) {
-		if (!strcmp(info_raw[i], "FSTotalBytes")) {
-			totalspace = strtoull(info_raw[i + 1], (char **) NULL, 10);
-		} else if (!strcmp(info_raw[i], "FSFreeBytes")) {
-			freespace = strtoull(info_raw[i + 1], (char **) NULL, 10);
-		} else if (!strcmp(info_raw[i], "FSBlockSize")) {
-			blocksize = atoi(info_raw[i + 1]);
-		}
+	int res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0) {
+		return res;
+	}
+	res = fsinfo_get(dev->fsinfo, &info);
+	ifuse_device_put(dev);
+	if (res < 0) {
+		return res;
 	}
-	free_dictionary(info_raw);
 
+	blocksize = (info.blocksize > 0) ? info.blocksize : (uint32_t)g_blocksize;
 	stats->f_bsize = stats->f_frsize = blocksize;
-	stats->f_blocks = totalspace / blocksize;
-	stats->f_bfree = stats->f_bavail = freespace / blocksize;
+	stats->f_blocks = info.total / blocksize;
+	stats->f_bfree = stats->f_bavail = info.free / blocksize;
 	stats->f_namemax = 255;
 	stats->f_files = stats->f_ffree = 1000000000;
 
@@ -480,12 +3911,85 @@ int ifuse_statfs(const char *path, struct statvfs *stats)
 
 int ifuse_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
-	afc_error_t err = afc_truncate(afc, path, size);
+	struct ifuse_file *file = NULL;
+	struct ifuse_file **others;
+	int64_t old_size;
+	int nothers;
+	int i;
+
+	/* what other handles of the file buffered must not end up behind
+	 * the new end of file either; failures are reported through them */
+	others = ifuse_writers_get(path, (fi) ? filetab_get(fi->fh) : NULL, &nothers);
+	for (i = 0; i < nothers; i++) {
+		if (others[i]->ra) {
+			readahead_invalidate(others[i]->ra);
+		}
+		pthread_mutex_lock(&others[i]->lock);
+		ifuse_file_flush(others[i]);
+		pthread_mutex_unlock(&others[i]->lock);
+	}
+
+	if (fi) {
+		int res;
+		file = filetab_get(fi->fh);
+		if (!file) {
+			ifuse_writers_put(others, nothers);
+			return -EBADF;
+		}
+		if (file->ra) {
+			readahead_invalidate(file->ra);
+		}
+		/* buffered data must not end up behind the new end of file */
+		pthread_mutex_lock(&file->lock);
+		res = ifuse_file_writeback(file);
+		old_size = file->size;
+		pthread_mutex_unlock(&file->lock);
+		if (res < 0) {
+			ifuse_writers_put(others, nothers);
+			return res;
+		}
+	} else {
+		old_size = ifuse_cached_size(path);
+	}
+
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0) {
+		ifuse_writers_put(others, nothers);
+		return res;
+	}
+	afc_pool_t pool;
+	afc_error_t err;
+	int tries = 0;
+	do {
+		struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+		err = afc_truncate(conn->client, devpath, size);
+		ifuse_device_release(dev, pool, conn, err);
+	} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+	metacache_invalidate(path);
+	ifuse_index_invalidate_attr(path);
 	if (err != AFC_E_SUCCESS) {
-		int res = get_afc_error_as_errno(err);
+		ifuse_device_put(dev);
+		ifuse_writers_put(others, nothers);
+		res = afc_info_errno(err);
 		return -res;
 	}
+	if (old_size >= 0) {
+		fsinfo_adjust(dev->fsinfo, (int64_t)size - old_size);
+	}
+	ifuse_device_put(dev);
+	if (file) {
+		pthread_mutex_lock(&file->lock);
+		file->size = size;
+		pthread_mutex_unlock(&file->lock);
+	}
+	for (i = 0; i < nothers; i++) {
+		pthread_mutex_lock(&others[i]->lock);
+		others[i]->size = size;
+		pthread_mutex_unlock(&others[i]->lock);
+	}
+	ifuse_writers_put(others, nothers);
 	return 0;
 }
 
@@ -497,8 +4001,20 @@ int ifuse_readlink(const char *path, char *linktarget, size_t buflen)
 		return -EINVAL;
 	}
 	linktarget[0] = '\0'; // in case the link target cannot be determined
-	afc_client_t afc = fuse_get_context()->private_data;
-	afc_error_t err = afc_get_file_info(afc, path, &info);
+	struct ifuse_device *dev;
+	const char *devpath;
+	ret = ifuse_device_get(path, &dev, &devpath);
+	if (ret < 0)
+		return ret;
+	afc_pool_t pool;
+	afc_error_t err;
+	int tries = 0;
+	do {
+		struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
+		err = afc_get_file_info(conn->client, devpath, &info);
+		ifuse_device_release(dev, pool, conn, err);
+	} while (err != AFC_E_SUCCESS && ifuse_device_retry(dev, err, &tries));
+	ifuse_device_put(dev);
 	if ((err == AFC_E_SUCCESS) && info) {
 		ret = -1;
 		for (i = 0; info[i]; i+=2) {
@@ -510,7 +4026,7 @@ int ifuse_readlink(const char *path, char *linktarget, size_t buflen)
 		}
 		free_dictionary(info);
 	} else {
-		ret = get_afc_error_as_errno(err);
+		ret = afc_info_errno(err);
 		return -ret;
 	}
 
@@ -519,80 +4035,475 @@ int ifuse_readlink(const char *path, char *linktarget, size_t buflen)
 
 int ifuse_symlink(const char *target, const char *linkname)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res = ifuse_device_get(linkname, &dev, &devpath);
+	if (res < 0)
+		return res;
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
 
-	afc_error_t err = afc_make_link(afc, AFC_SYMLINK, target, linkname);
+	afc_error_t err = afc_make_link(conn->client, AFC_SYMLINK, target, devpath);
+	/* not repeated, it might have been done already */
+	ifuse_device_release(dev, pool, conn, err);
+	ifuse_device_put(dev);
+	metacache_invalidate(linkname);
+	metacache_invalidate_parent(linkname);
+	ifuse_index_invalidate(linkname);
 	if (err == AFC_E_SUCCESS)
 		return 0;
 
-	return -get_afc_error_as_errno(err);
+	return -afc_info_errno(err);
 }
 
 int ifuse_link(const char *target, const char *linkname)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev, *target_dev;
+	const char *devpath, *target_devpath;
+	int res = ifuse_device_get(target, &target_dev, &target_devpath);
+	if (res < 0)
+		return res;
+	res = ifuse_device_get(linkname, &dev, &devpath);
+	ifuse_device_put(target_dev);
+	if (res < 0)
+		return res;
+	if (dev != target_dev) {
+		ifuse_device_put(dev);
+		return -EXDEV;
+	}
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
 
-	afc_error_t err = afc_make_link(afc, AFC_HARDLINK, target, linkname);
+	afc_error_t err = afc_make_link(conn->client, AFC_HARDLINK, target_devpath, devpath);
+	ifuse_device_release(dev, pool, conn, err);
+	ifuse_device_put(dev);
+	metacache_invalidate(target);
+	metacache_invalidate(linkname);
+	metacache_invalidate_parent(linkname);
+	ifuse_index_invalidate(target);
+	ifuse_index_invalidate(linkname);
 	if (err == AFC_E_SUCCESS)
 		return 0;
 
-	return -get_afc_error_as_errno(err);
+	return -afc_info_errno(err);
 }
 
 int ifuse_unlink(const char *path)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0)
+		return res;
+	int64_t size = ifuse_cached_size(path);
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
 
-	afc_error_t err = afc_remove_path(afc, path);
+	afc_error_t err = afc_remove_path(conn->client, devpath);
+	ifuse_device_release(dev, pool, conn, err);
+	metacache_invalidate_tree(path);
+	metacache_invalidate_parent(path);
+	ifuse_index_invalidate(path);
+	if (err == AFC_E_SUCCESS && size > 0) {
+		fsinfo_adjust(dev->fsinfo, -size);
+	}
+	ifuse_device_put(dev);
 	if (err == AFC_E_SUCCESS)
 		return 0;
 
-	return -get_afc_error_as_errno(err);
+	return -afc_info_errno(err);
+}
+
+static int ifuse_rmdir(const char *path)
+{
+	/* AFC removes empty directories like files */
+	return ifuse_unlink(path);
 }
 
 int ifuse_rename(const char *from, const char *to, unsigned int flags)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev, *to_dev;
+	const char *devfrom, *devto;
+	int res = ifuse_device_get(from, &dev, &devfrom);
+	if (res < 0)
+		return res;
+	res = ifuse_device_get(to, &to_dev, &devto);
+	ifuse_device_put(to_dev);
+	if (res < 0 || to_dev != dev) {
+		ifuse_device_put(dev);
+		return (res < 0) ? res : -EXDEV;
+	}
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
 
-	afc_error_t err = afc_rename_path(afc, from, to);
+	afc_error_t err = afc_rename_path(conn->client, devfrom, devto);
+	ifuse_device_release(dev, pool, conn, err);
+	ifuse_device_put(dev);
+	metacache_invalidate_tree(from);
+	metacache_invalidate_tree(to);
+	metacache_invalidate_parent(from);
+	metacache_invalidate_parent(to);
+	ifuse_index_invalidate(from);
+	ifuse_index_invalidate(to);
 	if (err == AFC_E_SUCCESS)
 		return 0;
 
-	return -get_afc_error_as_errno(err);
+	return -afc_info_errno(err);
 }
 
 int ifuse_mkdir(const char *dir, mode_t ignored)
 {
-	afc_client_t afc = fuse_get_context()->private_data;
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res = ifuse_device_get(dir, &dev, &devpath);
+	if (res < 0)
+		return res;
+	afc_pool_t pool;
+	struct afc_conn *conn = ifuse_device_acquire(dev, &pool);
 
-	afc_error_t err = afc_make_directory(afc, dir);
+	afc_error_t err = afc_make_directory(conn->client, devpath);
+	ifuse_device_release(dev, pool, conn, err);
+	ifuse_device_put(dev);
+	metacache_invalidate(dir);
+	metacache_invalidate_parent(dir);
+	ifuse_index_invalidate(dir);
 	if (err == AFC_E_SUCCESS)
 		return 0;
 
-	return -get_afc_error_as_errno(err);
+	return -afc_info_errno(err);
+}
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+#define XATTR_SHA256 "user.ifuse.sha256"
+#define XATTR_CRC32C "user.ifuse.crc32c"
+/* setting it removes a file or directory with all its contents at once */
+#define XATTR_REMOVE "user.ifuse.remove"
+
+/**
+ * Gets the attributes of a regular file and the key its checksums are
+ * stored under.
+ *
+ * @param cached Whether to only use attributes from the metadata cache or
+ *    the tree index, without contacting the device. Otherwise they are
+ *    asked from the device.
+ * @param key Receives the key, which has to be freed.
+ *
+ * @return 0 on success, -ENOATTR if path is not a regular file or, with
+ *    cached, its attributes are not known, or another negative errno value.
+ */
+static int ifuse_checksum_key(const char *path, int cached, struct stat *st, char **key)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+	int res;
+
+	if (get_virtual_path_type(path) != VIRTUAL_NONE || is_toplevel_path(path))
+		return -ENOATTR;
+
+	if (cached) {
+		res = metacache_get_attr(path, st);
+		if (res < 0)
+			return res;
+		dev = ifuse_index_device(path, &devpath);
+		if (!dev)
+			return -ENOATTR;
+		if (res == 0) {
+			res = ifuse_index_attr(dev->index, devpath, st);
+		}
+		res = (res > 0) ? 0 : (res < 0) ? res : -ENOATTR;
+	} else {
+		res = ifuse_device_get(path, &dev, &devpath);
+		if (res < 0)
+			return res;
+		res = ifuse_device_attr(dev, devpath, path, st);
+	}
+	if (res == 0 && !S_ISREG(st->st_mode)) {
+		res = -ENOATTR;
+	}
+	if (res == 0) {
+		*key = ifuse_file_key(dev, devpath, st);
+		if (!*key)
+			res = -ENOMEM;
+	}
+	ifuse_device_put(dev);
+
+	return res;
+}
+
+/**
+ * Gets the checksums of a regular file. Unless they are known from an
+ * earlier complete read, the file is read once; chunks in the content
+ * cache are not transferred again.
+ *
+ * @return 0 on success or a negative errno value.
+ */
+static int ifuse_file_checksums(const char *path, struct checksum *sum)
+{
+	struct fuse_file_info fi;
+	checksum_stream_t s;
+	struct stat st;
+	uint64_t offset = 0;
+	char *key;
+	char *buf;
+	int res;
+
+	res = ifuse_checksum_key(path, 0, &st, &key);
+	if (res < 0)
+		return res;
+	if (sumcache_get(key, sum)) {
+		free(key);
+		return 0;
+	}
+
+	buf = malloc(CHUNKCACHE_CHUNK_SIZE);
+	s = checksum_stream_new(st.st_size);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (!buf || !s) {
+		res = -ENOMEM;
+	} else {
+		res = ifuse_open(path, &fi);
+	}
+	if (res == 0) {
+		/* reads through the handle feed the checksums of the handle too,
+		 * which would only do the same work again */
+		struct ifuse_file *file = filetab_get(fi.fh);
+		pthread_mutex_lock(&file->sum_lock);
+		checksum_stream_free(file->sum);
+		__atomic_store_n(&file->sum, NULL, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&file->sum_lock);
+
+		res = (st.st_size == 0) ? 1 : 0;
+		while (res == 0) {
+			int len = ifuse_read(path, buf, CHUNKCACHE_CHUNK_SIZE, offset, &fi);
+			if (len < 0) {
+				res = len;
+				break;
+			}
+			res = (len > 0) ? checksum_stream_feed(s, buf, len, offset) : -1;
+			if (res < 0) {
+				/* the file changed while it was read */
+				res = -EIO;
+			}
+			offset += len;
+		}
+		ifuse_release(path, &fi);
+	}
+	if (res > 0) {
+		checksum_stream_result(s, sum);
+		sumcache_put(key, sum);
+		res = 0;
+	}
+	checksum_stream_free(s);
+	free(buf);
+	free(key);
+
+	return res;
+}
+
+static int ifuse_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	struct checksum sum;
+	char text[2 * CHECKSUM_SHA256_LEN + 1];
+	size_t len;
+	int res;
+	int i;
+
+	if (strcmp(name, XATTR_SHA256) != 0 && strcmp(name, XATTR_CRC32C) != 0)
+		return -ENOATTR;
+
+	res = ifuse_file_checksums(path, &sum);
+	if (res < 0)
+		return res;
+
+	if (!strcmp(name, XATTR_SHA256)) {
+		for (i = 0; i < CHECKSUM_SHA256_LEN; i++) {
+			snprintf(text + 2*i, 3, "%02x", sum.sha256[i]);
+		}
+	} else {
+		snprintf(text, sizeof(text), "%08x", sum.crc32c);
+	}
+	len = strlen(text);
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(value, text, len);
+
+	return len;
+}
+
+/**
+ * Removes a directory with everything below it in a single request to the
+ * device, instead of one unlink and rmdir per entry as rm -r does. The
+ * root of a device and the folder mounted with --documents can not be
+ * removed, just like a mount point.
+ */
+static int ifuse_remove_tree(const char *path)
+{
+	struct ifuse_device *dev;
+	const char *devpath;
+	afc_pool_t pool;
+	struct afc_conn *conn;
+	afc_error_t err;
+	int res;
+
+	if (get_virtual_path_type(path) != VIRTUAL_NONE)
+		return -ENOTSUP;
+	if (is_toplevel_path(path) || is_mount_root(path))
+		return -EBUSY;
+
+	res = ifuse_device_get(path, &dev, &devpath);
+	if (res < 0)
+		return res;
+	if (!strcmp(devpath, "/")) {
+		ifuse_device_put(dev);
+		return -EBUSY;
+	}
+
+	conn = ifuse_device_acquire(dev, &pool);
+	err = afc_remove_path_and_contents(conn->client, devpath);
+	ifuse_device_release(dev, pool, conn, err);
+	/* even a failed removal might have removed a part of the tree, and
+	 * the kernel does not know that the entries below path are gone */
+	metacache_invalidate_tree(path);
+	metacache_invalidate_parent(path);
+	ifuse_index_invalidate(path);
+	fsinfo_invalidate(dev->fsinfo);
+	ifuse_device_put(dev);
+	if (devices.fuse) {
+		fuse_invalidate_path(devices.fuse, path);
+	}
+
+	return -afc_info_errno(err);
+}
+
+static int ifuse_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	if (!strcmp(name, XATTR_REMOVE))
+		return ifuse_remove_tree(path);
+	if (!strcmp(name, XATTR_SHA256) || !strcmp(name, XATTR_CRC32C))
+		return -EPERM;
+
+	return -ENOTSUP;
+}
+
+/**
+ * Lists the checksum attributes only for files whose checksums are known,
+ * since tools copying extended attributes would otherwise read every file
+ * a second time to compute them. They can still be asked for by name. The
+ * key is built from cached attributes, so listing never asks the device.
+ */
+static int ifuse_listxattr(const char *path, char *list, size_t size)
+{
+	static const char names[] = XATTR_SHA256 "\0" XATTR_CRC32C;
+	struct checksum sum;
+	struct stat st;
+	char *key;
+	int known;
+	int res;
+
+	res = ifuse_checksum_key(path, 1, &st, &key);
+	if (res < 0)
+		return (res == -ENOATTR) ? 0 : res;
+	known = sumcache_get(key, &sum);
+	free(key);
+	if (!known)
+		return 0;
+
+	if (size == 0)
+		return sizeof(names);
+	if (size < sizeof(names))
+		return -ERANGE;
+	memcpy(list, names, sizeof(names));
+
+	return sizeof(names);
+}
+
+/* The entry points below wrap the implementations above to record
+ * per operation statistics, see stats.c, and traces, see trace.c. The
+ * wrapper for op calls ifuse_<op> with args and traces the path, handle
+ * and two arguments given. */
+#define STATS_WRAP(op, OP, params, args, tpath, tfh, targ1, targ2) \
+	static int stats_##op params \
+	{ \
+		uint64_t start = stats_begin(); \
+		int res = ifuse_##op args; \
+		stats_end(STATS_OP_##OP, start, res); \
+		trace_op(STATS_OP_##OP, tpath, tfh, targ1, targ2, start, res); \
+		return res; \
+	}
+
+#define FI_FH(fi) ((fi) ? (fi)->fh : 0)
+
+STATS_WRAP(getattr, GETATTR, (const char *path, struct stat *stbuf, struct fuse_file_info *fi), (path, stbuf, fi), path, FI_FH(fi), 0, 0)
+STATS_WRAP(statfs, STATFS, (const char *path, struct statvfs *stats), (path, stats), path, 0, 0, 0)
+STATS_WRAP(opendir, OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi), path, fi->fh, 0, 0)
+STATS_WRAP(readdir, READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags), (path, buf, filler, offset, fi, flags), path, fi->fh, offset, flags)
+STATS_WRAP(releasedir, RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi), path, fi->fh, 0, 0)
+STATS_WRAP(mkdir, MKDIR, (const char *dir, mode_t mode), (dir, mode), dir, 0, mode, 0)
+STATS_WRAP(rmdir, RMDIR, (const char *path), (path), path, 0, 0, 0)
+STATS_WRAP(create, CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), path, fi->fh, mode, fi->flags)
+STATS_WRAP(open, OPEN, (const char *path, struct fuse_file_info *fi), (path, fi), path, fi->fh, 0, fi->flags)
+STATS_WRAP(read, READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), path, fi->fh, offset, size)
+STATS_WRAP(write, WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), path, fi->fh, offset, size)
+STATS_WRAP(truncate, TRUNCATE, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi), path, FI_FH(fi), size, 0)
+STATS_WRAP(readlink, READLINK, (const char *path, char *linktarget, size_t buflen), (path, linktarget, buflen), path, 0, 0, buflen)
+STATS_WRAP(symlink, SYMLINK, (const char *target, const char *linkname), (target, linkname), linkname, 0, trace_path(target), 0)
+STATS_WRAP(link, LINK, (const char *target, const char *linkname), (target, linkname), linkname, 0, trace_path(target), 0)
+STATS_WRAP(unlink, UNLINK, (const char *path), (path), path, 0, 0, 0)
+STATS_WRAP(rename, RENAME, (const char *from, const char *to, unsigned int flags), (from, to, flags), from, 0, trace_path(to), flags)
+STATS_WRAP(utimens, UTIMENS, (const char *path, const struct timespec tv[2], struct fuse_file_info *fi), (path, tv, fi), path, FI_FH(fi), 0, 0)
+STATS_WRAP(fsync, FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi), path, fi->fh, 0, datasync)
+STATS_WRAP(flush, FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi), path, fi->fh, 0, 0)
+STATS_WRAP(chmod, CHMOD, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), path, FI_FH(fi), mode, 0)
+STATS_WRAP(chown, CHOWN, (const char *path, uid_t user, gid_t group, struct fuse_file_info *fi), (path, user, group, fi), path, FI_FH(fi), user, group)
+STATS_WRAP(release, RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi), path, fi->fh, 0, 0)
+STATS_WRAP(getxattr, GETXATTR, (const char *path, const char *name, char *value, size_t size), (path, name, value, size), path, 0, trace_path(name), size)
+STATS_WRAP(setxattr, SETXATTR, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags), path, 0, trace_path(name), size)
+STATS_WRAP(listxattr, LISTXATTR, (const char *path, char *list, size_t size), (path, list, size), path, 0, 0, size)
+
+/* counts the bytes in the buffer rather than the result, which is 0 */
+static int stats_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin();
+	int res = ifuse_read_buf(path, bufp, size, offset, fi);
+	stats_end(STATS_OP_READ, start, (res < 0) ? res : (int)fuse_buf_size(*bufp));
+	trace_op(STATS_OP_READ, path, fi->fh, offset, size, start, res);
+	return res;
 }
 
 static struct fuse_operations ifuse_oper = {
-	.getattr = ifuse_getattr,
-	.statfs = ifuse_statfs,
-	.readdir = ifuse_readdir,
-	.mkdir = ifuse_mkdir,
-	.rmdir = ifuse_unlink,
-	.create = ifuse_create,
-	.open = ifuse_open,
-	.read = ifuse_read,
-	.write = ifuse_write,
-	.truncate = ifuse_truncate,
-	.readlink = ifuse_readlink,
-	.symlink = ifuse_symlink,
-	.link = ifuse_link,
-	.unlink = ifuse_unlink,
-	.rename = ifuse_rename,
-	.utimens = ifuse_utimens,
-	.fsync = ifuse_fsync,
-	.chmod = ifuse_chmod,
-	.chown = ifuse_chown,
-	.release = ifuse_release,
+	.getattr = stats_getattr,
+	.statfs = stats_statfs,
+	.opendir = stats_opendir,
+	.readdir = stats_readdir,
+	.releasedir = stats_releasedir,
+	.mkdir = stats_mkdir,
+	.rmdir = stats_rmdir,
+	.create = stats_create,
+	.open = stats_open,
+	.read = stats_read,
+	.read_buf = stats_read_buf,
+	.write = stats_write,
+	.truncate = stats_truncate,
+	.readlink = stats_readlink,
+	.symlink = stats_symlink,
+	.link = stats_link,
+	.unlink = stats_unlink,
+	.rename = stats_rename,
+	.utimens = stats_utimens,
+	.fsync = stats_fsync,
+	.flush = stats_flush,
+	.chmod = stats_chmod,
+	.chown = stats_chown,
+	.release = stats_release,
+	.setxattr = stats_setxattr,
+	.getxattr = stats_getxattr,
+	.listxattr = stats_listxattr,
 	.init = ifuse_init,
 	.destroy = ifuse_cleanup
 };
@@ -605,14 +4516,33 @@ static void print_usage()
 	fprintf(stderr, "\n");
 	fprintf(stderr, "OPTIONS:\n");
 	fprintf(stderr, "  -o opt,[opt...]\tmount options\n");
+	fprintf(stderr, "     afc_connections=N\tnumber of parallel AFC connections (default: %d, %d with --network)\n", DEFAULT_AFC_CONNECTIONS, DEFAULT_NETWORK_AFC_CONNECTIONS);
+	fprintf(stderr, "     attr_timeout=T\tcache file attributes for T seconds (default: %.1f)\n", DEFAULT_CACHE_TIMEOUT);
+	fprintf(stderr, "     entry_timeout=T\tcache directory listings for T seconds (default: %.1f)\n", DEFAULT_CACHE_TIMEOUT);
+	fprintf(stderr, "     negative_timeout=T\tcache failed lookups for T seconds (default: %.1f)\n", DEFAULT_CACHE_TIMEOUT);
+	fprintf(stderr, "     readahead_max=SIZE\tread up to SIZE bytes ahead of sequential readers, 0 disables (default: 4M)\n");
+	fprintf(stderr, "     readahead_memory=SIZE\tmemory used for readahead of all open files (default: 64M)\n");
+	fprintf(stderr, "     writeback_max=SIZE\tcollect up to SIZE bytes of writes per file, 0 disables (default: 1M)\n");
+	fprintf(stderr, "     cache_dir=PATH\tkeep the content of files read from the device in PATH\n");
+	fprintf(stderr, "     cache_size=SIZE\tdisk space used by cache_dir at most (default: 1G)\n");
+	fprintf(stderr, "     index_dir=PATH\tindex the whole tree of each device in PATH to answer lookups locally\n");
+	fprintf(stderr, "     index_timeout=T\tcheck an indexed directory on the device again after T seconds (default: %.1f)\n", TREEINDEX_DEFAULT_TIMEOUT);
+	fprintf(stderr, "     checksum_reads\tcompute the checksums of files while they are read from their start\n");
+	fprintf(stderr, "     stats_file=PATH\twrite statistics to PATH on SIGUSR1 and unmount (default: stderr on SIGUSR1 only)\n");
+	fprintf(stderr, "     trace_file=PATH\trecord every operation to PATH for trace-replay\n");
+	fprintf(stderr, "     statfs_timeout=T\task the device for free space every T seconds, 0 on every statfs (default: %.1f)\n", FSINFO_DEFAULT_TIMEOUT);
+	fprintf(stderr, "     reconnect_timeout=T\twait up to T seconds for a dropped connection to come back, 0 to fail right away (default: %.1f)\n", DEFAULT_RECONNECT_TIMEOUT);
+	fprintf(stderr, "     apps_max=N\tkeep the connections of up to N apps open with --apps (default: %d)\n", DEFAULT_APPS_MAX);
 	fprintf(stderr, "  -u, --udid UDID\tmount specific device by UDID\n");
 	fprintf(stderr, "  -n, --network\t\tconnect to network device\n");
+	fprintf(stderr, "  -a, --all\t\tmount all attached devices in MOUNTPOINT/UDID\n");
 	fprintf(stderr, "  -h, --help\t\tprint usage information\n");
 	fprintf(stderr, "  -V, --version\t\tprint version\n");
-	fprintf(stderr, "  -d, --debug\t\tenable libimobiledevice communication debugging\n");
+	fprintf(stderr, "  -d, --debug\t\tenable libimobiledevice communication debugging and\n\t\t\tprint a breakdown of the startup time\n");
 	fprintf(stderr, "  --documents APPID\tmount 'Documents' folder of app identified by APPID\n");
 	fprintf(stderr, "  --container APPID\tmount sandbox root of an app identified by APPID\n");
 	fprintf(stderr, "  --list-apps\t\tlist installed apps that have file sharing enabled\n");
+	fprintf(stderr, "  --apps\t\tmount the folders of all apps that have file sharing\n\t\t\tenabled in MOUNTPOINT/APPID\n");
 	fprintf(stderr, "  --root\t\tmount root file system (jailbroken device required)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example:\n");
@@ -644,6 +4574,23 @@ static int ifuse_opt_proc(void *data, const char *arg, int key, struct fuse_args
 		opts.use_network = 1;
 		res = 0;
 		break;
+	case KEY_ALL:
+	case KEY_ALL_LONG:
+		opts.all_devices = 1;
+		res = 0;
+		break;
+	case KEY_APPS_LONG:
+		opts.all_apps = 1;
+		res = 0;
+		break;
+	case KEY_APPS_MAX:
+		opts.apps_max = (unsigned int)strtoul(arg+9, NULL, 10);
+		if (opts.apps_max < 1) {
+			fprintf(stderr, "ERROR: apps_max must be at least 1\n");
+			return -1;
+		}
+		res = 0;
+		break;
 	case KEY_VENDOR_CONTAINER_LONG:
 		opts.use_container = 1;
 		opts.appid = strdup(arg+11);
@@ -658,12 +4605,81 @@ static int ifuse_opt_proc(void *data, const char *arg, int key, struct fuse_args
 	case KEY_DEBUG:
 	case KEY_DEBUG_LONG:
 		idevice_set_debug_level(1);
+		debug = 1;
 		res = 0;
 		break;
 	case KEY_ROOT:
 		opts.service_name = AFC2_SERVICE_NAME;
 		res = 0;
 		break;
+	case KEY_ATTR_TIMEOUT:
+		opts.attr_timeout = strtod(arg+13, NULL);
+		res = 0;
+		break;
+	case KEY_ENTRY_TIMEOUT:
+		opts.entry_timeout = strtod(arg+14, NULL);
+		res = 0;
+		break;
+	case KEY_NEGATIVE_TIMEOUT:
+		opts.negative_timeout = strtod(arg+17, NULL);
+		res = 0;
+		break;
+	case KEY_READAHEAD_MAX:
+		opts.readahead_max = parse_size(arg+14);
+		res = 0;
+		break;
+	case KEY_READAHEAD_MEMORY:
+		opts.readahead_memory = parse_size(arg+17);
+		res = 0;
+		break;
+	case KEY_WRITEBACK_MAX:
+		opts.writeback_max = parse_size(arg+14);
+		res = 0;
+		break;
+	case KEY_CACHE_DIR:
+		opts.cache_dir = strdup(arg+10);
+		res = 0;
+		break;
+	case KEY_CACHE_SIZE:
+		opts.cache_size = parse_size(arg+11);
+		res = 0;
+		break;
+	case KEY_INDEX_DIR:
+		opts.index_dir = strdup(arg+10);
+		res = 0;
+		break;
+	case KEY_INDEX_TIMEOUT:
+		opts.index_timeout = strtod(arg+14, NULL);
+		res = 0;
+		break;
+	case KEY_CHECKSUM_READS:
+		opts.checksum_reads = 1;
+		res = 0;
+		break;
+	case KEY_STATS_FILE:
+		opts.stats_file = strdup(arg+11);
+		res = 0;
+		break;
+	case KEY_TRACE_FILE:
+		opts.trace_file = strdup(arg+11);
+		res = 0;
+		break;
+	case KEY_STATFS_TIMEOUT:
+		opts.statfs_timeout = strtod(arg+15, NULL);
+		res = 0;
+		break;
+	case KEY_RECONNECT_TIMEOUT:
+		opts.reconnect_timeout = strtod(arg+18, NULL);
+		res = 0;
+		break;
+	case KEY_AFC_CONNECTIONS:
+		opts.afc_connections = (unsigned int)strtoul(arg+16, NULL, 10);
+		if (opts.afc_connections < 1 || opts.afc_connections > AFC_POOL_MAX_CONNECTIONS) {
+			fprintf(stderr, "ERROR: afc_connections must be between 1 and %d\n", AFC_POOL_MAX_CONNECTIONS);
+			return -1;
+		}
+		res = 0;
+		break;
 	case KEY_HELP:
 		print_usage();
 		exit(EXIT_SUCCESS);
@@ -699,20 +4715,8 @@ static void list_available_apps(idevice_t dev)
 		goto leave_cleanup;
 	}
 
-	plist_t client_opts = instproxy_client_options_new();
-	instproxy_client_options_add(client_opts, "ApplicationType", "Any", NULL);
-	instproxy_client_options_set_return_attributes(client_opts,
-				"CFBundleIdentifier",
-				"CFBundleDisplayName",
-				"CFBundleVersion",
-				"UIFileSharingEnabled",
-				NULL
-	);
-
-	plist_t apps = NULL;
-	instproxy_browse(ip, client_opts, &apps);
-
-	if (!apps || (plist_get_node_type(apps) != PLIST_ARRAY)) {
+	plist_t list = browse_apps(ip);
+	if (!list) {
 		fprintf(stderr, "ERROR: instproxy_browse returned an invalid plist?!\n");
 		goto leave_cleanup;
 	}
@@ -722,65 +4726,148 @@ static void list_available_apps(idevice_t dev)
 
 	/* output rows with app information */
 	uint32_t i = 0;
-	for (i = 0; i < plist_array_get_size(apps); i++) {
-		plist_t node = plist_array_get_item(apps, i);
-		if (node && plist_get_node_type(node) == PLIST_DICT) {
-			uint8_t sharing_enabled = 0;
-			plist_t val = plist_dict_get_item(node, "UIFileSharingEnabled");
-			if (val && plist_get_node_type(val) == PLIST_BOOLEAN) {
-				plist_get_bool_val(val, &sharing_enabled);
+	for (i = 0; i < plist_array_get_size(list); i++) {
+		plist_t node = plist_array_get_item(list, i);
+		if (app_sharing_enabled(node)) {
+			char *bid = NULL;
+			char *ver = NULL;
+			char *name = NULL;
+			plist_t val = plist_dict_get_item(node, "CFBundleIdentifier");
+			if (val) {
+				plist_get_string_val(val, &bid);
 			}
-			if (sharing_enabled) {
-				char *bid = NULL;
-				char *ver = NULL;
-				char *name = NULL;
-				val = plist_dict_get_item(node, "CFBundleIdentifier");
-				if (val) {
-					plist_get_string_val(val, &bid);
-				}
-				val = plist_dict_get_item(node, "CFBundleVersion");
-				if (val) {
-					plist_get_string_val(val, &ver);
-				}
-				val = plist_dict_get_item(node, "CFBundleDisplayName");
-				if (val) {
-					plist_get_string_val(val, &name);
-				}
-				printf("\"%s\",\"%s\",\"%s\"\n", bid, ver, name);
-				free(bid);
-				free(ver);
-				free(name);
+			val = plist_dict_get_item(node, "CFBundleVersion");
+			if (val) {
+				plist_get_string_val(val, &ver);
 			}
+			val = plist_dict_get_item(node, "CFBundleDisplayName");
+			if (val) {
+				plist_get_string_val(val, &name);
+			}
+			printf("\"%s\",\"%s\",\"%s\"\n", bid, ver, name);
+			free(bid);
+			free(ver);
+			free(name);
 		}
 	}
-	plist_free(apps);
+	plist_free(list);
 
 leave_cleanup:
 	instproxy_client_free(ip);
 	idevice_free(dev);
 }
 
+/**
+ * Makes a path given with an option absolute, since fuse changes to the
+ * root directory when it goes to the background. A directory is created if
+ * it does not exist and has to be usable; the directory of a file has to
+ * exist and be writable.
+ *
+ * @param path The path, replaced with the absolute one.
+ * @param is_dir Whether path names a directory.
+ *
+ * @return 0 on success or -1 with errno set.
+ */
+static int make_path_absolute(char **path, int is_dir)
+{
+	char resolved[PATH_MAX];
+	char *dir = NULL;
+	const char *name = NULL;
+	char *slash;
+	char *abs;
+
+	if (is_dir) {
+		if (mkdir(*path, 0700) < 0 && errno != EEXIST)
+			return -1;
+		if (!realpath(*path, resolved) || access(resolved, R_OK | W_OK | X_OK) < 0)
+			return -1;
+		abs = strdup(resolved);
+	} else {
+		dir = strdup(*path);
+		if (!dir)
+			return -1;
+		slash = strrchr(dir, '/');
+		if (slash) {
+			*slash = '\0';
+			name = slash + 1;
+		} else {
+			name = *path;
+		}
+		if (!*name) {
+			free(dir);
+			errno = EISDIR;
+			return -1;
+		}
+		if (!realpath((!slash) ? "." : (slash == dir) ? "/" : dir, resolved) || access(resolved, W_OK | X_OK) < 0) {
+			free(dir);
+			return -1;
+		}
+		abs = malloc(strlen(resolved) + strlen(name) + 2);
+		if (abs) {
+			sprintf(abs, "%s/%s", (strcmp(resolved, "/")) ? resolved : "", name);
+		}
+		free(dir);
+	}
+	if (!abs) {
+		errno = ENOMEM;
+		return -1;
+	}
+	free(*path);
+	*path = abs;
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int res = EXIT_FAILURE;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct stat mst;
 	idevice_error_t err = IDEVICE_E_UNKNOWN_ERROR;
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 	enum idevice_options lookup_opts = IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK;
 
+	startup_time = monotonic_now();
+
 	memset(&opts, 0, sizeof(opts));
 	opts.service_name = AFC_SERVICE_NAME;
+	opts.attr_timeout = DEFAULT_CACHE_TIMEOUT;
+	opts.entry_timeout = DEFAULT_CACHE_TIMEOUT;
+	opts.negative_timeout = DEFAULT_CACHE_TIMEOUT;
+	opts.statfs_timeout = FSINFO_DEFAULT_TIMEOUT;
+	opts.reconnect_timeout = DEFAULT_RECONNECT_TIMEOUT;
+	opts.cache_size = CHUNKCACHE_DEFAULT_MAX_SIZE;
+	opts.index_timeout = TREEINDEX_DEFAULT_TIMEOUT;
+	opts.readahead_max = READAHEAD_DEFAULT_MAX_WINDOW;
+	opts.readahead_memory = READAHEAD_DEFAULT_MAX_MEMORY;
+	opts.writeback_max = DEFAULT_WRITEBACK_MAX;
 
 	if (fuse_opt_parse(&args, NULL, ifuse_opts, ifuse_opt_proc) == -1) {
 		return EXIT_FAILURE;
 	}
 
+	if (opts.apps_max == 0) {
+		opts.apps_max = DEFAULT_APPS_MAX;
+	}
+
+	if (opts.afc_connections == 0) {
+		opts.afc_connections = (opts.use_network) ? DEFAULT_NETWORK_AFC_CONNECTIONS : DEFAULT_AFC_CONNECTIONS;
+	}
+
 	if (opts.device_udid && !*opts.device_udid) {
 		fprintf(stderr, "ERROR: UDID must not be empty\n");
 		return EXIT_FAILURE;
 	}
 
+	if (opts.all_devices && (opts.device_udid || opts.appid || opts.should_list_apps || opts.all_apps)) {
+		fprintf(stderr, "ERROR: --all can not be combined with --udid, --documents, --container, --list-apps or --apps\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opts.all_apps && (opts.appid || opts.should_list_apps || strcmp(opts.service_name, AFC_SERVICE_NAME) != 0)) {
+		fprintf(stderr, "ERROR: --apps can not be combined with --documents, --container, --list-apps or --root\n");
+		return EXIT_FAILURE;
+	}
+
 	if (!opts.should_list_apps) {
 		if (!opts.mount_point) {
 			fprintf(stderr, "ERROR: No mount point specified\n");
@@ -798,6 +4885,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (opts.cache_dir && make_path_absolute(&opts.cache_dir, 1) < 0) {
+		fprintf(stderr, "ERROR: Could not use %s as cache directory: %s\n", opts.cache_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (opts.index_dir && make_path_absolute(&opts.index_dir, 1) < 0) {
+		fprintf(stderr, "ERROR: Could not use %s as index directory: %s\n", opts.index_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (opts.stats_file && make_path_absolute(&opts.stats_file, 0) < 0) {
+		fprintf(stderr, "ERROR: Could not use %s as statistics file: %s\n", opts.stats_file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (opts.trace_file && make_path_absolute(&opts.trace_file, 0) < 0) {
+		fprintf(stderr, "ERROR: Could not use %s as trace file: %s\n", opts.trace_file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (opts.all_devices) {
+		/* devices are connected on first access, see ifuse_device_get */
+		goto mount;
+	}
+
+	/* everything but the lookup of the device happens after mounting */
 	err = idevice_new_with_options(&device, opts.device_udid, (opts.use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (err != IDEVICE_E_SUCCESS) {
 		if (opts.device_udid) {
@@ -818,77 +4928,25 @@ int main(int argc, char *argv[])
 		return EXIT_SUCCESS;
 	}
 
-	ret = lockdownd_client_new_with_handshake(device, &control, "ifuse");
-	if (ret != LOCKDOWN_E_SUCCESS) {
-		idevice_free(device);
-		if (ret == LOCKDOWN_E_PASSWORD_PROTECTED) {
-			fprintf(stderr, "Please disable the password protection on your device and try again.\n");
-			fprintf(stderr, "The device does not allow pairing as long as a password has been set.\n");
-			fprintf(stderr, "You can enable it again after the connection succeeded.\n");
-#ifdef LOCKDOWN_E_PAIRING_DIALOG_PENDING
-		} else if (ret == LOCKDOWN_E_PAIRING_DIALOG_PENDING) {
-			fprintf(stderr, "Please dismiss the trust dialog on your device and try again.\n");
-			fprintf(stderr, "The device does not allow pairing as long as the dialog has not been accepted.\n");
-#endif
-		} else {
-			fprintf(stderr, "Failed to connect to lockdownd service on the device.\n");
-			fprintf(stderr, "Try again. If it still fails try rebooting your device.\n");
-		}
-		return EXIT_FAILURE;
+	if (opts.appid && opts.use_container == 0) {
+		fuse_opt_add_arg(&args, "-omodules=subdir");
+		fuse_opt_add_arg(&args, "-osubdir=Documents");
+		control_prefix = "/Documents";
 	}
 
-	if ((lockdownd_start_service(control, opts.service_name, &opts.service) != LOCKDOWN_E_SUCCESS) || !opts.service) {
-		lockdownd_client_free(control);
-		idevice_free(device);
-		fprintf(stderr, "Failed to start AFC service '%s' on the device.\n", opts.service_name);
-		if (!strcmp(opts.service_name, AFC2_SERVICE_NAME)) {
-			fprintf(stderr, "This service enables access to the root filesystem of your device.\n");
-			fprintf(stderr, "Your device needs to be jailbroken and have the AFC2 service installed.\n");
-		}
-		return EXIT_FAILURE;
+mount:
+	if (!opts.cache_dir) {
+		/* without chunks to splice fuse reads through ifuse_read() */
+		ifuse_oper.read_buf = NULL;
 	}
-
-	if (!strcmp(opts.service_name, HOUSE_ARREST_SERVICE_NAME)) {
-		house_arrest_client_new(device, opts.service, &house_arrest);
-		if (!house_arrest) {
-			fprintf(stderr, "Could not start document sharing service!\n");
-			return EXIT_FAILURE;
-		}
-
-		/* FIXME: iOS 3.x house_arrest does not know about VendDocuments yet, thus use VendContainer and chroot manually with fuse subdir module */
-		if (house_arrest_send_command(house_arrest, opts.use_container ? "VendContainer": "VendDocuments", opts.appid) != HOUSE_ARREST_E_SUCCESS) {
-			fprintf(stderr, "Could not send house_arrest command!\n");
-			goto leave_err;
-		}
-
-		plist_t dict = NULL;
-		if (house_arrest_get_result(house_arrest, &dict) != HOUSE_ARREST_E_SUCCESS) {
-			fprintf(stderr, "Could not get result from document sharing service!\n");
-			goto leave_err;
-		}
-		plist_t node = plist_dict_get_item(dict, "Error");
-		if (node) {
-			char *str = NULL;
-			plist_get_string_val(node, &str);
-			fprintf(stderr, "ERROR: %s\n", str);
-			if (str && !strcmp(str, "InstallationLookupFailed")) {
-				fprintf(stderr, "The App '%s' is either not present on the device, or the 'UIFileSharingEnabled' key is not set in its Info.plist. Starting with iOS 8.3 this key is mandatory to allow access to an app's Documents folder.\n", opts.appid);
-			}
-			free(str);
-			goto leave_err;
-		}
-		plist_free(dict);
-
-		if (opts.use_container == 0) {
-			fuse_opt_add_arg(&args, "-omodules=subdir");
-			fuse_opt_add_arg(&args, "-osubdir=Documents");
-		}
+	conn_opts = fuse_parse_conn_info_opts(&args);
+	if (!conn_opts) {
+		goto leave_err;
 	}
+
 	res = fuse_main(args.argc, args.argv, &ifuse_oper, NULL);
+	free(conn_opts);
 
 leave_err:
-	if (house_arrest) {
-		house_arrest_client_free(house_arrest);
-	}
 	return res;
 }
@@ -0,0 +1,483 @@
+/*
+ * metacache.c
+ * Path keyed attribute and directory listing cache.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metacache.h"
+
+struct metacache_entry {
+	char *path;
+	uint32_t hash;
+	struct metacache_entry *hnext;
+	struct metacache_entry *lru_prev;
+	struct metacache_entry *lru_next;
+
+	/* attributes, or a negative result if err is set */
+	int has_attr;
+	int err;
+	struct stat st;
+	double attr_expires;
+
+	/* the listing if this is a cached directory */
+	dirsnap_t names;
+	double names_expires;
+
+	/* generation at which the lookups that filled the entry began */
+	uint64_t generation;
+};
+
+/* number of slots remembering when paths were last invalidated */
+#define INVALIDATION_SLOTS 1024
+
+static struct {
+	pthread_mutex_t mutex;
+	struct metacache_entry **buckets;
+	uint32_t bucket_mask;
+	/* most recently used entry is at lru_head */
+	struct metacache_entry *lru_head;
+	struct metacache_entry *lru_tail;
+	unsigned int count;
+	unsigned int max_entries;
+	double attr_timeout;
+	double entry_timeout;
+	double negative_timeout;
+	/* bumped by every invalidation */
+	uint64_t generation;
+	/* generation of the last invalidation of a path, and of a tree
+	 * rooted at a path, by hash of the path; colliding paths share a
+	 * slot, which only costs a cache miss */
+	uint64_t invalidated[INVALIDATION_SLOTS];
+	uint64_t tree_invalidated[INVALIDATION_SLOTS];
+	/* generation of the last invalidation of everything */
+	uint64_t root_invalidated;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, { 0 }, { 0 }, 0 };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/* FNV-1a */
+static uint32_t path_hash(const char *path)
+{
+	uint32_t h = FNV_OFFSET;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+/**
+ * Checks whether path, or a directory above it, was invalidated after the
+ * given generation. As FNV-1a hashes a path one character at a time, the
+ * hash of every parent directory falls out on the way, so this costs one
+ * slot lookup per path component.
+ */
+static int tree_stale(const char *path, uint64_t since)
+{
+	uint32_t h = FNV_OFFSET;
+	const char *p;
+
+	if (cache.root_invalidated > since)
+		return 1;
+	for (p = path; *p; p++) {
+		if (*p == '/' && p != path && cache.tree_invalidated[h & (INVALIDATION_SLOTS-1)] > since)
+			return 1;
+		h ^= (unsigned char)*p;
+		h *= FNV_PRIME;
+	}
+	return cache.tree_invalidated[h & (INVALIDATION_SLOTS-1)] > since;
+}
+
+/* whether a result for path looked up since the given generation is outdated */
+static int put_stale(const char *path, uint32_t hash, uint64_t since)
+{
+	return cache.invalidated[hash & (INVALIDATION_SLOTS-1)] > since || tree_stale(path, since);
+}
+
+static void lru_unlink(struct metacache_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		cache.lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		cache.lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct metacache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache.lru_head;
+	if (cache.lru_head)
+		cache.lru_head->lru_prev = e;
+	cache.lru_head = e;
+	if (!cache.lru_tail)
+		cache.lru_tail = e;
+}
+
+static struct metacache_entry *find(const char *path, uint32_t hash)
+{
+	struct metacache_entry *e;
+
+	if (!cache.buckets)
+		return NULL;
+
+	for (e = cache.buckets[hash & cache.bucket_mask]; e; e = e->hnext) {
+		if (e->hash == hash && !strcmp(e->path, path))
+			return e;
+	}
+	return NULL;
+}
+
+static void remove_entry(struct metacache_entry *e)
+{
+	struct metacache_entry **pp = &cache.buckets[e->hash & cache.bucket_mask];
+
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+	lru_unlink(e);
+	dirsnap_unref(e->names);
+	free(e->path);
+	free(e);
+	cache.count--;
+}
+
+/* finds the entry for path, dropping it if a tree above it was invalidated since it was filled */
+static struct metacache_entry *lookup(const char *path, uint32_t hash)
+{
+	struct metacache_entry *e = find(path, hash);
+
+	if (e && tree_stale(path, e->generation)) {
+		remove_entry(e);
+		e = NULL;
+	}
+	return e;
+}
+
+/**
+ * Returns the entry for path, creating it if needed, and marks it as most
+ * recently used. Returns NULL if path was invalidated after since, the
+ * generation at which the lookup of what is to be stored began, so that a
+ * lookup racing with a change does not cache the outdated result.
+ */
+static struct metacache_entry *get_or_create(const char *path, uint64_t since)
+{
+	uint32_t hash = path_hash(path);
+	struct metacache_entry *e;
+
+	if (put_stale(path, hash, since))
+		return NULL;
+
+	e = lookup(path, hash);
+	if (e) {
+		if (since < e->generation)
+			e->generation = since;
+		lru_unlink(e);
+		lru_push_front(e);
+		return e;
+	}
+
+	if (!cache.buckets)
+		return NULL;
+
+	e = calloc(1, sizeof(struct metacache_entry));
+	if (!e)
+		return NULL;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return NULL;
+	}
+	e->hash = hash;
+	e->generation = since;
+	e->hnext = cache.buckets[hash & cache.bucket_mask];
+	cache.buckets[hash & cache.bucket_mask] = e;
+	lru_push_front(e);
+	cache.count++;
+
+	while (cache.count > cache.max_entries && cache.lru_tail && cache.lru_tail != e) {
+		remove_entry(cache.lru_tail);
+	}
+
+	return e;
+}
+
+/**
+ * Sets up the cache. A timeout of 0 disables caching of the respective
+ * kind of information.
+ *
+ * @param attr_timeout Seconds to keep file attributes.
+ * @param entry_timeout Seconds to keep directory listings.
+ * @param negative_timeout Seconds to remember failed lookups.
+ * @param max_entries Maximum number of cached paths.
+ */
+void metacache_init(double attr_timeout, double entry_timeout, double negative_timeout, unsigned int max_entries)
+{
+	uint32_t nbuckets = 64;
+
+	pthread_mutex_lock(&cache.mutex);
+	cache.attr_timeout = attr_timeout;
+	cache.entry_timeout = entry_timeout;
+	cache.negative_timeout = negative_timeout;
+	cache.max_entries = (max_entries > 0) ? max_entries : METACACHE_DEFAULT_MAX_ENTRIES;
+	while (nbuckets < cache.max_entries / 2)
+		nbuckets <<= 1;
+	cache.buckets = calloc(nbuckets, sizeof(struct metacache_entry*));
+	cache.bucket_mask = cache.buckets ? nbuckets - 1 : 0;
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Drops all cached information and releases the memory used by the cache.
+ */
+void metacache_cleanup(void)
+{
+	pthread_mutex_lock(&cache.mutex);
+	while (cache.lru_head) {
+		remove_entry(cache.lru_head);
+	}
+	free(cache.buckets);
+	cache.buckets = NULL;
+	cache.bucket_mask = 0;
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Returns the current generation of the cache. Take it before querying the
+ * device and pass it when storing the result.
+ */
+uint64_t metacache_begin(void)
+{
+	uint64_t generation;
+
+	pthread_mutex_lock(&cache.mutex);
+	generation = cache.generation;
+	pthread_mutex_unlock(&cache.mutex);
+
+	return generation;
+}
+
+/**
+ * Looks up the cached attributes of path.
+ *
+ * @param path The path to look up.
+ * @param st Receives the attributes on a positive hit.
+ *
+ * @return 1 on a positive hit, a negative errno value on a negative hit,
+ *    or 0 if nothing valid is cached.
+ */
+int metacache_get_attr(const char *path, struct stat *st)
+{
+	struct metacache_entry *e;
+	int res = 0;
+
+	pthread_mutex_lock(&cache.mutex);
+	e = lookup(path, path_hash(path));
+	if (e && e->has_attr && e->attr_expires > now()) {
+		if (e->err) {
+			res = -e->err;
+		} else {
+			*st = e->st;
+			res = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	return res;
+}
+
+/**
+ * Stores the attributes of path.
+ *
+ * @param path The path.
+ * @param st The attributes.
+ * @param since Value of metacache_begin() from before they were queried.
+ */
+void metacache_put_attr(const char *path, const struct stat *st, uint64_t since)
+{
+	struct metacache_entry *e;
+
+	if (cache.attr_timeout <= 0)
+		return;
+
+	pthread_mutex_lock(&cache.mutex);
+	e = get_or_create(path, since);
+	if (e) {
+		e->has_attr = 1;
+		e->err = 0;
+		e->st = *st;
+		e->attr_expires = now() + cache.attr_timeout;
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Remembers that looking up path failed with the given errno value.
+ * See metacache_put_attr() for since.
+ */
+void metacache_put_negative(const char *path, int err, uint64_t since)
+{
+	struct metacache_entry *e;
+
+	if (cache.negative_timeout <= 0 || err == 0)
+		return;
+
+	pthread_mutex_lock(&cache.mutex);
+	e = get_or_create(path, since);
+	if (e) {
+		e->has_attr = 1;
+		e->err = err;
+		e->attr_expires = now() + cache.negative_timeout;
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Returns the cached listing of the directory path.
+ *
+ * @return The listing with a reference taken, release it with
+ *    dirsnap_unref(), or NULL if no valid listing is cached.
+ */
+dirsnap_t metacache_get_dir(const char *path)
+{
+	struct metacache_entry *e;
+	dirsnap_t names = NULL;
+
+	pthread_mutex_lock(&cache.mutex);
+	e = lookup(path, path_hash(path));
+	if (e && e->names && e->names_expires > now()) {
+		names = dirsnap_ref(e->names);
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	return names;
+}
+
+/**
+ * Stores the listing of the directory path. The cache takes its own
+ * reference, the snapshot is shared rather than copied.
+ *
+ * @param path The directory.
+ * @param names The listing.
+ * @param since Value of metacache_begin() from before it was read.
+ */
+void metacache_put_dir(const char *path, dirsnap_t names, uint64_t since)
+{
+	struct metacache_entry *e;
+	dirsnap_t old = NULL;
+
+	if (cache.entry_timeout <= 0 || !names)
+		return;
+
+	pthread_mutex_lock(&cache.mutex);
+	e = get_or_create(path, since);
+	if (e) {
+		old = e->names;
+		e->names = dirsnap_ref(names);
+		e->names_expires = now() + cache.entry_timeout;
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	dirsnap_unref(old);
+}
+
+/**
+ * Drops everything cached for path itself.
+ */
+void metacache_invalidate(const char *path)
+{
+	struct metacache_entry *e;
+	uint32_t hash = path_hash(path);
+
+	pthread_mutex_lock(&cache.mutex);
+	cache.invalidated[hash & (INVALIDATION_SLOTS-1)] = ++cache.generation;
+	e = find(path, hash);
+	if (e)
+		remove_entry(e);
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * Drops the cached listing and attributes of the directory containing
+ * path, e.g. after an entry has been created or removed in it.
+ */
+void metacache_invalidate_parent(const char *path)
+{
+	char *parent = strdup(path);
+	char *slash;
+
+	if (!parent)
+		return;
+
+	slash = strrchr(parent, '/');
+	if (slash) {
+		if (slash == parent)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+		metacache_invalidate(parent);
+	}
+	free(parent);
+}
+
+/**
+ * Drops everything cached for path and for all paths below it. Entries
+ * below path are not searched for, lookups notice that they are outdated
+ * and drop them then.
+ */
+void metacache_invalidate_tree(const char *path)
+{
+	struct metacache_entry *e;
+	uint32_t hash = path_hash(path);
+
+	pthread_mutex_lock(&cache.mutex);
+	cache.generation++;
+	if (!strcmp(path, "/")) {
+		cache.root_invalidated = cache.generation;
+	} else {
+		cache.invalidated[hash & (INVALIDATION_SLOTS-1)] = cache.generation;
+		cache.tree_invalidated[hash & (INVALIDATION_SLOTS-1)] = cache.generation;
+	}
+	e = find(path, hash);
+	if (e)
+		remove_entry(e);
+	pthread_mutex_unlock(&cache.mutex);
+}
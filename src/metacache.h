@@ -0,0 +1,49 @@
+/*
+ * metacache.h
+ * Path keyed attribute and directory listing cache.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __METACACHE_H
+#define __METACACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "dirsnap.h"
+
+/* default upper limit of cached paths */
+#define METACACHE_DEFAULT_MAX_ENTRIES 65536
+
+void metacache_init(double attr_timeout, double entry_timeout, double negative_timeout, unsigned int max_entries);
+void metacache_cleanup(void);
+
+uint64_t metacache_begin(void);
+
+int metacache_get_attr(const char *path, struct stat *st);
+void metacache_put_attr(const char *path, const struct stat *st, uint64_t since);
+void metacache_put_negative(const char *path, int err, uint64_t since);
+
+dirsnap_t metacache_get_dir(const char *path);
+void metacache_put_dir(const char *path, dirsnap_t names, uint64_t since);
+
+void metacache_invalidate(const char *path);
+void metacache_invalidate_parent(const char *path);
+void metacache_invalidate_tree(const char *path);
+
+#endif
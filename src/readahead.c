@@ -0,0 +1,416 @@
+/*
+ * readahead.c
+ * Sequential readahead for files opened through ifuse.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "readahead.h"
+
+/*
+ * Each open file has two buffers: cur holds the data readers are served
+ * from, next is filled in the background by one of the worker threads with
+ * the window that follows cur. Once a reader runs past the end of cur the
+ * buffers are swapped and the following window is queued.
+ */
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct readahead *queue_head;
+	struct readahead *queue_tail;
+	pthread_t *threads;
+	unsigned int nthreads;
+	int quit;
+	size_t max_window;
+	size_t max_memory;
+	size_t used;
+} ra_global = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, 0, 0, 0, 0, 0 };
+
+/* makes sure b can hold want bytes within the global memory limit, returns the usable size */
+static size_t buffer_reserve(struct ra_buffer *b, size_t want)
+{
+	size_t grow;
+	char *data;
+
+	if (b->size >= want)
+		return want;
+
+	pthread_mutex_lock(&ra_global.mutex);
+	if (ra_global.used >= ra_global.max_memory) {
+		want = b->size;
+	} else if (want - b->size > ra_global.max_memory - ra_global.used) {
+		want = b->size + (ra_global.max_memory - ra_global.used);
+	}
+	grow = want - b->size;
+	ra_global.used += grow;
+	pthread_mutex_unlock(&ra_global.mutex);
+
+	if (grow == 0)
+		return b->size;
+
+	data = realloc(b->data, want);
+	if (!data) {
+		pthread_mutex_lock(&ra_global.mutex);
+		ra_global.used -= grow;
+		pthread_mutex_unlock(&ra_global.mutex);
+		return b->size;
+	}
+	b->data = data;
+	b->size = want;
+
+	return want;
+}
+
+static void buffer_release(struct ra_buffer *b)
+{
+	pthread_mutex_lock(&ra_global.mutex);
+	ra_global.used -= b->size;
+	pthread_mutex_unlock(&ra_global.mutex);
+	free(b->data);
+	memset(b, 0, sizeof(struct ra_buffer));
+}
+
+static int buffer_contains(struct ra_buffer *b, uint64_t pos)
+{
+	return b->valid && pos >= b->offset && pos < b->offset + b->len;
+}
+
+static void *readahead_worker(void *arg)
+{
+	pthread_mutex_lock(&ra_global.mutex);
+	while (1) {
+		struct readahead *ra;
+		uint64_t offset;
+		size_t size;
+		ssize_t res;
+
+		while (!ra_global.queue_head && !ra_global.quit) {
+			pthread_cond_wait(&ra_global.cond, &ra_global.mutex);
+		}
+		if (ra_global.quit)
+			break;
+
+		ra = ra_global.queue_head;
+		ra_global.queue_head = ra->queue_next;
+		if (!ra_global.queue_head)
+			ra_global.queue_tail = NULL;
+		ra->queue_next = NULL;
+		pthread_mutex_unlock(&ra_global.mutex);
+
+		/* next is owned by this thread until pending is cleared */
+		pthread_mutex_lock(&ra->mutex);
+		ra->queued = 0;
+		offset = ra->next.offset;
+		size = ra->next_want;
+		pthread_mutex_unlock(&ra->mutex);
+
+		size = buffer_reserve(&ra->next, size);
+		res = (size > 0) ? ra->fetch(ra->ctx, ra->next.data, size, offset) : -ENOMEM;
+
+		pthread_mutex_lock(&ra->mutex);
+		if (res > 0) {
+			ra->next.len = res;
+			ra->next.valid = 1;
+		}
+		if (res >= 0 && (size_t)res < size) {
+			ra->eof = 1;
+		}
+		ra->pending = 0;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->mutex);
+
+		pthread_mutex_lock(&ra_global.mutex);
+	}
+	pthread_mutex_unlock(&ra_global.mutex);
+
+	return NULL;
+}
+
+/* queues a background fill of next right behind cur, must be called with ra->mutex held */
+static void schedule_next(struct readahead *ra)
+{
+	if (ra->pending || ra->eof || !ra->cur.valid || ra_global.nthreads == 0)
+		return;
+
+	ra->next.valid = 0;
+	ra->next.offset = ra->cur.offset + ra->cur.len;
+	ra->next.len = 0;
+	ra->next_want = ra->window;
+	ra->pending = 1;
+	ra->queued = 1;
+
+	pthread_mutex_lock(&ra_global.mutex);
+	if (ra_global.queue_tail)
+		ra_global.queue_tail->queue_next = ra;
+	else
+		ra_global.queue_head = ra;
+	ra_global.queue_tail = ra;
+	pthread_cond_signal(&ra_global.cond);
+	pthread_mutex_unlock(&ra_global.mutex);
+}
+
+/* removes ra from the queue if no worker picked it up yet and waits for a running fill, must be called with ra->mutex held */
+static void cancel_next(struct readahead *ra)
+{
+	if (ra->queued) {
+		struct readahead *it, *prev = NULL;
+		int found = 0;
+
+		pthread_mutex_lock(&ra_global.mutex);
+		for (it = ra_global.queue_head; it; prev = it, it = it->queue_next) {
+			if (it == ra) {
+				if (prev)
+					prev->queue_next = ra->queue_next;
+				else
+					ra_global.queue_head = ra->queue_next;
+				if (ra_global.queue_tail == ra)
+					ra_global.queue_tail = prev;
+				found = 1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ra_global.mutex);
+		/* if a worker already dequeued it, wait for the fill below */
+		if (found) {
+			ra->queue_next = NULL;
+			ra->queued = 0;
+			ra->pending = 0;
+		}
+	}
+	while (ra->pending) {
+		pthread_cond_wait(&ra->cond, &ra->mutex);
+	}
+}
+
+/**
+ * Starts the worker threads that fill readahead buffers in the background.
+ *
+ * @param nthreads Number of worker threads.
+ * @param max_window Largest amount of data read ahead for a single file.
+ * @param max_memory Upper limit of the buffer memory of all open files.
+ */
+void readahead_init(unsigned int nthreads, size_t max_window, size_t max_memory)
+{
+	unsigned int i;
+
+	ra_global.max_window = (max_window < READAHEAD_MIN_WINDOW) ? READAHEAD_MIN_WINDOW : max_window;
+	ra_global.max_memory = max_memory;
+	ra_global.quit = 0;
+	ra_global.threads = calloc(nthreads, sizeof(pthread_t));
+	if (!ra_global.threads)
+		return;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&ra_global.threads[i], NULL, readahead_worker, NULL) != 0)
+			break;
+	}
+	ra_global.nthreads = i;
+}
+
+/**
+ * Stops the worker threads.
+ */
+void readahead_cleanup(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&ra_global.mutex);
+	ra_global.quit = 1;
+	pthread_cond_broadcast(&ra_global.cond);
+	pthread_mutex_unlock(&ra_global.mutex);
+
+	for (i = 0; i < ra_global.nthreads; i++) {
+		pthread_join(ra_global.threads[i], NULL);
+	}
+	free(ra_global.threads);
+	ra_global.threads = NULL;
+	ra_global.nthreads = 0;
+}
+
+/**
+ * Creates the readahead state for an open file.
+ *
+ * @param fetch Function reading from the file.
+ * @param ctx Context passed to fetch.
+ *
+ * @return The new readahead state or NULL on error.
+ */
+struct readahead *readahead_new(readahead_fetch_cb_t fetch, void *ctx)
+{
+	struct readahead *ra = calloc(1, sizeof(struct readahead));
+
+	if (!ra)
+		return NULL;
+
+	pthread_mutex_init(&ra->read_lock, NULL);
+	pthread_mutex_init(&ra->mutex, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ra->fetch = fetch;
+	ra->ctx = ctx;
+	ra->window = READAHEAD_MIN_WINDOW;
+
+	return ra;
+}
+
+/**
+ * Frees the readahead state of a file, waiting for a background fill that
+ * might still be running.
+ */
+void readahead_free(struct readahead *ra)
+{
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->mutex);
+	cancel_next(ra);
+	pthread_mutex_unlock(&ra->mutex);
+
+	buffer_release(&ra->cur);
+	buffer_release(&ra->next);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->mutex);
+	pthread_mutex_destroy(&ra->read_lock);
+	free(ra);
+}
+
+/**
+ * Drops all buffered data, e.g. because the file was written to.
+ */
+void readahead_invalidate(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->read_lock);
+	pthread_mutex_lock(&ra->mutex);
+	cancel_next(ra);
+	ra->cur.valid = 0;
+	ra->next.valid = 0;
+	ra->eof = 0;
+	ra->window = READAHEAD_MIN_WINDOW;
+	pthread_mutex_unlock(&ra->mutex);
+	pthread_mutex_unlock(&ra->read_lock);
+}
+
+/**
+ * Reads from a file through its readahead buffers. Sequential access grows
+ * the readahead window up to the configured maximum, random access reads
+ * directly from the file.
+ *
+ * @return Number of bytes read, which is only less than size at the end
+ *    of the file, or a negative errno value.
+ */
+ssize_t readahead_read(struct readahead *ra, char *buf, size_t size, uint64_t offset)
+{
+	size_t done = 0;
+	ssize_t res = 0;
+	int sequential;
+
+	pthread_mutex_lock(&ra->read_lock);
+
+	/* the kernel may issue sequential reads slightly out of order */
+	sequential = (offset == ra->expected) || buffer_contains(&ra->cur, offset);
+	if (!sequential) {
+		ra->window = READAHEAD_MIN_WINDOW;
+	} else if (ra->window < ra_global.max_window) {
+		ra->window *= 2;
+		if (ra->window > ra_global.max_window)
+			ra->window = ra_global.max_window;
+	}
+
+	while (done < size) {
+		uint64_t pos = offset + done;
+		size_t left = size - done;
+
+		if (buffer_contains(&ra->cur, pos)) {
+			size_t avail = ra->cur.offset + ra->cur.len - pos;
+			size_t n = (avail < left) ? avail : left;
+			memcpy(buf + done, ra->cur.data + (pos - ra->cur.offset), n);
+			done += n;
+			continue;
+		}
+
+		/* take over data the worker threads prefetched */
+		pthread_mutex_lock(&ra->mutex);
+		while (ra->pending && pos >= ra->next.offset && pos < ra->next.offset + ra->next_want) {
+			pthread_cond_wait(&ra->cond, &ra->mutex);
+		}
+		if (!ra->pending && buffer_contains(&ra->next, pos)) {
+			struct ra_buffer tmp = ra->cur;
+			ra->cur = ra->next;
+			ra->next = tmp;
+			ra->next.valid = 0;
+			pthread_mutex_unlock(&ra->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&ra->mutex);
+
+		if (sequential) {
+			size_t want = (ra->window > left) ? ra->window : left;
+			/* a worker might be filling next, so only cur may be touched here */
+			size_t avail = buffer_reserve(&ra->cur, want);
+			if (avail >= left) {
+				ra->cur.valid = 0;
+				res = ra->fetch(ra->ctx, ra->cur.data, avail, pos);
+				if (res < 0)
+					break;
+				ra->cur.offset = pos;
+				ra->cur.len = res;
+				ra->cur.valid = (res > 0);
+				pthread_mutex_lock(&ra->mutex);
+				ra->eof = ((size_t)res < avail);
+				pthread_mutex_unlock(&ra->mutex);
+				if ((size_t)res < left) {
+					memcpy(buf + done, ra->cur.data, res);
+					done += res;
+					break;
+				}
+				continue;
+			}
+		}
+
+		/* random access or out of buffer memory: read directly */
+		res = ra->fetch(ra->ctx, buf + done, left, pos);
+		if (res < 0)
+			break;
+		done += res;
+		if ((size_t)res < left)
+			break;
+	}
+
+	ra->expected = offset + done;
+	if (sequential && done == size) {
+		pthread_mutex_lock(&ra->mutex);
+		if (!ra->pending && !(ra->next.valid && ra->next.offset == ra->cur.offset + ra->cur.len)) {
+			schedule_next(ra);
+		}
+		pthread_mutex_unlock(&ra->mutex);
+	}
+
+	pthread_mutex_unlock(&ra->read_lock);
+
+	if (done == 0 && res < 0)
+		return res;
+
+	return done;
+}
@@ -0,0 +1,78 @@
+/*
+ * readahead.h
+ * Sequential readahead for files opened through ifuse.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/* window used when sequential access is first detected */
+#define READAHEAD_MIN_WINDOW (128 * 1024)
+/* defaults for the largest window and the memory shared by all open files */
+#define READAHEAD_DEFAULT_MAX_WINDOW (4 * 1024 * 1024)
+#define READAHEAD_DEFAULT_MAX_MEMORY (64 * 1024 * 1024)
+
+/**
+ * Reads up to size bytes at offset from the underlying file.
+ *
+ * @return Number of bytes read, which is only less than size at the end
+ *    of the file, or a negative errno value.
+ */
+typedef ssize_t (*readahead_fetch_cb_t)(void *ctx, char *buf, size_t size, uint64_t offset);
+
+struct ra_buffer {
+	char *data;
+	size_t size;
+	uint64_t offset;
+	size_t len;
+	int valid;
+};
+
+struct readahead {
+	/* serializes readers of the same file */
+	pthread_mutex_t read_lock;
+	/* protects next, pending, queued and the eof state */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	readahead_fetch_cb_t fetch;
+	void *ctx;
+	struct ra_buffer cur;
+	struct ra_buffer next;
+	size_t next_want;
+	int pending;
+	int queued;
+	int eof;
+	uint64_t expected;
+	size_t window;
+	struct readahead *queue_next;
+};
+
+void readahead_init(unsigned int nthreads, size_t max_window, size_t max_memory);
+void readahead_cleanup(void);
+
+struct readahead *readahead_new(readahead_fetch_cb_t fetch, void *ctx);
+void readahead_free(struct readahead *ra);
+ssize_t readahead_read(struct readahead *ra, char *buf, size_t size, uint64_t offset);
+void readahead_invalidate(struct readahead *ra);
+
+#endif
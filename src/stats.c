@@ -0,0 +1,314 @@
+/*
+ * stats.c
+ * Per operation counters and latency histograms.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+/* bucket i counts latencies below 2^i microseconds */
+#define STATS_BUCKETS 32
+/* errno values above this are counted together */
+#define STATS_MAX_ERRNO 134
+
+struct op_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t max_ns;
+	uint64_t total_ns;
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t errnos[STATS_MAX_ERRNO + 1];
+};
+
+static const char *op_names[STATS_OP_COUNT] = {
+	"getattr",
+	"readdir",
+	"open",
+	"create",
+	"read",
+	"write",
+	"flush",
+	"fsync",
+	"release",
+	"statfs",
+	"truncate",
+	"readlink",
+	"symlink",
+	"link",
+	"unlink",
+	"rmdir",
+	"rename",
+	"mkdir",
+	"utimens",
+	"chmod",
+	"chown",
+	"getxattr",
+	"listxattr",
+	"opendir",
+	"releasedir",
+	"setxattr"
+};
+
+static struct op_stats stats[STATS_OP_COUNT];
+static uint64_t start_time = 0;
+static char *dump_path = NULL;
+static int signal_pipe[2] = { -1, -1 };
+static pthread_t signal_thread;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the start time of an operation to pass to stats_end().
+ */
+uint64_t stats_begin(void)
+{
+	return now_ns();
+}
+
+/**
+ * Records a finished operation.
+ *
+ * @param op The operation.
+ * @param start Value returned by stats_begin() when the operation started.
+ * @param res Result of the operation: a negative errno value on failure,
+ *    otherwise the number of bytes transferred for read and write.
+ */
+void stats_end(enum stats_op op, uint64_t start, int res)
+{
+	struct op_stats *s = &stats[op];
+	uint64_t elapsed = now_ns() - start;
+	uint64_t us = elapsed / 1000;
+	uint64_t max;
+	int bucket = 0;
+
+	while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket))
+		bucket++;
+
+	__atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->total_ns, elapsed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+	if (res < 0) {
+		int e = -res;
+		__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->errnos[(e > STATS_MAX_ERRNO) ? 0 : e], 1, __ATOMIC_RELAXED);
+	} else if (op == STATS_OP_READ || op == STATS_OP_WRITE) {
+		__atomic_add_fetch(&s->bytes, (uint64_t)res, __ATOMIC_RELAXED);
+	}
+
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (elapsed > max) {
+		if (__atomic_compare_exchange_n(&s->max_ns, &max, elapsed, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* upper bound in microseconds of the bucket holding the given percentile */
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, unsigned int pct)
+{
+	uint64_t rank = (count * pct + 99) / 100;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank && seen > 0)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+/**
+ * Returns the name of an operation as used in the statistics.
+ */
+const char *stats_op_name(enum stats_op op)
+{
+	return (op < STATS_OP_COUNT) ? op_names[op] : "unknown";
+}
+
+/**
+ * Formats all counters as JSON.
+ *
+ * @param length Receives the length of the returned string.
+ *
+ * @return A string the caller has to free, or NULL on error.
+ */
+char *stats_to_json(size_t *length)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	int i, e;
+
+	if (!f)
+		return NULL;
+
+	fprintf(f, "{\n  \"uptime\": %.3f,\n  \"operations\": {", (now_ns() - start_time) / 1e9);
+	for (i = 0; i < STATS_OP_COUNT; i++) {
+		struct op_stats s;
+		int first = 1;
+
+		/* a consistent snapshot is not needed, the counters only grow */
+		memcpy(&s, &stats[i], sizeof(s));
+		fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, \"bytes\": %llu, ",
+			(i > 0) ? "," : "", op_names[i],
+			(unsigned long long)s.count, (unsigned long long)s.errors, (unsigned long long)s.bytes);
+		fprintf(f, "\"latency_us\": {\"avg\": %llu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}, \"errno\": {",
+			(unsigned long long)(s.count ? s.total_ns / s.count / 1000 : 0),
+			(unsigned long long)percentile(s.buckets, s.count, 50),
+			(unsigned long long)percentile(s.buckets, s.count, 99),
+			(unsigned long long)(s.max_ns / 1000));
+		for (e = 0; e <= STATS_MAX_ERRNO; e++) {
+			if (s.errnos[e] == 0)
+				continue;
+			fprintf(f, "%s\"%d\": %llu", first ? "" : ", ", e, (unsigned long long)s.errnos[e]);
+			first = 0;
+		}
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n  }\n}\n");
+	fclose(f);
+
+	if (length)
+		*length = len;
+
+	return buf;
+}
+
+/**
+ * Writes the counters to the file given to stats_init(), or to stderr.
+ */
+void stats_dump(void)
+{
+	size_t len = 0;
+	char *json = stats_to_json(&len);
+	FILE *f = stderr;
+
+	if (!json)
+		return;
+
+	if (dump_path) {
+		f = fopen(dump_path, "w");
+		if (!f) {
+			fprintf(stderr, "ERROR: Could not write statistics to %s: %s\n", dump_path, strerror(errno));
+			free(json);
+			return;
+		}
+	}
+	fwrite(json, 1, len, f);
+	if (f != stderr) {
+		fclose(f);
+	} else {
+		fflush(f);
+	}
+	free(json);
+}
+
+static void sigusr1_handler(int sig)
+{
+	char c = 'd';
+	ssize_t res = write(signal_pipe[1], &c, 1);
+	(void)res;
+}
+
+/* dumps the statistics outside of signal context whenever SIGUSR1 arrives */
+static void *signal_thread_func(void *arg)
+{
+	char c;
+
+	while (read(signal_pipe[0], &c, 1) == 1 && c == 'd') {
+		stats_dump();
+	}
+
+	return NULL;
+}
+
+/**
+ * Resets all counters and installs a SIGUSR1 handler that dumps them.
+ *
+ * @param dump_file File to write the statistics to, or NULL to write them
+ *    to stderr on SIGUSR1 only.
+ */
+void stats_init(const char *dump_file)
+{
+	struct sigaction sa;
+
+	memset(stats, 0, sizeof(stats));
+	start_time = now_ns();
+	dump_path = dump_file ? strdup(dump_file) : NULL;
+
+	if (pipe(signal_pipe) < 0) {
+		signal_pipe[0] = signal_pipe[1] = -1;
+		return;
+	}
+	if (pthread_create(&signal_thread, NULL, signal_thread_func, NULL) != 0) {
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
+		signal_pipe[0] = signal_pipe[1] = -1;
+		return;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigusr1_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/**
+ * Dumps the counters a last time if a dump file was given and removes the
+ * SIGUSR1 handler.
+ */
+void stats_cleanup(void)
+{
+	if (signal_pipe[1] >= 0) {
+		char c = 'q';
+		signal(SIGUSR1, SIG_IGN);
+		if (write(signal_pipe[1], &c, 1) == 1) {
+			pthread_join(signal_thread, NULL);
+		}
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
+		signal_pipe[0] = signal_pipe[1] = -1;
+	}
+
+	if (dump_path) {
+		stats_dump();
+	}
+
+	free(dump_path);
+	dump_path = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ * stats.h
+ * Per operation counters and latency histograms.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum stats_op {
+	STATS_OP_GETATTR = 0,
+	STATS_OP_READDIR,
+	STATS_OP_OPEN,
+	STATS_OP_CREATE,
+	STATS_OP_READ,
+	STATS_OP_WRITE,
+	STATS_OP_FLUSH,
+	STATS_OP_FSYNC,
+	STATS_OP_RELEASE,
+	STATS_OP_STATFS,
+	STATS_OP_TRUNCATE,
+	STATS_OP_READLINK,
+	STATS_OP_SYMLINK,
+	STATS_OP_LINK,
+	STATS_OP_UNLINK,
+	STATS_OP_RMDIR,
+	STATS_OP_RENAME,
+	STATS_OP_MKDIR,
+	STATS_OP_UTIMENS,
+	STATS_OP_CHMOD,
+	STATS_OP_CHOWN,
+	STATS_OP_GETXATTR,
+	STATS_OP_LISTXATTR,
+	STATS_OP_OPENDIR,
+	STATS_OP_RELEASEDIR,
+	STATS_OP_SETXATTR,
+	STATS_OP_COUNT
+};
+
+void stats_init(const char *dump_file);
+void stats_cleanup(void);
+
+uint64_t stats_begin(void);
+void stats_end(enum stats_op op, uint64_t start, int res);
+
+const char *stats_op_name(enum stats_op op);
+char *stats_to_json(size_t *length);
+void stats_dump(void);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * sumcache.c
+ * Checksums of device files, remembered by path, size and mtime.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sumcache.h"
+#include "chunkcache.h"
+
+/* the checksums are stored with the content cache under this chunk index */
+#define SUMCACHE_CHUNK_INDEX UINT64_MAX
+/* SHA-256 followed by the CRC32C in big endian */
+#define SUMCACHE_RECORD_SIZE (CHECKSUM_SHA256_LEN + 4)
+
+#define SUMCACHE_BUCKETS 1024
+
+/*
+ * The keys are the ones of the content cache (see chunkcache_key()), so a
+ * file that changed on the device is not found any more. With cache_dir
+ * the checksums are also stored there and survive a remount.
+ */
+struct sum_entry {
+	char *key;
+	struct checksum sum;
+	struct sum_entry *next;
+	/* insertion order, for dropping the oldest entry */
+	struct sum_entry *older;
+	struct sum_entry *newer;
+};
+
+static pthread_mutex_t sumcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sum_entry *buckets[SUMCACHE_BUCKETS];
+static struct sum_entry *oldest = NULL;
+static struct sum_entry *newest = NULL;
+static unsigned int count = 0;
+
+static unsigned int key_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	while (*key) {
+		h = (h ^ (uint8_t)*key++) * 16777619u;
+	}
+
+	return h % SUMCACHE_BUCKETS;
+}
+
+static struct sum_entry *lookup(const char *key)
+{
+	struct sum_entry *e;
+
+	for (e = buckets[key_hash(key)]; e; e = e->next) {
+		if (!strcmp(e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void unlink_entry(struct sum_entry *e)
+{
+	struct sum_entry **pp = &buckets[key_hash(e->key)];
+
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	count--;
+}
+
+static void insert(const char *key, const struct checksum *sum)
+{
+	struct sum_entry *e = lookup(key);
+	unsigned int h;
+
+	if (e) {
+		e->sum = *sum;
+		return;
+	}
+	e = calloc(1, sizeof(struct sum_entry));
+	if (!e)
+		return;
+	e->key = strdup(key);
+	if (!e->key) {
+		free(e);
+		return;
+	}
+	e->sum = *sum;
+
+	if (count >= SUMCACHE_MAX_ENTRIES) {
+		struct sum_entry *old = oldest;
+		unlink_entry(old);
+		free(old->key);
+		free(old);
+	}
+	h = key_hash(key);
+	e->next = buckets[h];
+	buckets[h] = e;
+	e->older = newest;
+	if (newest)
+		newest->newer = e;
+	else
+		oldest = e;
+	newest = e;
+	count++;
+}
+
+/**
+ * Looks up the checksums of a file.
+ *
+ * @param key The key of the file, see chunkcache_key().
+ * @param sum Receives the checksums.
+ *
+ * @return 1 if they are known, 0 otherwise.
+ */
+int sumcache_get(const char *key, struct checksum *sum)
+{
+	uint8_t rec[SUMCACHE_RECORD_SIZE];
+	struct sum_entry *e;
+
+	pthread_mutex_lock(&sumcache_mutex);
+	e = lookup(key);
+	if (e) {
+		*sum = e->sum;
+	}
+	pthread_mutex_unlock(&sumcache_mutex);
+	if (e)
+		return 1;
+
+	if (!chunkcache_enabled() || chunkcache_get(key, SUMCACHE_CHUNK_INDEX, 0, (char*)rec, sizeof(rec)) != (ssize_t)sizeof(rec))
+		return 0;
+	memcpy(sum->sha256, rec, CHECKSUM_SHA256_LEN);
+	sum->crc32c = ((uint32_t)rec[32] << 24) | ((uint32_t)rec[33] << 16) | ((uint32_t)rec[34] << 8) | rec[35];
+
+	pthread_mutex_lock(&sumcache_mutex);
+	insert(key, sum);
+	pthread_mutex_unlock(&sumcache_mutex);
+
+	return 1;
+}
+
+/**
+ * Remembers the checksums of a file.
+ *
+ * @param key The key of the file, see chunkcache_key().
+ * @param sum The checksums.
+ */
+void sumcache_put(const char *key, const struct checksum *sum)
+{
+	uint8_t rec[SUMCACHE_RECORD_SIZE];
+
+	pthread_mutex_lock(&sumcache_mutex);
+	insert(key, sum);
+	pthread_mutex_unlock(&sumcache_mutex);
+
+	if (chunkcache_enabled()) {
+		memcpy(rec, sum->sha256, CHECKSUM_SHA256_LEN);
+		rec[32] = (uint8_t)(sum->crc32c >> 24);
+		rec[33] = (uint8_t)(sum->crc32c >> 16);
+		rec[34] = (uint8_t)(sum->crc32c >> 8);
+		rec[35] = (uint8_t)sum->crc32c;
+		chunkcache_put(key, SUMCACHE_CHUNK_INDEX, (const char*)rec, sizeof(rec));
+	}
+}
+
+void sumcache_cleanup(void)
+{
+	pthread_mutex_lock(&sumcache_mutex);
+	while (oldest) {
+		struct sum_entry *e = oldest;
+		oldest = e->newer;
+		free(e->key);
+		free(e);
+	}
+	newest = NULL;
+	memset(buckets, 0, sizeof(buckets));
+	count = 0;
+	pthread_mutex_unlock(&sumcache_mutex);
+}
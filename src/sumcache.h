@@ -0,0 +1,34 @@
+/*
+ * sumcache.h
+ * Checksums of device files, remembered by path, size and mtime.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SUMCACHE_H
+#define __SUMCACHE_H
+
+#include "checksum.h"
+
+/* checksums kept in memory, the oldest ones are dropped first */
+#define SUMCACHE_MAX_ENTRIES 4096
+
+int sumcache_get(const char *key, struct checksum *sum);
+void sumcache_put(const char *key, const struct checksum *sum);
+void sumcache_cleanup(void);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * trace.c
+ * Binary traces of the operations served by the mount.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* size of the buffer of each thread, written to the file when it is full */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/* initial number of paths each thread remembers as written */
+#define TRACE_SEEN_INITIAL 256
+
+/*
+ * Every thread collects its records in a buffer of its own, so recording
+ * an operation takes no lock. A full buffer is written with a single
+ * write() to the file, which is opened with O_APPEND so that the buffers of
+ * different threads do not overwrite each other. The records of a trace
+ * are thus only ordered within each buffer; readers sort them by start.
+ */
+struct trace_buffer {
+	char data[TRACE_BUFFER_SIZE];
+	size_t len;
+	/* open addressed set of the ids of the paths this thread wrote */
+	uint64_t *seen;
+	size_t seen_size;
+	size_t seen_count;
+	struct trace_buffer *prev;
+	struct trace_buffer *next;
+};
+
+static struct {
+	/* -1 while not tracing */
+	int fd;
+	uint64_t started;
+	pthread_key_t key;
+	/* protects the list of buffers */
+	pthread_mutex_t mutex;
+	struct trace_buffer *buffers;
+} trace = { -1, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a, 0 is reserved for operations without a path */
+static uint64_t path_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 1099511628211ULL;
+	}
+	return (h) ? h : 1;
+}
+
+static void trace_flush(struct trace_buffer *buf)
+{
+	size_t done = 0;
+
+	while (done < buf->len) {
+		ssize_t res = write(trace.fd, buf->data + done, buf->len - done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		done += res;
+	}
+	buf->len = 0;
+}
+
+/* called when a thread that recorded operations exits */
+static void trace_buffer_free(void *data)
+{
+	struct trace_buffer *buf = (struct trace_buffer*)data;
+
+	pthread_mutex_lock(&trace.mutex);
+	if (trace.fd >= 0) {
+		trace_flush(buf);
+	}
+	if (buf->prev) {
+		buf->prev->next = buf->next;
+	} else {
+		trace.buffers = buf->next;
+	}
+	if (buf->next) {
+		buf->next->prev = buf->prev;
+	}
+	pthread_mutex_unlock(&trace.mutex);
+
+	free(buf->seen);
+	free(buf);
+}
+
+static struct trace_buffer *trace_buffer(void)
+{
+	struct trace_buffer *buf = pthread_getspecific(trace.key);
+
+	if (buf)
+		return buf;
+
+	buf = calloc(1, sizeof(struct trace_buffer));
+	if (!buf)
+		return NULL;
+	buf->seen = calloc(TRACE_SEEN_INITIAL, sizeof(uint64_t));
+	if (!buf->seen) {
+		free(buf);
+		return NULL;
+	}
+	buf->seen_size = TRACE_SEEN_INITIAL;
+	pthread_setspecific(trace.key, buf);
+
+	pthread_mutex_lock(&trace.mutex);
+	buf->next = trace.buffers;
+	if (buf->next) {
+		buf->next->prev = buf;
+	}
+	trace.buffers = buf;
+	pthread_mutex_unlock(&trace.mutex);
+
+	return buf;
+}
+
+/* makes room for len bytes in the buffer */
+static char *trace_reserve(struct trace_buffer *buf, size_t len)
+{
+	char *p;
+
+	if (buf->len + len > TRACE_BUFFER_SIZE) {
+		trace_flush(buf);
+	}
+	p = buf->data + buf->len;
+	buf->len += len;
+
+	return p;
+}
+
+/**
+ * Adds an id to the set of paths written by this thread.
+ *
+ * @return 1 if it was added, 0 if it was in the set already.
+ */
+static int trace_seen_add(struct trace_buffer *buf, uint64_t id)
+{
+	size_t i;
+
+	if (2 * (buf->seen_count + 1) > buf->seen_size) {
+		uint64_t *seen = calloc(2 * buf->seen_size, sizeof(uint64_t));
+		if (seen) {
+			size_t mask = 2 * buf->seen_size - 1;
+			for (i = 0; i < buf->seen_size; i++) {
+				size_t j;
+				if (!buf->seen[i])
+					continue;
+				for (j = buf->seen[i] & mask; seen[j]; j = (j + 1) & mask);
+				seen[j] = buf->seen[i];
+			}
+			free(buf->seen);
+			buf->seen = seen;
+			buf->seen_size *= 2;
+		} else if (buf->seen_count + 1 >= buf->seen_size) {
+			/* write the path again rather than losing it */
+			return 1;
+		}
+	}
+
+	for (i = id & (buf->seen_size - 1); buf->seen[i]; i = (i + 1) & (buf->seen_size - 1)) {
+		if (buf->seen[i] == id)
+			return 0;
+	}
+	buf->seen[i] = id;
+	buf->seen_count++;
+
+	return 1;
+}
+
+/**
+ * Returns the id of a path, writing the path to the buffer first if the
+ * calling thread did not write it yet.
+ */
+static uint64_t trace_path_write(struct trace_buffer *buf, const char *path)
+{
+	uint64_t id;
+	size_t len;
+	struct trace_path rec;
+	char *p;
+
+	if (!path)
+		return 0;
+	id = path_hash(path);
+	len = strlen(path);
+	if (len > UINT16_MAX || !trace_seen_add(buf, id))
+		return id;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = TRACE_PATH;
+	rec.len = len;
+	rec.id = id;
+	p = trace_reserve(buf, sizeof(rec) + ((len + 7) & ~(size_t)7));
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), path, len);
+	memset(p + sizeof(rec) + len, 0, ((len + 7) & ~(size_t)7) - len);
+
+	return id;
+}
+
+/**
+ * Starts writing a trace.
+ *
+ * @param path The file to write, it is replaced if it exists.
+ *
+ * @return 0 on success, -1 if the file could not be created.
+ */
+int trace_init(const char *path)
+{
+	struct trace_header header;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0)
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header.version = TRACE_VERSION;
+	header.started = now_ns(CLOCK_REALTIME);
+	if (write(fd, &header, sizeof(header)) != sizeof(header) || pthread_key_create(&trace.key, trace_buffer_free) != 0) {
+		close(fd);
+		return -1;
+	}
+	trace.started = now_ns(CLOCK_MONOTONIC);
+	trace.fd = fd;
+
+	return 0;
+}
+
+/**
+ * Writes the records that are still buffered and closes the trace. No
+ * operations may be recorded anymore at this point.
+ */
+void trace_cleanup(void)
+{
+	struct trace_buffer *buf;
+
+	if (trace.fd < 0)
+		return;
+
+	pthread_mutex_lock(&trace.mutex);
+	while ((buf = trace.buffers) != NULL) {
+		trace.buffers = buf->next;
+		trace_flush(buf);
+		free(buf->seen);
+		free(buf);
+	}
+	close(trace.fd);
+	trace.fd = -1;
+	pthread_mutex_unlock(&trace.mutex);
+
+	pthread_key_delete(trace.key);
+}
+
+/**
+ * Returns the id of a path, writing the path to the trace if the calling
+ * thread did not do so yet. Used for operations with a second path.
+ *
+ * @return The id, 0 if path is NULL or no trace is written.
+ */
+uint64_t trace_path(const char *path)
+{
+	struct trace_buffer *buf;
+
+	if (trace.fd < 0)
+		return 0;
+	buf = trace_buffer();
+	if (!buf)
+		return 0;
+
+	return trace_path_write(buf, path);
+}
+
+/**
+ * Records a finished operation, if a trace is written.
+ *
+ * @param op The operation.
+ * @param path The path the operation was on.
+ * @param fh The file handle, 0 if the operation is not on an open file.
+ * @param offset The offset, or another argument, see trace.h.
+ * @param size The size, or another argument, see trace.h.
+ * @param start Value returned by stats_begin() when the operation started.
+ * @param res Result of the operation.
+ */
+void trace_op(enum stats_op op, const char *path, uint64_t fh, uint64_t offset, uint64_t size, uint64_t start, int res)
+{
+	struct trace_buffer *buf;
+	struct trace_op rec;
+	uint64_t end;
+
+	if (trace.fd < 0)
+		return;
+	end = now_ns(CLOCK_MONOTONIC);
+	buf = trace_buffer();
+	if (!buf)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = TRACE_OP;
+	rec.op = op;
+	rec.result = res;
+	rec.path = trace_path_write(buf, path);
+	rec.fh = fh;
+	rec.offset = offset;
+	rec.size = size;
+	rec.start = (start > trace.started) ? start - trace.started : 0;
+	rec.duration = end - start;
+	memcpy(trace_reserve(buf, sizeof(rec)), &rec, sizeof(rec));
+}
@@ -0,0 +1,98 @@
+/*
+ * trace.h
+ * Binary traces of the operations served by the mount.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * A trace file starts with a struct trace_header, followed by records in
+ * the byte order of the machine that wrote it. Every record starts with its
+ * type and is a multiple of 8 bytes long. Paths are identified by a 64 bit
+ * hash; the first time a thread records an operation on a path, the path
+ * itself is written in a struct trace_path before it.
+ *
+ * Besides the path, offset and size of an operation, some operations store
+ * their other arguments in these fields, so that they can be replayed:
+ *
+ *   open, create   size: open flags, offset: mode (create only)
+ *   mkdir, chmod   offset: mode
+ *   truncate       offset: new size
+ *   chown          offset: uid, size: gid
+ *   fsync          size: datasync
+ *   readdir        size: readdir flags
+ *   rename         offset: id of the new path, size: rename flags
+ *   symlink, link  path: the new link, offset: id of the target
+ *   *xattr         offset: id of the attribute name, size: buffer size
+ */
+
+#define TRACE_MAGIC "IFTRACE"
+#define TRACE_VERSION 1
+
+enum trace_type {
+	TRACE_OP = 1,
+	TRACE_PATH
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	/* wall clock time the trace was started at, in ns since the epoch */
+	uint64_t started;
+};
+
+struct trace_op {
+	uint8_t type;
+	/* enum stats_op */
+	uint8_t op;
+	uint16_t reserved;
+	/* the result returned to fuse, a negative errno value on failure */
+	int32_t result;
+	uint64_t path;
+	/* the file handle, 0 if the operation is not on an open file */
+	uint64_t fh;
+	uint64_t offset;
+	uint64_t size;
+	/* ns since the trace was started */
+	uint64_t start;
+	uint64_t duration;
+};
+
+struct trace_path {
+	uint8_t type;
+	uint8_t reserved;
+	/* length of the path, which follows padded with NULs to 8 bytes */
+	uint16_t len;
+	uint32_t reserved2;
+	uint64_t id;
+};
+
+int trace_init(const char *path);
+void trace_cleanup(void);
+
+uint64_t trace_path(const char *path);
+void trace_op(enum stats_op op, const char *path, uint64_t fh, uint64_t offset, uint64_t size, uint64_t start, int res);
+
+#endif
@@ -0,0 +1,964 @@
+/*
+ * treeindex.c
+ * Persistent index of the whole directory tree of a device.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "treeindex.h"
+
+/*
+ * The index is a trie of path components. Every node carries the packed
+ * attributes of its entry and, for a directory, its entries sorted by name
+ * together with the modification time of the directory they were listed
+ * at. Adding or removing an entry changes that time, so a listing from an
+ * earlier mount is confirmed with a single request for the attributes of
+ * the directory. Only a directory confirmed less than the timeout ago
+ * answers lookups, for its own attributes, its listing and its entries.
+ * Writing to a file does not change the modification time of its
+ * directory, so the attributes of a file only answer lookups for the
+ * timeout after they were retrieved from the device, like those in the
+ * metadata cache do for attr_timeout.
+ *
+ * On disk the nodes are stored in preorder: the header, then for every
+ * node its record, its name and the nodes of its entries.
+ */
+
+/* "itre" */
+#define INDEX_MAGIC 0x65727469
+#define INDEX_VERSION 2
+
+/* deeper trees are not loaded, which bounds the recursion */
+#define INDEX_MAX_DEPTH (PATH_MAX / 2)
+
+/* the device stores modification times in seconds, so a listing taken
+ * while the modification time of its directory was this recent might miss
+ * a change made in the same second; it is not trusted on the next check */
+#define INDEX_RACY_SECONDS 2
+
+/* the entries of a directory have to be listed again */
+#define UNLISTED INT64_MIN
+
+struct index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+};
+
+struct index_record {
+	uint64_t size;
+	uint64_t blocks;
+	int64_t mtime;
+	int64_t listed;
+	int64_t fetched;
+	uint32_t mode;
+	uint32_t nlink;
+	/* number of entries whose nodes follow */
+	uint32_t count;
+	uint16_t namelen;
+	uint16_t reserved;
+};
+
+struct index_node {
+	char *name;
+	/* sorted by name */
+	struct index_node **entries;
+	uint32_t count;
+	uint32_t capacity;
+	/* attributes, not known if mode is 0 */
+	uint64_t size;
+	uint64_t blocks;
+	int64_t mtime;
+	uint32_t mode;
+	uint32_t nlink;
+	/* modification time of the directory when its entries were listed */
+	int64_t listed;
+	/* wall clock time the attributes were retrieved from the device */
+	int64_t fetched;
+	/* when the entries were confirmed during this mount, 0 if not yet */
+	double checked;
+};
+
+struct treeindex {
+	pthread_mutex_t mutex;
+	/* taken before mutex, keeps saves in order */
+	pthread_mutex_t save_mutex;
+	char *file;
+	double timeout;
+	struct index_node *root;
+	/* number of changes since it was loaded or saved, 0 if none */
+	unsigned int dirty;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct index_node *node_new(const char *name, size_t len)
+{
+	struct index_node *node = calloc(1, sizeof(struct index_node));
+
+	if (!node)
+		return NULL;
+	node->name = strndup(name, len);
+	if (!node->name) {
+		free(node);
+		return NULL;
+	}
+	node->listed = UNLISTED;
+
+	return node;
+}
+
+static void node_free_entries(struct index_node *node)
+{
+	uint32_t i;
+
+	for (i = 0; i < node->count; i++) {
+		node_free_entries(node->entries[i]);
+		free(node->entries[i]->name);
+		free(node->entries[i]);
+	}
+	free(node->entries);
+	node->entries = NULL;
+	node->count = 0;
+	node->capacity = 0;
+	node->listed = UNLISTED;
+}
+
+static void node_free(struct index_node *node)
+{
+	if (!node)
+		return;
+	node_free_entries(node);
+	free(node->name);
+	free(node);
+}
+
+static int compare_name(const char *a, const char *b, size_t len)
+{
+	int cmp = strncmp(a, b, len);
+
+	return (cmp == 0 && a[len] != '\0') ? 1 : cmp;
+}
+
+/**
+ * Finds an entry of a directory.
+ *
+ * @param dir The directory.
+ * @param name The name, not necessarily NUL terminated.
+ * @param len Length of name.
+ * @param pos Receives the position of the entry, or where it belongs if
+ *    it does not exist. Can be NULL.
+ *
+ * @return The entry or NULL.
+ */
+static struct index_node *find_entry(struct index_node *dir, const char *name, size_t len, uint32_t *pos)
+{
+	uint32_t lo = 0;
+	uint32_t hi = dir->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = compare_name(dir->entries[mid]->name, name, len);
+		if (cmp == 0) {
+			lo = mid;
+			break;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+
+	return (lo < dir->count && compare_name(dir->entries[lo]->name, name, len) == 0) ? dir->entries[lo] : NULL;
+}
+
+/* looks up the node of the first len characters of path */
+static struct index_node *lookup_len(struct treeindex *idx, const char *path, size_t len)
+{
+	struct index_node *node = idx->root;
+	const char *end = path + len;
+
+	while (node && path < end) {
+		size_t n;
+		while (path < end && *path == '/')
+			path++;
+		n = 0;
+		while (path + n < end && path[n] != '/')
+			n++;
+		if (n == 0)
+			break;
+		node = find_entry(node, path, n, NULL);
+		path += n;
+	}
+
+	return node;
+}
+
+static struct index_node *lookup(struct treeindex *idx, const char *path)
+{
+	return lookup_len(idx, path, strlen(path));
+}
+
+/**
+ * Looks up the directory containing path.
+ *
+ * @param idx The index.
+ * @param path The path.
+ * @param name Receives the last component of path.
+ * @param len Receives the length of name, 0 for the root directory.
+ *
+ * @return The directory or NULL if it is not in the index.
+ */
+static struct index_node *lookup_parent(struct treeindex *idx, const char *path, const char **name, size_t *len)
+{
+	const char *slash = strrchr(path, '/');
+
+	*name = (slash) ? slash + 1 : path;
+	*len = strlen(*name);
+	if (*len == 0)
+		return NULL;
+
+	return lookup_len(idx, path, *name - path);
+}
+
+static int is_valid(struct treeindex *idx, struct index_node *node)
+{
+	return node->checked > 0 && now() - node->checked < idx->timeout;
+}
+
+static int is_fresh(struct treeindex *idx, struct index_node *node)
+{
+	time_t t = time(NULL);
+
+	return node->fetched <= (int64_t)t && t - node->fetched < idx->timeout;
+}
+
+static int is_racy(const struct stat *st)
+{
+	return st->st_mtime >= time(NULL) - INDEX_RACY_SECONDS;
+}
+
+/* stores the attributes of st in node and tells whether they changed */
+static int set_attr(struct index_node *node, const struct stat *st)
+{
+	int changed = (node->size != (uint64_t)st->st_size || node->blocks != (uint64_t)st->st_blocks
+		|| node->mtime != (int64_t)st->st_mtime || node->mode != (uint32_t)st->st_mode || node->nlink != (uint32_t)st->st_nlink);
+
+	if (node->mode && S_ISDIR(node->mode) && !S_ISDIR(st->st_mode)) {
+		/* a directory was replaced by a file */
+		node_free_entries(node);
+		node->checked = 0;
+	}
+	node->size = st->st_size;
+	node->blocks = st->st_blocks;
+	node->mtime = st->st_mtime;
+	node->mode = st->st_mode;
+	node->nlink = st->st_nlink;
+	node->fetched = time(NULL);
+	if (S_ISDIR(st->st_mode) && node->listed != (int64_t)st->st_mtime) {
+		node->checked = 0;
+	}
+
+	return changed;
+}
+
+static void get_attr(struct index_node *node, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_size = node->size;
+	st->st_blocks = node->blocks;
+	st->st_mtime = node->mtime;
+	st->st_mode = node->mode;
+	st->st_nlink = node->nlink;
+}
+
+/* marks node and everything below it as not confirmed */
+static void uncheck_tree(struct index_node *node)
+{
+	uint32_t i;
+
+	node->checked = 0;
+	for (i = 0; i < node->count; i++) {
+		uncheck_tree(node->entries[i]);
+	}
+}
+
+static uint64_t count_nodes(struct index_node *node)
+{
+	uint64_t count = 1;
+	uint32_t i;
+
+	for (i = 0; i < node->count; i++) {
+		count += count_nodes(node->entries[i]);
+	}
+
+	return count;
+}
+
+static int write_node(FILE *f, struct index_node *node)
+{
+	struct index_record rec;
+	uint32_t i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.size = node->size;
+	rec.blocks = node->blocks;
+	rec.mtime = node->mtime;
+	rec.listed = node->listed;
+	rec.fetched = node->fetched;
+	rec.mode = node->mode;
+	rec.nlink = node->nlink;
+	rec.count = node->count;
+	rec.namelen = strlen(node->name);
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(node->name, 1, rec.namelen, f) != rec.namelen)
+		return -1;
+	for (i = 0; i < node->count; i++) {
+		if (write_node(f, node->entries[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads a node and the nodes of its entries.
+ *
+ * @param f The index file.
+ * @param left Number of nodes the header announced and that were not
+ *    read yet.
+ * @param depth Depth of the node in the tree.
+ *
+ * @return The node, or NULL if the file is broken or out of memory.
+ */
+static struct index_node *read_node(FILE *f, uint64_t *left, unsigned int depth)
+{
+	struct index_record rec;
+	struct index_node *node;
+	uint32_t i;
+
+	if (*left == 0 || depth > INDEX_MAX_DEPTH || fread(&rec, sizeof(rec), 1, f) != 1)
+		return NULL;
+	(*left)--;
+	/* only the root has no name */
+	if ((depth == 0) != (rec.namelen == 0) || rec.count > *left)
+		return NULL;
+
+	node = calloc(1, sizeof(struct index_node));
+	if (!node)
+		return NULL;
+	node->name = malloc(rec.namelen + 1);
+	if (!node->name || fread(node->name, 1, rec.namelen, f) != rec.namelen || memchr(node->name, '/', rec.namelen)) {
+		free(node->name);
+		free(node);
+		return NULL;
+	}
+	node->name[rec.namelen] = '\0';
+	node->size = rec.size;
+	node->blocks = rec.blocks;
+	node->mtime = rec.mtime;
+	node->listed = rec.listed;
+	node->fetched = rec.fetched;
+	node->mode = rec.mode;
+	node->nlink = rec.nlink;
+
+	if (rec.count > 0) {
+		node->entries = malloc(rec.count * sizeof(struct index_node*));
+		if (!node->entries) {
+			node_free(node);
+			return NULL;
+		}
+		node->capacity = rec.count;
+	}
+	for (i = 0; i < rec.count; i++) {
+		struct index_node *entry = read_node(f, left, depth + 1);
+		/* lookups rely on the order */
+		if (entry && node->count > 0 && strcmp(node->entries[node->count - 1]->name, entry->name) >= 0) {
+			node_free(entry);
+			entry = NULL;
+		}
+		if (!entry) {
+			node_free(node);
+			return NULL;
+		}
+		node->entries[node->count++] = entry;
+	}
+
+	return node;
+}
+
+/**
+ * Loads the index stored in file, or starts an empty one if it does not
+ * exist or can not be read. Nothing of it is trusted before it is
+ * confirmed with treeindex_check_dir() or treeindex_put_dir().
+ *
+ * @param file Where the index is stored.
+ * @param timeout Seconds a confirmed directory answers lookups before it
+ *    has to be checked again.
+ *
+ * @return The index or NULL when out of memory.
+ */
+treeindex_t treeindex_open(const char *file, double timeout)
+{
+	struct index_header header;
+	treeindex_t idx = calloc(1, sizeof(struct treeindex));
+	FILE *f;
+
+	if (!idx)
+		return NULL;
+	idx->file = strdup(file);
+	if (!idx->file) {
+		free(idx);
+		return NULL;
+	}
+	idx->timeout = timeout;
+	pthread_mutex_init(&idx->mutex, NULL);
+	pthread_mutex_init(&idx->save_mutex, NULL);
+
+	f = fopen(file, "rb");
+	if (f) {
+		if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == INDEX_MAGIC && header.version == INDEX_VERSION) {
+			idx->root = read_node(f, &header.count, 0);
+		}
+		fclose(f);
+		/* replace a broken index or one of another version */
+		idx->dirty = (idx->root == NULL);
+	}
+	if (!idx->root) {
+		idx->root = node_new("", 0);
+	}
+	if (!idx->root) {
+		treeindex_free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+/**
+ * Writes the index to its file if it changed. The index is serialized into
+ * memory, so lookups only wait for that and not for the disk. A new file
+ * is written and then renamed, so an interrupted save leaves the previous
+ * index intact.
+ *
+ * @return 0 on success or -1 on error.
+ */
+int treeindex_save(treeindex_t idx)
+{
+	struct index_header header;
+	char tmp[PATH_MAX];
+	char *buf = NULL;
+	size_t len = 0;
+	unsigned int changes;
+	int res = 0;
+	FILE *f;
+	int fd;
+
+	if (!idx)
+		return -1;
+
+	pthread_mutex_lock(&idx->save_mutex);
+	pthread_mutex_lock(&idx->mutex);
+	changes = idx->dirty;
+	if (changes) {
+		f = open_memstream(&buf, &len);
+		header.magic = INDEX_MAGIC;
+		header.version = INDEX_VERSION;
+		header.count = count_nodes(idx->root);
+		if (!f || fwrite(&header, sizeof(header), 1, f) != 1 || write_node(f, idx->root) < 0) {
+			res = -1;
+		}
+		if (f && fclose(f) != 0) {
+			res = -1;
+		}
+	}
+	pthread_mutex_unlock(&idx->mutex);
+	if (!changes || res < 0) {
+		pthread_mutex_unlock(&idx->save_mutex);
+		free(buf);
+		return res;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmpXXXXXX", idx->file);
+	fd = mkstemp(tmp);
+	f = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+	if (!f) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		pthread_mutex_unlock(&idx->save_mutex);
+		free(buf);
+		return -1;
+	}
+	if (fwrite(buf, 1, len, f) != len) {
+		res = -1;
+	}
+	if (fclose(f) != 0) {
+		res = -1;
+	}
+	free(buf);
+	if (res == 0 && rename(tmp, idx->file) == 0) {
+		pthread_mutex_lock(&idx->mutex);
+		/* what changed while it was written is saved the next time */
+		if (idx->dirty == changes) {
+			idx->dirty = 0;
+		}
+		pthread_mutex_unlock(&idx->mutex);
+	} else {
+		unlink(tmp);
+		res = -1;
+	}
+	pthread_mutex_unlock(&idx->save_mutex);
+
+	return res;
+}
+
+/**
+ * Releases the memory used by the index. Changes that were not saved with
+ * treeindex_save() are lost.
+ */
+void treeindex_free(treeindex_t idx)
+{
+	if (!idx)
+		return;
+
+	node_free(idx->root);
+	pthread_mutex_destroy(&idx->mutex);
+	pthread_mutex_destroy(&idx->save_mutex);
+	free(idx->file);
+	free(idx);
+}
+
+/**
+ * Looks up the attributes of path. Only the uid, gid and block size are
+ * not filled in.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The path on the device.
+ * @param st Receives the attributes on a positive hit.
+ *
+ * @return 1 on a positive hit, -ENOENT if path does not exist according to
+ *    the confirmed listing of its directory, or 0 if it is not known.
+ */
+int treeindex_get_attr(treeindex_t idx, const char *path, struct stat *st)
+{
+	struct index_node *parent;
+	struct index_node *node = NULL;
+	const char *name;
+	size_t len;
+	int res = 0;
+
+	if (!idx)
+		return 0;
+
+	pthread_mutex_lock(&idx->mutex);
+	parent = lookup_parent(idx, path, &name, &len);
+	if (len == 0) {
+		node = idx->root;
+	} else if (parent && is_valid(idx, parent)) {
+		node = find_entry(parent, name, len, NULL);
+		if (!node)
+			res = -ENOENT;
+	}
+	/* a directory's own attributes are only current once it was checked,
+	 * those of a file for the timeout after they were retrieved */
+	if (node && node->mode && (S_ISDIR(node->mode) ? is_valid(idx, node) : is_fresh(idx, node))) {
+		get_attr(node, st);
+		res = 1;
+	}
+	pthread_mutex_unlock(&idx->mutex);
+
+	return res;
+}
+
+/**
+ * Returns the listing of a directory that was confirmed recently.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The directory on the device.
+ *
+ * @return The listing, including "." and "..", with a reference taken, or
+ *    NULL if the directory has to be checked or listed first.
+ */
+dirsnap_t treeindex_get_dir(treeindex_t idx, const char *path)
+{
+	struct index_node *node;
+	dirsnap_t snap = NULL;
+	char **names;
+	uint32_t i;
+
+	if (!idx)
+		return NULL;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	if (node && is_valid(idx, node)) {
+		names = malloc((node->count + 3) * sizeof(char*));
+		if (names) {
+			names[0] = (char*)".";
+			names[1] = (char*)"..";
+			for (i = 0; i < node->count; i++) {
+				names[i + 2] = node->entries[i]->name;
+			}
+			names[node->count + 2] = NULL;
+			snap = dirsnap_new(names);
+			free(names);
+		}
+	}
+	pthread_mutex_unlock(&idx->mutex);
+
+	return snap;
+}
+
+/**
+ * Checks whether the index has a listing of a directory that can be
+ * confirmed with treeindex_check_dir().
+ */
+int treeindex_listed(treeindex_t idx, const char *path)
+{
+	struct index_node *node;
+	int res;
+
+	if (!idx)
+		return 0;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	res = (node && node->listed != UNLISTED);
+	pthread_mutex_unlock(&idx->mutex);
+
+	return res;
+}
+
+/**
+ * Compares the modification time of a directory on the device with the
+ * one its indexed listing was taken at. If they match the listing and the
+ * attributes of the files in it answer lookups for the next timeout
+ * seconds.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The directory on the device.
+ * @param st The current attributes of the directory.
+ *
+ * @return 1 if the listing is current, 0 if it has to be listed again.
+ */
+int treeindex_check_dir(treeindex_t idx, const char *path, const struct stat *st)
+{
+	struct index_node *node;
+	int res = 0;
+
+	if (!idx)
+		return 0;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	if (node) {
+		if (set_attr(node, st))
+			idx->dirty++;
+		if (S_ISDIR(st->st_mode) && node->listed == (int64_t)st->st_mtime && !is_racy(st)) {
+			node->checked = now();
+			res = 1;
+		}
+	}
+	pthread_mutex_unlock(&idx->mutex);
+
+	return res;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp((*(struct index_node * const *)a)->name, (*(struct index_node * const *)b)->name);
+}
+
+/**
+ * Stores a listing of a directory taken from the device. Entries that were
+ * indexed before keep what is known below them, so their own listings can
+ * be confirmed by their modification times.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The directory on the device. It is added if its parent is
+ *    in the index, otherwise the listing is not stored.
+ * @param st The attributes of the directory, retrieved before the listing.
+ * @param names NULL terminated list of names, as returned by
+ *    afc_read_directory().
+ * @param stats The attributes of the entries in the order of names, or
+ *    NULL. An entry whose mode is 0 could not be looked up. Without stats
+ *    the entries that were indexed before keep their attributes.
+ */
+void treeindex_put_dir(treeindex_t idx, const char *path, const struct stat *st, char **names, const struct stat *stats)
+{
+	struct index_node *node;
+	struct index_node **entries;
+	char *taken;
+	uint32_t count = 0;
+	uint32_t n = 0;
+	uint32_t i;
+
+	if (!idx || !names || !S_ISDIR(st->st_mode))
+		return;
+	while (names[count])
+		count++;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	if (!node) {
+		const char *name;
+		size_t len;
+		struct index_node *parent = lookup_parent(idx, path, &name, &len);
+		uint32_t pos;
+		if (!parent || len == 0 || !(node = node_new(name, len)))
+			goto leave;
+		find_entry(parent, name, len, &pos);
+		if (parent->count == parent->capacity) {
+			uint32_t capacity = (parent->capacity) ? 2 * parent->capacity : 8;
+			struct index_node **grown = realloc(parent->entries, capacity * sizeof(struct index_node*));
+			if (!grown) {
+				node_free(node);
+				goto leave;
+			}
+			parent->entries = grown;
+			parent->capacity = capacity;
+		}
+		memmove(&parent->entries[pos + 1], &parent->entries[pos], (parent->count - pos) * sizeof(struct index_node*));
+		parent->entries[pos] = node;
+		parent->count++;
+		/* the listing of the parent did not have it */
+		parent->listed = UNLISTED;
+		parent->checked = 0;
+	}
+
+	entries = malloc((count + 1) * sizeof(struct index_node*));
+	taken = calloc(node->count + 1, 1);
+	if (!entries || !taken) {
+		free(entries);
+		free(taken);
+		goto leave;
+	}
+	for (i = 0; i < count; i++) {
+		struct index_node *entry;
+		size_t len = strlen(names[i]);
+		uint32_t pos;
+
+		if (!strcmp(names[i], ".") || !strcmp(names[i], "..") || len == 0 || strchr(names[i], '/'))
+			continue;
+		entry = find_entry(node, names[i], len, &pos);
+		if (entry && !taken[pos]) {
+			taken[pos] = 1;
+		} else {
+			entry = node_new(names[i], len);
+			if (!entry)
+				continue;
+		}
+		if (stats && stats[i].st_mode) {
+			set_attr(entry, &stats[i]);
+		} else if (stats) {
+			entry->mode = 0;
+		}
+		entries[n++] = entry;
+	}
+	for (i = 0; i < node->count; i++) {
+		if (!taken[i]) {
+			node_free(node->entries[i]);
+		}
+	}
+	free(taken);
+	free(node->entries);
+	qsort(entries, n, sizeof(struct index_node*), compare_entries);
+	node->entries = entries;
+	node->count = n;
+	node->capacity = count + 1;
+
+	set_attr(node, st);
+	node->listed = (is_racy(st)) ? UNLISTED : (int64_t)st->st_mtime;
+	node->checked = now();
+	idx->dirty++;
+
+leave:
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+/**
+ * Updates the attributes of an indexed entry after they were retrieved
+ * from the device.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The path on the device.
+ * @param st The attributes.
+ */
+void treeindex_put_attr(treeindex_t idx, const char *path, const struct stat *st)
+{
+	struct index_node *parent;
+	struct index_node *node = NULL;
+	const char *name;
+	size_t len;
+
+	if (!idx)
+		return;
+
+	pthread_mutex_lock(&idx->mutex);
+	parent = lookup_parent(idx, path, &name, &len);
+	if (len == 0) {
+		node = idx->root;
+	} else if (parent) {
+		node = find_entry(parent, name, len, NULL);
+		if (!node && parent->listed != UNLISTED) {
+			/* it was created after the parent was listed */
+			parent->listed = UNLISTED;
+			parent->checked = 0;
+			idx->dirty++;
+		}
+	}
+	if (node && set_attr(node, st)) {
+		idx->dirty++;
+	}
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+/**
+ * Lists the indexed subdirectories of a directory.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The directory on the device.
+ *
+ * @return NULL terminated list of the paths of the subdirectories, which
+ *    has to be freed along with the paths, or NULL if there are none.
+ */
+char **treeindex_subdirs(treeindex_t idx, const char *path)
+{
+	struct index_node *node;
+	char **dirs = NULL;
+	size_t plen = strlen(path);
+	uint32_t n = 0;
+	uint32_t i;
+
+	if (!idx)
+		return NULL;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	if (node && node->count > 0) {
+		dirs = calloc(node->count + 1, sizeof(char*));
+	}
+	for (i = 0; dirs && i < node->count; i++) {
+		struct index_node *entry = node->entries[i];
+		size_t nlen = strlen(entry->name);
+		char *sub;
+
+		if (!S_ISDIR(entry->mode))
+			continue;
+		sub = malloc(plen + nlen + 2);
+		if (!sub)
+			break;
+		memcpy(sub, path, plen);
+		sub[plen] = '/';
+		memcpy(sub + plen + ((plen > 0 && path[plen - 1] == '/') ? 0 : 1), entry->name, nlen + 1);
+		dirs[n++] = sub;
+	}
+	pthread_mutex_unlock(&idx->mutex);
+
+	if (dirs && n == 0) {
+		free(dirs);
+		dirs = NULL;
+	}
+
+	return dirs;
+}
+
+/**
+ * Forgets the attributes of path after it was changed through this mount,
+ * and that the listings of it and of its parent were confirmed. Everything
+ * below path has to be checked again, too.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The path on the device.
+ */
+void treeindex_invalidate(treeindex_t idx, const char *path)
+{
+	struct index_node *parent;
+	struct index_node *node;
+	const char *name;
+	size_t len;
+
+	if (!idx)
+		return;
+
+	pthread_mutex_lock(&idx->mutex);
+	parent = lookup_parent(idx, path, &name, &len);
+	if (len == 0) {
+		node = idx->root;
+	} else if (parent) {
+		parent->listed = UNLISTED;
+		parent->checked = 0;
+		node = find_entry(parent, name, len, NULL);
+		idx->dirty++;
+	} else {
+		node = NULL;
+	}
+	if (node) {
+		uncheck_tree(node);
+		if (node != idx->root) {
+			node->mode = 0;
+		}
+		idx->dirty++;
+	}
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+/**
+ * Forgets the attributes of path after its content or attributes were
+ * changed through this mount. Unlike treeindex_invalidate() the listing of
+ * its directory stays confirmed, since no entry was added or removed.
+ *
+ * @param idx The index, can be NULL.
+ * @param path The path on the device.
+ */
+void treeindex_invalidate_attr(treeindex_t idx, const char *path)
+{
+	struct index_node *node;
+
+	if (!idx)
+		return;
+
+	pthread_mutex_lock(&idx->mutex);
+	node = lookup(idx, path);
+	if (node && node != idx->root && node->mode && !S_ISDIR(node->mode)) {
+		node->mode = 0;
+		idx->dirty++;
+	}
+	pthread_mutex_unlock(&idx->mutex);
+}
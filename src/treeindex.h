@@ -0,0 +1,49 @@
+/*
+ * treeindex.h
+ * Persistent index of the whole directory tree of a device.
+ *
+ * Copyright (c) 2026 ifuse contributors All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TREEINDEX_H
+#define __TREEINDEX_H
+
+#include <sys/stat.h>
+
+#include "dirsnap.h"
+
+/* default time in seconds a directory is trusted after its modification
+ * time was compared with the device */
+#define TREEINDEX_DEFAULT_TIMEOUT 60.0
+
+typedef struct treeindex *treeindex_t;
+
+treeindex_t treeindex_open(const char *file, double timeout);
+int treeindex_save(treeindex_t idx);
+void treeindex_free(treeindex_t idx);
+
+int treeindex_get_attr(treeindex_t idx, const char *path, struct stat *st);
+dirsnap_t treeindex_get_dir(treeindex_t idx, const char *path);
+int treeindex_listed(treeindex_t idx, const char *path);
+int treeindex_check_dir(treeindex_t idx, const char *path, const struct stat *st);
+void treeindex_put_dir(treeindex_t idx, const char *path, const struct stat *st, char **names, const struct stat *stats);
+void treeindex_put_attr(treeindex_t idx, const char *path, const struct stat *st);
+char **treeindex_subdirs(treeindex_t idx, const char *path);
+void treeindex_invalidate(treeindex_t idx, const char *path);
+void treeindex_invalidate_attr(treeindex_t idx, const char *path);
+
+#endif